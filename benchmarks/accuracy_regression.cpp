@@ -0,0 +1,477 @@
+/*
+Guards the fast execution modes of the library against accuracy regressions.
+The model is run on a fixed set of inputs stored in HDF5 once as the reference
+(default algorithms) and once per mode. For every mode the report has the max
+and mean absolute deviation from the reference outputs, the agreement of
+the top-1 classes (per image, or per pixel for segmentation models) and the
+speedup. The program fails (exit code 1) if a mode deviates more than the
+tolerance, so new fast paths can be turned on with confidence.
+
+If the input file doesn't exist, random inputs are generated and saved to it,
+so the following runs use the same ones. Without a checkpoint random weights
+are used.
+
+./accuracy_regression --model resnet50_imagenet --weights ../resnet50_imagenet.h5 \
+    --inputs resnet50_inputs.h5 --tolerance winograd_2x2_3x3=5e-3 --output accuracy.json
+
+Modes: one per convolution algorithm (forced where it's applicable), tuned
+(the fastest algorithms chosen by ConvolutionTuner), concurrent_branches,
+packed_weights and streamed_branches (concurrent branches of a model with
+weights streamed from accuracy_streamed_weights.bin).
+
+Options:
+  --model NAME          one of benchmark::models(), default: resnet18_imagenet
+  --weights FILE        checkpoint, random weights if not given or missing
+  --inputs FILE         inputs, every dataset is N x C x H x W,
+                        default: accuracy_inputs.h5
+  --input-count N       images generated if the file doesn't exist, default: 8
+  --batch-size N        default: 1
+  --modes LIST          comma separated names, default: all
+  --max-deviation X     max absolute deviation, default: 1e-3
+  --tolerance MODE=X    max absolute deviation of one mode
+  --min-agreement X     min top-1 agreement, default: 0.99
+  --iterations N        timed runs over the inputs, default: 3
+  --output FILE         default: standard output
+*/
+
+#include "benchmark.h"
+
+using namespace at;
+
+using std::string;
+using std::vector;
+
+struct Options
+{
+	string model = "resnet18_imagenet";
+	string weights;
+	string inputs = "accuracy_inputs.h5";
+	int input_count = 8;
+	int batch_size = 1;
+	vector<string> modes;
+	double max_deviation = 1e-3;
+	map<string, double> tolerances;
+	double min_agreement = 0.99;
+	int iterations = 3;
+	string output;
+};
+
+// Execution mode which is compared with the reference. prepare() gets a
+// copy of the reference model and a sample input, enable() and disable()
+// switch the global settings of the mode around its runs.
+struct Mode
+{
+	string name;
+	std::function<void(torch::Module::Ptr & model, const Tensor & sample_input)> prepare;
+	std::function<void()> enable;
+	std::function<void()> disable;
+};
+
+vector<Mode> all_modes()
+{
+	vector<Mode> modes;
+	auto & tuner = torch::ConvolutionTuner::global();
+
+	auto nothing = []() {};
+	auto keep_model = [](torch::Module::Ptr &, const Tensor &) {};
+
+	for (int algorithm = torch::CONV_ALGORITHM_DEFAULT + 1; algorithm < torch::CONV_ALGORITHMS_COUNT; ++algorithm)
+	{
+		modes.push_back({ torch::ConvolutionTuner::algorithm_name(algorithm), keep_model,
+			[&tuner, algorithm]() { tuner.force(algorithm); },
+			[&tuner]() { tuner.force(-1); } });
+	}
+
+	modes.push_back({ "tuned", keep_model,
+		[&tuner]() { tuner.enable(); },
+		[&tuner]() { tuner.disable(); } });
+
+	modes.push_back({ "concurrent_branches", [](torch::Module::Ptr & model, const Tensor &)
+	{
+		auto config = std::make_shared<torch::ExecutionConfig>();
+
+		config->concurrent_branches = true;
+		model->set_execution_config(config);
+	},
+	nothing, nothing });
+
+	modes.push_back({ "packed_weights", [](torch::Module::Ptr & model, const Tensor & sample_input)
+	{
+		model->pack_weights(sample_input);
+	},
+	nothing, nothing });
+
+	// Downsample branches run on the workers of the pool, which have
+	// to prefetch and release the streamed weights too
+	modes.push_back({ "streamed_branches", [](torch::Module::Ptr & model, const Tensor & sample_input)
+	{
+		auto config = std::make_shared<torch::ExecutionConfig>();
+
+		config->concurrent_branches = true;
+		model->set_execution_config(config);
+
+		model->pack_weights(sample_input);
+		model->stream_weights("accuracy_streamed_weights.bin");
+	},
+	nothing, nothing });
+
+	return modes;
+}
+
+// Splits the input tensors into batches
+vector<Tensor> load_inputs(const Options & options, const vector<int64_t> & input_sizes)
+{
+	if (!std::ifstream(options.inputs).good())
+	{
+		vector<int64_t> sizes = { options.input_count };
+
+		sizes.insert(sizes.end(), input_sizes.begin(), input_sizes.end());
+
+		map<string, Tensor> generated;
+
+		generated["inputs"] = CPU(kFloat).rand(sizes);
+		torch::save(options.inputs, generated);
+
+		std::cerr << "Generated " << options.input_count << " inputs in '" << options.inputs << "'." << endl;
+	}
+
+	vector<Tensor> batches;
+
+	for (auto & name_tensor_pair : torch::load(options.inputs))
+	{
+		auto & inputs = name_tensor_pair.second;
+
+		for (int64_t start = 0; start < inputs.size(0); start += options.batch_size)
+		{
+			int64_t length = std::min(int64_t(options.batch_size), inputs.size(0) - start);
+
+			batches.push_back(inputs.narrow(0, start, length).contiguous());
+		}
+	}
+
+	if (batches.empty())
+	{
+		throw std::runtime_error("no inputs in '" + options.inputs + "'");
+	}
+
+	return batches;
+}
+
+// Outputs for all the batches and the median time of a run over all of them
+vector<Tensor> run_model(const torch::Module::Ptr & model, const vector<Tensor> & batches, int iterations, double & time_ms)
+{
+	vector<Tensor> outputs;
+
+	// Warmup, also tunes the convolutions in the tuned mode
+	for (auto & batch : batches)
+	{
+		outputs.push_back(model->forward(batch).toBackend(Backend::CPU).contiguous());
+	}
+
+	auto latencies_ms = benchmark::measure([&]()
+	{
+		for (auto & batch : batches)
+		{
+			model->forward(batch);
+		}
+	}, 0, std::max(iterations, 1));
+
+	time_ms = benchmark::percentile(latencies_ms, 0.5);
+
+	return outputs;
+}
+
+// Index of the largest channel for every image and spatial position
+vector<int64_t> top1_classes(const Tensor & output)
+{
+	int64_t batch_size = output.size(0);
+	int64_t channels = output.size(1);
+	int64_t positions = output.numel() / std::max(batch_size * channels, int64_t(1));
+
+	const float * data = output.data<float>();
+	vector<int64_t> classes;
+
+	for (int64_t n = 0; n < batch_size; ++n)
+	{
+		for (int64_t position = 0; position < positions; ++position)
+		{
+			const float * values = data + n * channels * positions + position;
+			int64_t best = 0;
+
+			for (int64_t channel = 1; channel < channels; ++channel)
+			{
+				if (values[channel * positions] > values[best * positions])
+				{
+					best = channel;
+				}
+			}
+
+			classes.push_back(best);
+		}
+	}
+
+	return classes;
+}
+
+struct Comparison
+{
+	double max_deviation = 0;
+	double mean_deviation = 0;
+	double top1_agreement = 1;
+};
+
+Comparison compare_outputs(const vector<Tensor> & reference, const vector<Tensor> & outputs)
+{
+	Comparison comparison;
+
+	double deviation_sum = 0;
+	int64_t elements_count = 0;
+	int64_t agreeing_count = 0;
+	int64_t classes_count = 0;
+
+	for (size_t i = 0; i < reference.size(); ++i)
+	{
+		if (!reference[i].sizes().equals(outputs[i].sizes()))
+		{
+			throw std::runtime_error("outputs of the mode have different sizes than the reference ones");
+		}
+
+		const float * reference_data = reference[i].data<float>();
+		const float * output_data = outputs[i].data<float>();
+
+		for (int64_t j = 0; j < reference[i].numel(); ++j)
+		{
+			double deviation = std::abs(double(reference_data[j]) - double(output_data[j]));
+
+			// NaN has to fail the comparison
+			if (!(deviation <= comparison.max_deviation))
+			{
+				comparison.max_deviation = std::isnan(deviation) ? deviation : std::max(comparison.max_deviation, deviation);
+			}
+
+			deviation_sum += deviation;
+		}
+
+		elements_count += reference[i].numel();
+
+		auto reference_classes = top1_classes(reference[i]);
+		auto output_classes = top1_classes(outputs[i]);
+
+		for (size_t j = 0; j < reference_classes.size(); ++j)
+		{
+			agreeing_count += (reference_classes[j] == output_classes[j]);
+		}
+
+		classes_count += reference_classes.size();
+	}
+
+	comparison.mean_deviation = deviation_sum / std::max(elements_count, int64_t(1));
+	comparison.top1_agreement = double(agreeing_count) / std::max(classes_count, int64_t(1));
+
+	return comparison;
+}
+
+Options parse_options(int argc, char * argv[])
+{
+	Options options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		string argument = argv[i];
+
+		if (i + 1 >= argc)
+		{
+			throw std::runtime_error("option '" + argument + "' needs a value");
+		}
+
+		string value = argv[++i];
+
+		if (argument == "--model")
+		{
+			options.model = value;
+		}
+		else if (argument == "--weights")
+		{
+			options.weights = value;
+		}
+		else if (argument == "--inputs")
+		{
+			options.inputs = value;
+		}
+		else if (argument == "--input-count")
+		{
+			options.input_count = std::atoi(value.c_str());
+		}
+		else if (argument == "--batch-size")
+		{
+			options.batch_size = std::max(std::atoi(value.c_str()), 1);
+		}
+		else if (argument == "--modes")
+		{
+			std::istringstream stream(value);
+			string mode;
+
+			while (std::getline(stream, mode, ','))
+			{
+				options.modes.push_back(mode);
+			}
+		}
+		else if (argument == "--max-deviation")
+		{
+			options.max_deviation = std::atof(value.c_str());
+		}
+		else if (argument == "--tolerance")
+		{
+			auto separator = value.find('=');
+
+			if (separator == string::npos)
+			{
+				throw std::runtime_error("--tolerance needs MODE=VALUE, got '" + value + "'");
+			}
+
+			options.tolerances[value.substr(0, separator)] = std::atof(value.c_str() + separator + 1);
+		}
+		else if (argument == "--min-agreement")
+		{
+			options.min_agreement = std::atof(value.c_str());
+		}
+		else if (argument == "--iterations")
+		{
+			options.iterations = std::atoi(value.c_str());
+		}
+		else if (argument == "--output")
+		{
+			options.output = value;
+		}
+		else
+		{
+			throw std::runtime_error("unknown option '" + argument + "'");
+		}
+	}
+
+	// A misspelled mode would run nothing and pass
+	auto modes = all_modes();
+
+	for (auto & name : options.modes)
+	{
+		auto known = std::find_if(modes.begin(), modes.end(), [&name](const Mode & mode) { return mode.name == name; });
+
+		if (known == modes.end())
+		{
+			string names;
+
+			for (auto & mode : modes)
+			{
+				names += (names.empty() ? "" : ", ") + mode.name;
+			}
+
+			throw std::runtime_error("unknown mode '" + name + "', the modes are: " + names);
+		}
+	}
+
+	return options;
+}
+
+int main(int argc, char * argv[])
+{
+	try
+	{
+		Options options = parse_options(argc, argv);
+
+		torch::set_default_type(CPU(kFloat));
+
+		auto model_factory = benchmark::find_model(options.model);
+		auto reference_model = benchmark::create_model(model_factory, options.weights);
+		auto batches = load_inputs(options, model_factory.input_sizes);
+
+		// Reference convolutions use the default algorithm. Being forced, the
+		// layers don't remember it, so the copies of the model are not tuned.
+		double reference_time_ms;
+
+		torch::ConvolutionTuner::global().force(torch::CONV_ALGORITHM_DEFAULT);
+
+		auto reference_outputs = run_model(reference_model, batches, options.iterations, reference_time_ms);
+
+		torch::ConvolutionTuner::global().force(-1);
+
+		vector<string> mode_reports;
+		bool all_passed = true;
+
+		for (auto & mode : all_modes())
+		{
+			if (!options.modes.empty() &&
+				std::find(options.modes.begin(), options.modes.end(), mode.name) == options.modes.end())
+			{
+				continue;
+			}
+
+			auto model = reference_model->clone();
+
+			mode.prepare(model, batches[0]);
+
+			double time_ms;
+			vector<Tensor> outputs;
+
+			mode.enable();
+
+			try
+			{
+				outputs = run_model(model, batches, options.iterations, time_ms);
+			}
+			catch (...)
+			{
+				mode.disable();
+				throw;
+			}
+
+			mode.disable();
+
+			auto comparison = compare_outputs(reference_outputs, outputs);
+
+			auto tolerance_entry = options.tolerances.find(mode.name);
+			double tolerance = (tolerance_entry == options.tolerances.end()) ? options.max_deviation : tolerance_entry->second;
+
+			bool passed = comparison.max_deviation <= tolerance && comparison.top1_agreement >= options.min_agreement;
+
+			all_passed = all_passed && passed;
+
+			benchmark::JsonObject mode_report;
+
+			mode_report.add("mode", mode.name)
+				.add("max_deviation", comparison.max_deviation)
+				.add("mean_deviation", comparison.mean_deviation)
+				.add("top1_agreement", comparison.top1_agreement)
+				.add("time_ms", time_ms)
+				.add("speedup", (time_ms > 0) ? reference_time_ms / time_ms : 0.0)
+				.add("tolerance", tolerance)
+				.add("passed", passed);
+
+			mode_reports.push_back(mode_report.str(2));
+
+			std::cerr << (passed ? "PASSED " : "FAILED ") << mode.name << ": max deviation " << comparison.max_deviation
+				<< ", top-1 agreement " << comparison.top1_agreement
+				<< ", speedup " << reference_time_ms / time_ms << endl;
+		}
+
+		benchmark::JsonObject report;
+
+		report.add("cpu", torch::ConvolutionTuner::global().cpu_model())
+			.add("model", options.model)
+			.add("inputs", options.inputs)
+			.add("batches", int(batches.size()))
+			.add("reference_time_ms", reference_time_ms)
+			.add("min_agreement", options.min_agreement)
+			.add("passed", all_passed)
+			.add_json("modes", benchmark::json_array(mode_reports, 1));
+
+		benchmark::write_report(options.output, report.str());
+
+		return all_passed ? 0 : 1;
+	}
+	catch (const std::exception & error)
+	{
+		std::cerr << "ERROR: " << error.what() << endl;
+
+		return 1;
+	}
+}
@@ -0,0 +1,359 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+// Helpers shared by the benchmark programs: timing, statistics,
+// command line lists, random weights and JSON output.
+
+#include <pytorch.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+namespace benchmark
+{
+	// Runs the function warmup times without measuring it,
+	// then returns the duration of every run in milliseconds
+	inline vector<double> measure(const std::function<void()> & function, int warmup, int iterations)
+	{
+		for (int i = 0; i < warmup; ++i)
+		{
+			function();
+		}
+
+		vector<double> latencies_ms;
+
+		latencies_ms.reserve(iterations);
+
+		for (int i = 0; i < iterations; ++i)
+		{
+			auto start = std::chrono::steady_clock::now();
+
+			function();
+
+			auto end = std::chrono::steady_clock::now();
+
+			latencies_ms.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+		}
+
+		return latencies_ms;
+	}
+
+	// Nearest-rank percentile, fraction is in [0, 1]
+	inline double percentile(vector<double> values, double fraction)
+	{
+		if (values.empty())
+		{
+			return 0;
+		}
+
+		std::sort(values.begin(), values.end());
+
+		size_t rank = size_t(std::ceil(fraction * values.size()));
+
+		return values[(rank == 0) ? 0 : rank - 1];
+	}
+
+	inline double mean(const vector<double> & values)
+	{
+		double sum = 0;
+
+		for (auto value : values)
+		{
+			sum += value;
+		}
+
+		return values.empty() ? 0 : sum / values.size();
+	}
+
+	inline string json_escape(const string & text)
+	{
+		string escaped;
+
+		for (char character : text)
+		{
+			switch (character)
+			{
+			case '"': escaped += "\\\""; break;
+			case '\\': escaped += "\\\\"; break;
+			case '\n': escaped += "\\n"; break;
+			case '\t': escaped += "\\t"; break;
+			default: escaped += character;
+			}
+		}
+
+		return escaped;
+	}
+
+	// JSON object built field by field, values which are objects
+	// or arrays themselves are added with add_json()
+	class JsonObject
+	{
+	public:
+		JsonObject & add(const string & key, const string & value)
+		{
+			return add_json(key, "\"" + json_escape(value) + "\"");
+		}
+
+		JsonObject & add(const string & key, const char * value)
+		{
+			return add(key, string(value));
+		}
+
+		JsonObject & add(const string & key, double value)
+		{
+			std::ostringstream text;
+
+			// NaN and infinity are not valid JSON
+			if (std::isfinite(value))
+			{
+				text << value;
+			}
+			else
+			{
+				text << "null";
+			}
+
+			return add_json(key, text.str());
+		}
+
+		JsonObject & add(const string & key, int64_t value)
+		{
+			return add_json(key, std::to_string(value));
+		}
+
+		JsonObject & add(const string & key, int value)
+		{
+			return add_json(key, std::to_string(value));
+		}
+
+		JsonObject & add(const string & key, bool value)
+		{
+			return add_json(key, value ? "true" : "false");
+		}
+
+		JsonObject & add_json(const string & key, const string & json)
+		{
+			fields.push_back("\"" + json_escape(key) + "\": " + json);
+
+			return *this;
+		}
+
+		string str(int indentation_level = 0) const
+		{
+			string indentation(indentation_level + 1, '\t');
+			string text = "{";
+
+			for (size_t i = 0; i < fields.size(); ++i)
+			{
+				text += (i == 0) ? "\n" : ",\n";
+				text += indentation + fields[i];
+			}
+
+			text += "\n" + string(indentation_level, '\t') + "}";
+
+			return text;
+		}
+
+	private:
+		vector<string> fields;
+	};
+
+	inline string json_array(const vector<string> & items, int indentation_level = 0)
+	{
+		string indentation(indentation_level + 1, '\t');
+		string text = "[";
+
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			text += (i == 0) ? "\n" : ",\n";
+			text += indentation + items[i];
+		}
+
+		text += "\n" + string(indentation_level, '\t') + "]";
+
+		return text;
+	}
+
+	inline string json_array(const vector<int> & items)
+	{
+		string text = "[";
+
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			text += (i == 0 ? "" : ", ") + std::to_string(items[i]);
+		}
+
+		return text + "]";
+	}
+
+	// Latency statistics of the runs, throughput is in images per second
+	inline JsonObject & add_latency_statistics(JsonObject & object, const vector<double> & latencies_ms, int batch_size)
+	{
+		double mean_ms = mean(latencies_ms);
+
+		object.add("mean_ms", mean_ms)
+			.add("min_ms", percentile(latencies_ms, 0))
+			.add("p50_ms", percentile(latencies_ms, 0.5))
+			.add("p90_ms", percentile(latencies_ms, 0.9))
+			.add("p99_ms", percentile(latencies_ms, 0.99))
+			.add("max_ms", percentile(latencies_ms, 1))
+			.add("throughput", (mean_ms > 0) ? batch_size * 1000.0 / mean_ms : 0.0);
+
+		return object;
+	}
+
+	// Parses comma separated numbers: "1,2,4"
+	inline vector<int> parse_list(const string & text)
+	{
+		vector<int> values;
+		std::istringstream stream(text);
+		string item;
+
+		while (std::getline(stream, item, ','))
+		{
+			if (!item.empty())
+			{
+				values.push_back(std::atoi(item.c_str()));
+			}
+		}
+
+		return values;
+	}
+
+	// Fills the weights with random values, so the benchmarks run without
+	// checkpoints. Running variances have to stay positive.
+	inline void randomize_weights(const torch::Module::Ptr & module)
+	{
+		map<string, Tensor> dict;
+
+		module->state_dict(dict);
+
+		for (auto & name_tensor_pair : dict)
+		{
+			Tensor tensor = name_tensor_pair.second;
+			const string & name = name_tensor_pair.first;
+
+			if (!tensor.defined())
+			{
+				continue;
+			}
+
+			bool is_variance = name.size() >= 11 && name.compare(name.size() - 11, 11, "running_var") == 0;
+
+			if (is_variance)
+			{
+				tensor.uniform_(0.5, 1.5);
+			}
+			else
+			{
+				tensor.uniform_(-0.05, 0.05);
+			}
+		}
+
+		module->weights_updated();
+	}
+
+	// Models which can be benchmarked, with the input size (one image)
+	struct ModelFactory
+	{
+		string name;
+		std::function<torch::Module::Ptr()> create;
+		vector<int64_t> input_sizes;
+	};
+
+	inline vector<ModelFactory> models()
+	{
+		// Segmentation models are run on the size of Pascal VOC images
+		return
+		{
+			{ "resnet18_imagenet", torch::resnet18_imagenet, { 3, 224, 224 } },
+			{ "resnet34_imagenet", torch::resnet34_imagenet, { 3, 224, 224 } },
+			{ "resnet50_imagenet", torch::resnet50_imagenet, { 3, 224, 224 } },
+			{ "resnet101_imagenet", torch::resnet101_imagenet, { 3, 224, 224 } },
+			{ "resnet152_imagenet", torch::resnet152_imagenet, { 3, 224, 224 } },
+			{ "resnet18_8s_pascal_voc", torch::resnet18_8s_pascal_voc, { 3, 512, 512 } },
+			{ "resnet34_8s_pascal_voc", torch::resnet34_8s_pascal_voc, { 3, 512, 512 } }
+		};
+	}
+
+	inline ModelFactory find_model(const string & name)
+	{
+		for (auto & model : models())
+		{
+			if (model.name == name)
+			{
+				return model;
+			}
+		}
+
+		throw std::runtime_error("unknown model '" + name + "'");
+	}
+
+	// Builds the model and loads the checkpoint, or fills the
+	// weights with random values if there is no checkpoint
+	inline torch::Module::Ptr create_model(const ModelFactory & model, const string & weights_filename)
+	{
+		auto module = model.create();
+		std::ifstream weights_file(weights_filename);
+
+		if (!weights_filename.empty() && weights_file.good())
+		{
+			module->load_weights(weights_filename);
+		}
+		else
+		{
+			std::cerr << "WARNING: no checkpoint for " << model.name << ", using random weights." << endl;
+
+			module->materialize();
+			randomize_weights(module);
+		}
+
+		return module;
+	}
+
+	// Resident memory of the process, 0 if it's not known
+	inline int64_t resident_memory_bytes()
+	{
+#ifdef __linux__
+		std::ifstream statm("/proc/self/statm");
+		int64_t total_pages = 0;
+		int64_t resident_pages = 0;
+
+		statm >> total_pages >> resident_pages;
+
+		return resident_pages * sysconf(_SC_PAGESIZE);
+#else
+		return 0;
+#endif
+	}
+
+	// Writes the report to the file, or to the standard output if the name is empty
+	inline void write_report(const string & filename, const string & json)
+	{
+		if (filename.empty())
+		{
+			cout << json << endl;
+			return;
+		}
+
+		std::ofstream file(filename);
+
+		file << json << endl;
+
+		if (!file)
+		{
+			throw std::runtime_error("can't write the report to '" + filename + "'");
+		}
+	}
+}
+
+#endif // !BENCHMARK_H
@@ -0,0 +1,312 @@
+/*
+Benchmarks of the layers on the shapes of ResNet and of the whole models,
+on CPU with random weights, so no checkpoints are needed. Every case is run
+for each batch size and number of threads and the results are written as JSON
+(latency percentiles and throughput in images per second):
+
+./pytorch_benchmarks --threads 1,4 --batch-sizes 1,8 --output results.json
+
+Options:
+  --layers              only the layers
+  --models              only the models
+  --threads LIST        OpenMP threads, default: 1 and all cores
+  --batch-sizes LIST    default: 1,8
+  --warmup N            runs which are not measured, default: 5
+  --iterations N        measured runs, default: 30
+  --output FILE         default: standard output
+*/
+
+#include "benchmark.h"
+
+#include <thread>
+
+using namespace at;
+
+using std::string;
+using std::vector;
+
+struct Options
+{
+	bool run_layers = true;
+	bool run_models = true;
+	vector<int> threads;
+	vector<int> batch_sizes = {1, 8};
+	int warmup = 5;
+	int iterations = 30;
+	string output;
+};
+
+struct BenchmarkCase
+{
+	string kind;
+	string name;
+	string shape;
+	std::function<torch::Module::Ptr()> create;
+
+	// Sizes of one input without the batch dimension
+	vector<int64_t> input_sizes;
+};
+
+BenchmarkCase conv_case(int in_channels, int out_channels, int kernel_size, int stride, int spatial_size)
+{
+	int padding = kernel_size / 2;
+
+	std::ostringstream shape;
+
+	shape << in_channels << "x" << spatial_size << "x" << spatial_size << " k" << kernel_size
+		<< " s" << stride << " -> " << out_channels;
+
+	return { "layer", "Conv2d", shape.str(), [=]()
+	{
+		return torch::Module::Ptr(std::make_shared<torch::Conv2d>(in_channels, out_channels,
+			kernel_size, kernel_size, stride, stride, padding, padding, 1, 1, 1, false));
+	},
+	{ in_channels, spatial_size, spatial_size } };
+}
+
+BenchmarkCase feature_map_case(const string & name, std::function<torch::Module::Ptr()> create,
+	int channels, int spatial_size)
+{
+	std::ostringstream shape;
+
+	shape << channels << "x" << spatial_size << "x" << spatial_size;
+
+	return { "layer", name, shape.str(), create, { channels, spatial_size, spatial_size } };
+}
+
+vector<BenchmarkCase> layer_cases()
+{
+	vector<BenchmarkCase> cases;
+
+	// Convolutions of ResNet on 224x224 images: the first one, 3x3 ones of
+	// every stage, strided ones which start the stages and 1x1 ones of bottlenecks
+	cases.push_back(conv_case(3, 64, 7, 2, 224));
+	cases.push_back(conv_case(64, 64, 3, 1, 56));
+	cases.push_back(conv_case(128, 128, 3, 1, 28));
+	cases.push_back(conv_case(256, 256, 3, 1, 14));
+	cases.push_back(conv_case(512, 512, 3, 1, 7));
+	cases.push_back(conv_case(64, 128, 3, 2, 56));
+	cases.push_back(conv_case(128, 256, 3, 2, 28));
+	cases.push_back(conv_case(256, 512, 3, 2, 14));
+	cases.push_back(conv_case(64, 256, 1, 1, 56));
+	cases.push_back(conv_case(256, 64, 1, 1, 56));
+	cases.push_back(conv_case(256, 512, 1, 2, 56));
+	cases.push_back(conv_case(1024, 256, 1, 1, 14));
+	cases.push_back(conv_case(512, 2048, 1, 1, 7));
+
+	for (auto & channels_size : vector<pair<int, int>>{ {64, 112}, {256, 56}, {512, 28}, {1024, 14}, {2048, 7} })
+	{
+		int channels = channels_size.first;
+
+		cases.push_back(feature_map_case("BatchNorm2d", [channels]()
+		{
+			return torch::Module::Ptr(std::make_shared<torch::BatchNorm2d>(channels));
+		}, channels, channels_size.second));
+	}
+
+	for (auto & channels_size : vector<pair<int, int>>{ {64, 112}, {256, 56}, {2048, 7} })
+	{
+		cases.push_back(feature_map_case("ReLU", []()
+		{
+			return torch::Module::Ptr(std::make_shared<torch::ReLU>());
+		}, channels_size.first, channels_size.second));
+
+		cases.push_back(feature_map_case("CReLU", []()
+		{
+			return torch::Module::Ptr(std::make_shared<torch::CReLU>());
+		}, channels_size.first, channels_size.second));
+	}
+
+	cases.push_back(feature_map_case("MaxPool2d", []()
+	{
+		return torch::Module::Ptr(std::make_shared<torch::MaxPool2d>(3, 3, 2, 2, 1, 1));
+	}, 64, 112));
+
+	cases.push_back(feature_map_case("AvgPool2d", []()
+	{
+		return torch::Module::Ptr(std::make_shared<torch::AvgPool2d>(7, 7));
+	}, 2048, 7));
+
+	for (int in_features : {512, 2048})
+	{
+		cases.push_back({ "layer", "Linear", std::to_string(in_features) + " -> 1000", [in_features]()
+		{
+			return torch::Module::Ptr(std::make_shared<torch::Linear>(in_features, 1000));
+		},
+		{ in_features } });
+	}
+
+	return cases;
+}
+
+vector<BenchmarkCase> model_cases()
+{
+	vector<BenchmarkCase> cases;
+
+	for (auto & model : benchmark::models())
+	{
+		std::ostringstream shape;
+
+		shape << model.input_sizes[0] << "x" << model.input_sizes[1] << "x" << model.input_sizes[2];
+
+		cases.push_back({ "model", model.name, shape.str(), model.create, model.input_sizes });
+	}
+
+	return cases;
+}
+
+void run_case(const BenchmarkCase & benchmark_case, const Options & options, vector<string> & results)
+{
+	auto module = benchmark_case.create();
+
+	benchmark::randomize_weights(module);
+
+	for (int batch_size : options.batch_sizes)
+	{
+		vector<int64_t> sizes = { batch_size };
+
+		sizes.insert(sizes.end(), benchmark_case.input_sizes.begin(), benchmark_case.input_sizes.end());
+
+		Tensor input = CPU(kFloat).rand(sizes);
+
+		for (int threads : options.threads)
+		{
+			auto config = std::make_shared<torch::ExecutionConfig>();
+
+			config->num_threads = threads;
+
+			vector<double> latencies_ms;
+
+			{
+				torch::ExecutionGuard guard(config);
+
+				latencies_ms = benchmark::measure([&]()
+				{
+					module->forward(input);
+				}, options.warmup, options.iterations);
+			}
+
+			benchmark::JsonObject result;
+
+			result.add("kind", benchmark_case.kind)
+				.add("name", benchmark_case.name)
+				.add("shape", benchmark_case.shape)
+				.add("batch_size", batch_size)
+				.add("threads", threads);
+
+			benchmark::add_latency_statistics(result, latencies_ms, batch_size);
+
+			results.push_back(result.str(2));
+
+			// Progress goes to stderr, the report may be written to stdout
+			std::cerr << benchmark_case.name << " " << benchmark_case.shape << " batch " << batch_size
+				<< " threads " << threads << ": " << benchmark::percentile(latencies_ms, 0.5) << " ms" << endl;
+		}
+	}
+}
+
+Options parse_options(int argc, char * argv[])
+{
+	Options options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		string argument = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (argument == "--layers")
+		{
+			options.run_models = false;
+		}
+		else if (argument == "--models")
+		{
+			options.run_layers = false;
+		}
+		else if (argument == "--threads" && has_value)
+		{
+			options.threads = benchmark::parse_list(argv[++i]);
+		}
+		else if (argument == "--batch-sizes" && has_value)
+		{
+			options.batch_sizes = benchmark::parse_list(argv[++i]);
+		}
+		else if (argument == "--warmup" && has_value)
+		{
+			options.warmup = std::atoi(argv[++i]);
+		}
+		else if (argument == "--iterations" && has_value)
+		{
+			options.iterations = std::atoi(argv[++i]);
+		}
+		else if (argument == "--output" && has_value)
+		{
+			options.output = argv[++i];
+		}
+		else
+		{
+			throw std::runtime_error("unknown option '" + argument + "'");
+		}
+	}
+
+	if (options.threads.empty())
+	{
+		int cores = int(std::thread::hardware_concurrency());
+
+		options.threads.push_back(1);
+
+		if (cores > 1)
+		{
+			options.threads.push_back(cores);
+		}
+	}
+
+	return options;
+}
+
+int main(int argc, char * argv[])
+{
+	try
+	{
+		Options options = parse_options(argc, argv);
+
+		// Layers and models are built on CPU
+		torch::set_default_type(CPU(kFloat));
+
+		vector<string> results;
+
+		if (options.run_layers)
+		{
+			for (auto & benchmark_case : layer_cases())
+			{
+				run_case(benchmark_case, options, results);
+			}
+		}
+
+		if (options.run_models)
+		{
+			for (auto & benchmark_case : model_cases())
+			{
+				run_case(benchmark_case, options, results);
+			}
+		}
+
+		benchmark::JsonObject report;
+
+		report.add("cpu", torch::ConvolutionTuner::global().cpu_model())
+			.add("warmup", options.warmup)
+			.add("iterations", options.iterations)
+			.add_json("threads", benchmark::json_array(options.threads))
+			.add_json("batch_sizes", benchmark::json_array(options.batch_sizes))
+			.add_json("results", benchmark::json_array(results, 1));
+
+		benchmark::write_report(options.output, report.str());
+	}
+	catch (const std::exception & error)
+	{
+		std::cerr << "ERROR: " << error.what() << endl;
+
+		return 1;
+	}
+
+	return 0;
+}
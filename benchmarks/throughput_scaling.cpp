@@ -0,0 +1,378 @@
+/*
+Finds out whether a model gives more images per second as one instance with
+many OpenMP threads or as many instances with few threads each. Every
+combination of instances x threads x batch size is run for a fixed time:
+instances are deep copies of the model, each one runs forward passes in a
+loop on its own thread and, on Linux, is pinned to its own cores. The report
+has throughput, p50/p99 latency and resident memory per configuration and
+marks the best one -- the one with the highest throughput whose p99 latency
+is within --max-p99-ms, if given. Without a checkpoint random weights are used.
+Memory freed by a configuration stays resident, so the growth of the resident
+memory during each configuration is reported next to the absolute value.
+
+./throughput_scaling --model resnet50_imagenet --weights ../resnet50_imagenet.h5 \
+    --instances 1,2,4 --threads 1,2,4 --batch-sizes 1,8 --output scaling.json
+
+Options:
+  --model NAME          one of benchmark::models(), default: resnet18_imagenet
+  --weights FILE        checkpoint, random weights if not given or missing
+  --instances LIST      default: 1,2,4
+  --threads LIST        OpenMP threads per instance, default: 1,2,4
+  --batch-sizes LIST    default: 1
+  --duration SECONDS    measured time per configuration, default: 5
+  --warmup N            runs of every instance before measuring, default: 3
+  --max-p99-ms MS       latency limit for the best configuration
+  --output FILE         default: standard output
+*/
+
+#include "benchmark.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+using namespace at;
+
+using std::string;
+using std::vector;
+
+struct Options
+{
+	string model = "resnet18_imagenet";
+	string weights;
+	vector<int> instances = {1, 2, 4};
+	vector<int> threads = {1, 2, 4};
+	vector<int> batch_sizes = {1};
+	double duration_seconds = 5;
+	int warmup = 3;
+	double max_p99_ms = 0;
+	string output;
+};
+
+struct ConfigurationResult
+{
+	int instances;
+	int threads;
+	int batch_size;
+	double throughput;
+	double p50_ms;
+	double p99_ms;
+	int64_t resident_bytes;
+
+	// Growth of the resident memory while the configuration ran. Memory
+	// freed by the previous configurations stays resident, so the
+	// absolute value only grows from row to row.
+	int64_t added_resident_bytes;
+	bool oversubscribed;
+};
+
+ConfigurationResult run_configuration(const torch::Module::Ptr & model, const vector<int64_t> & input_sizes,
+	int instances_count, int threads_count, int batch_size, const Options & options)
+{
+	const int cores = std::max(int(std::thread::hardware_concurrency()), 1);
+
+	int64_t initial_resident_bytes = benchmark::resident_memory_bytes();
+
+	// Instances share nothing but the code, the first one is the model itself
+	vector<torch::Module::Ptr> instances = { model };
+
+	for (int i = 1; i < instances_count; ++i)
+	{
+		instances.push_back(model->clone());
+	}
+
+	vector<int64_t> sizes = { batch_size };
+
+	sizes.insert(sizes.end(), input_sizes.begin(), input_sizes.end());
+
+	std::atomic<int> ready_count(0);
+	std::atomic<bool> started(false);
+	std::atomic<bool> stopped(false);
+
+	std::mutex latencies_mutex;
+	vector<double> latencies_ms;
+	std::atomic<int64_t> images_count(0);
+
+	// First exception of the workers, rethrown after they are joined
+	string error;
+
+	vector<std::thread> workers;
+
+	for (int i = 0; i < instances_count; ++i)
+	{
+		auto config = std::make_shared<torch::ExecutionConfig>();
+
+		config->num_threads = threads_count;
+
+		// Disjoint cores for every instance while there are enough of them
+		if ((i + 1) * threads_count <= cores)
+		{
+			for (int thread = 0; thread < threads_count; ++thread)
+			{
+				config->cpu_affinity.push_back(i * threads_count + thread);
+			}
+		}
+
+		workers.emplace_back([&, i, config]()
+		{
+			bool ready = false;
+			vector<double> instance_latencies_ms;
+
+			try
+			{
+				torch::ExecutionGuard guard(config);
+
+				auto & instance = instances[i];
+				Tensor input = CPU(kFloat).rand(sizes);
+
+				for (int run = 0; run < options.warmup; ++run)
+				{
+					instance->forward(input);
+				}
+
+				ready = true;
+				ready_count++;
+
+				while (!started)
+				{
+					std::this_thread::yield();
+				}
+
+				while (!stopped)
+				{
+					auto start = std::chrono::steady_clock::now();
+
+					instance->forward(input);
+
+					auto end = std::chrono::steady_clock::now();
+
+					instance_latencies_ms.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+					images_count += batch_size;
+				}
+			}
+			catch (const std::exception & exception)
+			{
+				std::lock_guard<std::mutex> lock(latencies_mutex);
+
+				if (error.empty())
+				{
+					error = "instance " + std::to_string(i) + ": " + exception.what();
+				}
+			}
+
+			// The main thread doesn't wait for a failed instance forever
+			if (!ready)
+			{
+				ready_count++;
+			}
+
+			std::lock_guard<std::mutex> lock(latencies_mutex);
+
+			latencies_ms.insert(latencies_ms.end(), instance_latencies_ms.begin(), instance_latencies_ms.end());
+		});
+	}
+
+	while (ready_count < instances_count)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto deadline = start + std::chrono::duration<double>(options.duration_seconds);
+
+	started = true;
+
+	// Peak of the resident memory while all instances run
+	int64_t resident_bytes = benchmark::resident_memory_bytes();
+
+	while (std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+		resident_bytes = std::max(resident_bytes, benchmark::resident_memory_bytes());
+	}
+
+	stopped = true;
+
+	for (auto & worker : workers)
+	{
+		worker.join();
+	}
+
+	if (!error.empty())
+	{
+		throw std::runtime_error(std::to_string(instances_count) + " instances x " +
+			std::to_string(threads_count) + " threads failed, " + error);
+	}
+
+	double elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	ConfigurationResult result;
+
+	result.instances = instances_count;
+	result.threads = threads_count;
+	result.batch_size = batch_size;
+	result.throughput = images_count / elapsed_seconds;
+	result.p50_ms = benchmark::percentile(latencies_ms, 0.5);
+	result.p99_ms = benchmark::percentile(latencies_ms, 0.99);
+	result.resident_bytes = resident_bytes;
+	result.added_resident_bytes = std::max(resident_bytes - initial_resident_bytes, int64_t(0));
+	result.oversubscribed = instances_count * threads_count > cores;
+
+	return result;
+}
+
+Options parse_options(int argc, char * argv[])
+{
+	Options options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		string argument = argv[i];
+
+		if (i + 1 >= argc)
+		{
+			throw std::runtime_error("option '" + argument + "' needs a value");
+		}
+
+		string value = argv[++i];
+
+		if (argument == "--model")
+		{
+			options.model = value;
+		}
+		else if (argument == "--weights")
+		{
+			options.weights = value;
+		}
+		else if (argument == "--instances")
+		{
+			options.instances = benchmark::parse_list(value);
+		}
+		else if (argument == "--threads")
+		{
+			options.threads = benchmark::parse_list(value);
+		}
+		else if (argument == "--batch-sizes")
+		{
+			options.batch_sizes = benchmark::parse_list(value);
+		}
+		else if (argument == "--duration")
+		{
+			options.duration_seconds = std::atof(value.c_str());
+		}
+		else if (argument == "--warmup")
+		{
+			options.warmup = std::atoi(value.c_str());
+		}
+		else if (argument == "--max-p99-ms")
+		{
+			options.max_p99_ms = std::atof(value.c_str());
+		}
+		else if (argument == "--output")
+		{
+			options.output = value;
+		}
+		else
+		{
+			throw std::runtime_error("unknown option '" + argument + "'");
+		}
+	}
+
+	return options;
+}
+
+int main(int argc, char * argv[])
+{
+	try
+	{
+		Options options = parse_options(argc, argv);
+
+		torch::set_default_type(CPU(kFloat));
+
+		auto model_factory = benchmark::find_model(options.model);
+		auto model = benchmark::create_model(model_factory, options.weights);
+
+		vector<ConfigurationResult> results;
+
+		for (int batch_size : options.batch_sizes)
+		{
+			for (int instances_count : options.instances)
+			{
+				for (int threads_count : options.threads)
+				{
+					auto result = run_configuration(model, model_factory.input_sizes,
+						instances_count, threads_count, batch_size, options);
+
+					std::cerr << instances_count << " instances x " << threads_count << " threads, batch "
+						<< batch_size << ": " << result.throughput << " images/s, p99 "
+						<< result.p99_ms << " ms, +" << result.added_resident_bytes / double(1 << 20) << " MB" << endl;
+
+					results.push_back(result);
+				}
+			}
+		}
+
+		int best = -1;
+
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			bool within_limit = options.max_p99_ms <= 0 || results[i].p99_ms <= options.max_p99_ms;
+
+			if (within_limit && (best < 0 || results[i].throughput > results[best].throughput))
+			{
+				best = int(i);
+			}
+		}
+
+		vector<string> configurations;
+
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			auto & result = results[i];
+			benchmark::JsonObject configuration;
+
+			configuration.add("instances", result.instances)
+				.add("threads", result.threads)
+				.add("batch_size", result.batch_size)
+				.add("throughput", result.throughput)
+				.add("p50_ms", result.p50_ms)
+				.add("p99_ms", result.p99_ms)
+				.add("resident_mb", result.resident_bytes / double(1 << 20))
+				.add("added_resident_mb", result.added_resident_bytes / double(1 << 20))
+				.add("oversubscribed", result.oversubscribed)
+				.add("best", int(i) == best);
+
+			configurations.push_back(configuration.str(2));
+		}
+
+		benchmark::JsonObject report;
+
+		report.add("cpu", torch::ConvolutionTuner::global().cpu_model())
+			.add("model", options.model)
+			.add("random_weights", options.weights.empty() || !std::ifstream(options.weights).good())
+			.add("duration_seconds", options.duration_seconds)
+			.add("max_p99_ms", options.max_p99_ms)
+			.add_json("configurations", benchmark::json_array(configurations, 1));
+
+		if (best >= 0)
+		{
+			std::cerr << "Best: " << results[best].instances << " instances x " << results[best].threads
+				<< " threads, batch " << results[best].batch_size << endl;
+		}
+		else
+		{
+			std::cerr << "WARNING: no configuration is within the latency limit." << endl;
+		}
+
+		benchmark::write_report(options.output, report.str());
+	}
+	catch (const std::exception & error)
+	{
+		std::cerr << "ERROR: " << error.what() << endl;
+
+		return 1;
+	}
+
+	return 0;
+}
@@ -20,47 +20,6 @@ using std::tie;
 
 using namespace cv;
 
-Mat resize_and_center_square_crop(Mat input_image, int square_size=224)
-{
-
-  // Resize image so that the smallest side == square_size
-  // and do a center crop along the biggest side.
-  // This way we preserve the aspect ratio and prepare the image
-  // for network.
-  
-  int width = input_image.cols,
-      height = input_image.rows;
-
-  int min_dim = ( width >= height ) ? height : width;
-  float scale = ( ( float ) square_size ) / min_dim;
-
-  resize(input_image, input_image, Size(0, 0), scale, scale, INTER_LINEAR);
-
-  Rect roi;
-
-  if ( height >= width )
-  {
-      roi.width = square_size;
-      roi.x = 0;
-
-      roi.height = square_size;
-      roi.y = ( input_image.rows - roi.height ) / 2;
-  }
-  else
-  {
-      roi.y = 0;
-      roi.height = square_size;
-
-
-      roi.width = square_size;
-      roi.x = ( input_image.cols - roi.width ) / 2;
-  }
-
-  Mat square_crop = input_image(roi);
-
-  return square_crop;
-}
-
 
 int main()
 {
@@ -77,35 +36,31 @@ int main()
       return -1;
 
   Mat frame;
-  Mat resized_img;
-  Mat tmp;
+
+  // Input and output buffers are allocated once and reused for every frame
+  Tensor input_tensor = CPU(kFloat).tensor({1, 3, 224, 224});
+  Tensor input_tensor_gpu = CUDA(kFloat).tensor({1, 3, 224, 224});
+  Tensor full_prediction;
+
+  // Resize so that the smallest side == 224, do a center crop, convert
+  // BGR to RGB which is what our network was trained on and normalize --
+  // all in one pass over the frame.
+  torch::ImagePreprocessing preprocessing;
+
+  preprocessing.pixel_format = torch::PIXEL_FORMAT_BGR;
+  preprocessing.resize_to = 224;
+  preprocessing.crop_size = 224;
   
   for(;;)
   { 
 
     cap.read(frame);
 
-    // BGR to RGB which is what our network was trained on
-    cvtColor(frame, tmp, COLOR_BGR2RGB);
-
-    // Be carefull: convert_opencv_mat_image_to_tensor() sometimes fails because
-    // of different management of underlaying image representation, this is why we
-    // do .clone()
-    // TODO: investigate it further
-    resized_img = resize_and_center_square_crop(tmp).clone();
-
-    // Outputs height x width x 3 tensor converted from Opencv's Mat with 0-255 values
-    // and convert to 0-1 range
-    auto image_tensor = torch::convert_opencv_mat_image_to_tensor(resized_img).toType(CPU(kFloat)) / 255;
-
-    // Reshape image into 1 x 3 x height x width
-    auto image_batch_tensor = torch::convert_image_to_batch(image_tensor);
-
-    auto image_batch_normalized_tensor = torch::preprocess_batch(image_batch_tensor);
+    torch::preprocess_image_out(frame.data, frame.cols, frame.rows, frame.step, input_tensor, preprocessing);
 
-    auto input_tensor_gpu = image_batch_normalized_tensor.toBackend(Backend::CUDA);
+    input_tensor_gpu.copy_(input_tensor);
 
-    auto full_prediction = net->forward(input_tensor_gpu);
+    net->forward_out(input_tensor_gpu, full_prediction);
 
     /*
     auto softmaxed = torch::softmax(full_prediction);
@@ -0,0 +1,306 @@
+#include "pytorch.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace
+{
+	enum RequestStatus
+	{
+		REQUEST_PENDING,
+		REQUEST_RUNNING,
+		REQUEST_DONE,
+		REQUEST_CANCELLED
+	};
+}
+
+struct torch::AsyncExecutor::Request
+{
+	Module::Ptr module;
+	Tensor input;
+	ForwardCallback callback;
+
+	std::promise<Tensor> promise;
+	std::atomic<int> status;
+
+	// Executor which counts the request as pending
+	shared_ptr<AsyncExecutor::State> executor;
+
+	void finish(const Tensor & output, std::exception_ptr error)
+	{
+		// Callback runs first, so it's done when the future becomes ready
+		if (callback)
+		{
+			try
+			{
+				callback(output, error);
+			}
+			catch (...)
+			{
+				cout << "WARNING: callback of forward_async() has thrown an exception." << endl;
+			}
+		}
+
+		if (error)
+		{
+			promise.set_exception(error);
+		}
+		else
+		{
+			promise.set_value(output);
+		}
+	}
+
+	// Finishes the request with an error if it hasn't started yet.
+	// Returns false if it's already running or done.
+	bool cancel();
+};
+
+struct torch::AsyncExecutor::State
+{
+	std::mutex mutex;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+
+	// Can contain cancelled requests, they are skipped
+	std::deque<shared_ptr<Request>> requests;
+
+	// Requests which are neither started nor cancelled
+	int pending_requests;
+	int max_pending_requests;
+	OverflowPolicy overflow_policy;
+	bool stopping;
+
+	ExecutionConfig::Ptr config;
+	vector<std::thread> threads;
+
+	void request_left_queue()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending_requests--;
+		}
+
+		not_full.notify_one();
+	}
+
+	void run_worker()
+	{
+		ExecutionGuard guard(config);
+
+		Tracer::set_thread_name("AsyncExecutor worker");
+
+		for (;;)
+		{
+			shared_ptr<Request> request;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				not_empty.wait(lock, [this] { return stopping || !requests.empty(); });
+
+				if (requests.empty())
+				{
+					return;
+				}
+
+				request = requests.front();
+				requests.pop_front();
+			}
+
+			int expected = REQUEST_PENDING;
+
+			// Cancelled while it was waiting in the queue
+			if (!request->status.compare_exchange_strong(expected, REQUEST_RUNNING))
+			{
+				continue;
+			}
+
+			request_left_queue();
+
+			Tensor output;
+			std::exception_ptr error;
+
+			try
+			{
+				TraceScope trace_scope("async_executor", "request");
+
+				output = request->module->forward(request->input);
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+
+			request->status = REQUEST_DONE;
+			request->finish(output, error);
+
+			// Release the module and the input as soon as possible
+			request->module = nullptr;
+			request->input = Tensor();
+		}
+	}
+};
+
+bool torch::AsyncExecutor::Request::cancel()
+{
+	int expected = REQUEST_PENDING;
+
+	if (!status.compare_exchange_strong(expected, REQUEST_CANCELLED))
+	{
+		return false;
+	}
+
+	// It stays in the queue, but doesn't count as pending anymore
+	if (executor)
+	{
+		executor->request_left_queue();
+	}
+
+	auto error = std::make_exception_ptr(std::runtime_error("forward_async(): the request was cancelled"));
+
+	finish(Tensor(), error);
+
+	module = nullptr;
+	input = Tensor();
+
+	return true;
+}
+
+torch::AsyncExecutor::AsyncExecutor(int threads_count,
+	int max_pending_requests,
+	OverflowPolicy overflow_policy,
+	ExecutionConfig::Ptr config) :
+	state(make_shared<State>())
+{
+	state->pending_requests = 0;
+	state->max_pending_requests = std::max(max_pending_requests, 1);
+	state->overflow_policy = overflow_policy;
+	state->stopping = false;
+	state->config = config;
+
+	for (int i = 0; i < std::max(threads_count, 1); ++i)
+	{
+		state->threads.push_back(std::thread(&State::run_worker, state.get()));
+	}
+}
+
+torch::AsyncExecutor::~AsyncExecutor()
+{
+	std::deque<shared_ptr<Request>> requests;
+
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->stopping = true;
+		requests.swap(state->requests);
+	}
+
+	state->not_empty.notify_all();
+	state->not_full.notify_all();
+
+	for (auto & request : requests)
+	{
+		// The future was already taken by the handle of the caller
+		request->cancel();
+	}
+
+	for (auto & thread : state->threads)
+	{
+		thread.join();
+	}
+}
+
+torch::AsyncExecutor & torch::AsyncExecutor::global()
+{
+	// One thread -- the kernels of ATen are already parallel, this way
+	// the forward passes don't compete for the cores
+	static AsyncExecutor executor;
+
+	return executor;
+}
+
+int torch::AsyncExecutor::pending_requests() const
+{
+	std::lock_guard<std::mutex> lock(state->mutex);
+
+	return state->pending_requests;
+}
+
+void torch::AsyncExecutor::submit(shared_ptr<Request> request)
+{
+	{
+		std::unique_lock<std::mutex> lock(state->mutex);
+
+		if (state->overflow_policy == REJECT_WHEN_FULL &&
+			state->pending_requests >= state->max_pending_requests)
+		{
+			throw std::runtime_error("forward_async(): too many pending requests");
+		}
+
+		state->not_full.wait(lock, [this]
+		{
+			return state->stopping || state->pending_requests < state->max_pending_requests;
+		});
+
+		if (state->stopping)
+		{
+			throw std::runtime_error("forward_async(): the executor is being destroyed");
+		}
+
+		request->executor = state;
+		state->pending_requests++;
+		state->requests.push_back(request);
+	}
+
+	state->not_empty.notify_one();
+}
+
+torch::AsyncForward::AsyncForward(shared_ptr<AsyncExecutor::Request> request) :
+	request(request),
+	output(request->promise.get_future().share())
+{
+
+}
+
+Tensor torch::AsyncForward::get()
+{
+	return output.get();
+}
+
+bool torch::AsyncForward::ready() const
+{
+	return output.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+bool torch::AsyncForward::cancel()
+{
+	return request->cancel();
+}
+
+torch::AsyncForward torch::Module::forward_async(const Tensor & input, AsyncExecutor * executor)
+{
+	return forward_async(input, ForwardCallback(), executor);
+}
+
+torch::AsyncForward torch::Module::forward_async(const Tensor & input, ForwardCallback callback, AsyncExecutor * executor)
+{
+	if (executor == nullptr)
+	{
+		executor = &AsyncExecutor::global();
+	}
+
+	auto request = make_shared<AsyncExecutor::Request>();
+
+	request->module = shared_from_this();
+	request->input = input;
+	request->callback = callback;
+	request->status = REQUEST_PENDING;
+
+	// The future has to be taken before the request can be finished
+	AsyncForward handle(request);
+
+	executor->submit(request);
+
+	return handle;
+}
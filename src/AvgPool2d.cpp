@@ -17,7 +17,7 @@ torch::AvgPool2d::AvgPool2d(int kernel_width,
         ceil_mode(ceil_mode),
         count_include_pad(count_include_pad)
 { 
-
+	module_name = "AvgPool2d";
 };
 
 torch::AvgPool2d::~AvgPool2d()
@@ -25,9 +25,18 @@ torch::AvgPool2d::~AvgPool2d()
 		
 };
 
-Tensor torch::AvgPool2d::forward(Tensor input)
+torch::Module::Ptr torch::AvgPool2d::clone() const
+{
+	auto copy = make_shared<AvgPool2d>(*this);
+	copy->clone_contents();
+
+	return copy;
+};
+
+Tensor torch::AvgPool2d::forward(const Tensor & input)
 {
-	Tensor output = input.type().tensor();
+	ForwardScope scope(this);
+
 	return avg_pool2d(input, {kernel_height, kernel_height}, {stride_height, stride_width}, {padding_height, padding_width}, ceil_mode, count_include_pad);
 };
 
@@ -45,3 +54,26 @@ string torch::AvgPool2d::tostring(int indentation_level)
 
 	return string_stream.str();
 };
+
+vector<int64_t> torch::AvgPool2d::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	// Same parameters as avg_pool2d() gets in forward()
+	auto output_sizes = input_sizes;
+	auto dims = output_sizes.size();
+
+	output_sizes[dims - 2] = pooling_output_size(input_sizes[dims - 2], kernel_height, stride_height, padding_height, ceil_mode);
+	output_sizes[dims - 1] = pooling_output_size(input_sizes[dims - 1], kernel_height, stride_width, padding_width, ceil_mode);
+
+	int64_t output_elements = 1;
+
+	for (auto size : output_sizes)
+	{
+		output_elements *= size;
+	}
+
+	return analysis.add_layer(module_name, 0, path, input_sizes, output_sizes,
+		output_elements * kernel_height * kernel_height, in_place, false);
+}
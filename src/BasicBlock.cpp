@@ -20,6 +20,7 @@ torch::BasicBlock::BasicBlock(int inplanes, int planes, int stride, int dilation
 
 	add_module("conv1", conv1);
 	add_module("bn1", bn1);
+	add_module("relu", relu);
 	add_module("conv2", conv2);
 	add_module("bn2", bn2);
 
@@ -37,27 +38,89 @@ torch::BasicBlock::~BasicBlock()
 
 };
 
-Tensor torch::BasicBlock::forward(Tensor input)
+torch::Module::Ptr torch::BasicBlock::clone() const
 {
+	auto copy = make_shared<BasicBlock>(*this);
+	copy->clone_contents();
+
+	// Named members point to the submodules of the original
+	copy->conv1 = copy->get_module("conv1");
+	copy->bn1 = copy->get_module("bn1");
+	copy->conv2 = copy->get_module("conv2");
+	copy->bn2 = copy->get_module("bn2");
+	copy->relu = copy->get_module("relu");
+	copy->downsample = copy->get_module("downsample");
+
+	return copy;
+};
+
+Tensor torch::BasicBlock::forward(const Tensor & input)
+{
+	ForwardScope scope(this);
+
+	auto main_branch = [this, &input]()
+	{
+		// The output of convolution is a new tensor,
+		// so the layers after it can work in-place
+		Tensor out = conv1->forward(input);
+		out = bn1->forward_(out);
+		out = relu->forward_(out);
+		out = conv2->forward(out);
+		out = bn2->forward_(out);
+
+		return out;
+	};
+
 	// This is done in case we don't have the
 	// downsample module
 	Tensor residual = input;
 	Tensor out;
 
-	out = conv1->forward(input);
-	out = bn1->forward(out);
-	out = relu->forward(out);
-	out = conv2->forward(out);
-	out = bn2->forward(out);
+	if (downsample != nullptr)
+	{
+		// The downsample branch depends only on the input, so
+		// it can run at the same time as the main branch
+		auto outputs = forward_branches({ main_branch, [this, &input]() { return downsample->forward(input); } });
 
-	if(downsample != nullptr)
+		out = outputs[0];
+		residual = outputs[1];
+	}
+	else
 	{
-     
-		residual = downsample->forward(input);
+		out = main_branch();
 	}
 
 	out += residual;
-	out = relu->forward(out);
+	out = relu->forward_(out);
 
 	return out;
-}
\ No newline at end of file
+}
+
+vector<int64_t> torch::BasicBlock::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	// The input is kept for the residual connection, the output of
+	// the first convolution is a new tensor, the rest works in-place
+	auto sizes = conv1->analyze_module(input_sizes, analysis, ShapeAnalysis::child_path(path, "conv1"), false);
+	sizes = bn1->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "bn1"), true);
+	sizes = relu->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "relu"), true);
+	sizes = conv2->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "conv2"), true);
+	sizes = bn2->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "bn2"), true);
+	if (downsample != nullptr)
+	{
+		auto residual_sizes = downsample->analyze_module(input_sizes, analysis,
+			ShapeAnalysis::child_path(path, "downsample"), false);
+
+		// Added to the output and freed
+		analysis.release(residual_sizes);
+	}
+
+	if (in_place)
+	{
+		analysis.release(input_sizes);
+	}
+
+	return relu->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "relu"), true);
+}
@@ -15,18 +15,23 @@ torch::BatchNorm2d::BatchNorm2d(
 	// Initialize weights here
 
 	// Ones initialization is temporarry -- just to avoid
-	// division by zero during testing
-	parameters["weight"] = TENSOR_DEFAULT_TYPE.ones(num_features);
-	parameters["bias"] = TENSOR_DEFAULT_TYPE.zeros(num_features);
+	// division by zero during testing.
+	// Tensors are allocated on the load.
+	declare_parameter("weight", {num_features}, 1);
+	declare_parameter("bias", {num_features}, 0);
 
-	buffers["running_mean"] = TENSOR_DEFAULT_TYPE.zeros(num_features);
-	buffers["running_var"] = TENSOR_DEFAULT_TYPE.ones(num_features);
+	declare_buffer("running_mean", {num_features}, 0);
+	declare_buffer("running_var", {num_features}, 1);
 
-	// We don't recompute the mean and var during inference
-	// So, some variables are initialized for possible future use case.
-	grads["save_mean"] = TENSOR_DEFAULT_TYPE.ones(num_features);
-	grads["save_std"] = TENSOR_DEFAULT_TYPE.ones(num_features);
+	// We don't recompute the mean and var during inference,
+	// so these are needed only for training
+	if (training)
+	{
+		grads["save_mean"] = TENSOR_DEFAULT_TYPE.ones(num_features);
+		grads["save_std"] = TENSOR_DEFAULT_TYPE.ones(num_features);
+	}
 
+	module_name = "BatchNorm2d";
 };
 
 torch::BatchNorm2d::~BatchNorm2d()
@@ -34,6 +39,14 @@ torch::BatchNorm2d::~BatchNorm2d()
 
 };
 
+torch::Module::Ptr torch::BatchNorm2d::clone() const
+{
+	auto copy = make_shared<BatchNorm2d>(*this);
+	copy->clone_contents();
+
+	return copy;
+};
+
 string torch::BatchNorm2d::tostring(int indentation_level)
 {
 
@@ -51,7 +64,51 @@ string torch::BatchNorm2d::tostring(int indentation_level)
 
 };
 
-Tensor torch::BatchNorm2d::forward(Tensor input)
+Tensor torch::BatchNorm2d::forward(const Tensor & input)
 {
+	ForwardScope scope(this);
+
 	return batch_norm(input, parameters["weight"], parameters["bias"], buffers["running_mean"], buffers["running_var"], training, momentum, eps, false);
 };
+
+Tensor torch::BatchNorm2d::forward_(Tensor & input)
+{
+	ForwardScope scope(this);
+
+	// Statistics are recomputed during training, so we
+	// can't do it in-place
+	if (training)
+	{
+		return forward(input);
+	}
+
+	// During inference batchnorm is just a per-channel affine transform:
+	// y = x * scale + shift, where scale = weight / sqrt(running_var + eps)
+	// and shift = bias - running_mean * scale. Both are of size num_features,
+	// so computing them is cheap compared to the pass over the input.
+	Tensor scale = parameters["weight"] / (buffers["running_var"] + eps).sqrt();
+	Tensor shift = parameters["bias"] - buffers["running_mean"] * scale;
+
+	auto input_sizes = input.sizes();
+
+	input.mul_(scale.view({1, num_features, 1, 1}).expand(input_sizes));
+	input.add_(shift.view({1, num_features, 1, 1}).expand(input_sizes));
+
+	return input;
+};
+
+vector<int64_t> torch::BatchNorm2d::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	int64_t elements = 1;
+
+	for (auto size : input_sizes)
+	{
+		elements *= size;
+	}
+
+	// forward_() works in-place only during inference
+	return analysis.add_layer(module_name, weight_bytes(), path, input_sizes, input_sizes, elements, in_place, !training);
+}
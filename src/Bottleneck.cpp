@@ -20,6 +20,7 @@ torch::Bottleneck::Bottleneck(int inplanes, int planes, int stride, int dilation
 
 	add_module("conv1", conv1);
 	add_module("bn1", bn1);
+	add_module("relu", relu);
 	add_module("conv2", conv2);
 	add_module("bn2", bn2);
 	add_module("conv3", conv3);
@@ -41,30 +42,97 @@ torch::Bottleneck::~Bottleneck()
 
 };
 
-Tensor torch::Bottleneck::forward(Tensor input)
+torch::Module::Ptr torch::Bottleneck::clone() const
 {
-	Tensor residual = input;
-	Tensor out;
+	auto copy = make_shared<Bottleneck>(*this);
+	copy->clone_contents();
+
+	// Named members point to the submodules of the original
+	copy->conv1 = copy->get_module("conv1");
+	copy->bn1 = copy->get_module("bn1");
+	copy->conv2 = copy->get_module("conv2");
+	copy->bn2 = copy->get_module("bn2");
+	copy->conv3 = copy->get_module("conv3");
+	copy->bn3 = copy->get_module("bn3");
+	copy->relu = copy->get_module("relu");
+	copy->downsample = copy->get_module("downsample");
+
+	return copy;
+};
 
-	out = conv1->forward(input);
-	out = bn1->forward(out);
-	out = relu->forward(out);
-       
-	out = conv2->forward(out);
-	out = bn2->forward(out);
-	out = relu->forward(out);
+Tensor torch::Bottleneck::forward(const Tensor & input)
+{
+	ForwardScope scope(this);
+
+	auto main_branch = [this, &input]()
+	{
+		// The output of convolution is a new tensor,
+		// so the layers after it can work in-place
+		Tensor out = conv1->forward(input);
+		out = bn1->forward_(out);
+		out = relu->forward_(out);
+
+		out = conv2->forward(out);
+		out = bn2->forward_(out);
+		out = relu->forward_(out);
+
+		out = conv3->forward(out);
+		out = bn3->forward_(out);
 
-	out = conv3->forward(out);
-	out = bn3->forward(out);
+		return out;
+	};
+
+	Tensor residual = input;
+	Tensor out;
 
+	if (downsample != nullptr)
+	{
+		// The downsample branch depends only on the input, so
+		// it can run at the same time as the main branch
+		auto outputs = forward_branches({ main_branch, [this, &input]() { return downsample->forward(input); } });
 
-	if(downsample != nullptr)
+		out = outputs[0];
+		residual = outputs[1];
+	}
+	else
 	{
-		residual = downsample->forward(input);
+		out = main_branch();
 	}
 
 	out += residual;
-	out = relu->forward(out);
+	out = relu->forward_(out);
 
 	return out;
 }
+
+vector<int64_t> torch::Bottleneck::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	// The input is kept for the residual connection, the output of
+	// the first convolution is a new tensor, the rest works in-place
+	auto sizes = conv1->analyze_module(input_sizes, analysis, ShapeAnalysis::child_path(path, "conv1"), false);
+	sizes = bn1->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "bn1"), true);
+	sizes = relu->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "relu"), true);
+	sizes = conv2->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "conv2"), true);
+	sizes = bn2->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "bn2"), true);
+	sizes = relu->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "relu"), true);
+	sizes = conv3->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "conv3"), true);
+	sizes = bn3->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "bn3"), true);
+	if (downsample != nullptr)
+	{
+		auto residual_sizes = downsample->analyze_module(input_sizes, analysis,
+			ShapeAnalysis::child_path(path, "downsample"), false);
+
+		// Added to the output and freed
+		analysis.release(residual_sizes);
+	}
+
+	if (in_place)
+	{
+		analysis.release(input_sizes);
+	}
+
+	return relu->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "relu"), true);
+}
@@ -0,0 +1,466 @@
+#include "pytorch.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+struct torch::CachingAllocator::State
+{
+	// Used to find the per-thread cache of this allocator --
+	// unlike the address it's never reused
+	uint64_t id;
+
+	bool use_huge_pages;
+	int64_t max_cached_bytes_per_thread;
+
+	// Set by the destructor of the allocator. Blocks freed after that
+	// go to the system and caches of the threads drop their blocks.
+	std::atomic<bool> destroyed;
+
+	// Blocks freed by other threads than the one which allocated them
+	// (pipelines, executors), any thread can take them
+	std::mutex shared_mutex;
+	vector<void *> shared_free_lists[20];
+	int64_t shared_cached_bytes;
+
+	std::atomic<int64_t> hits;
+	std::atomic<int64_t> misses;
+	std::atomic<int64_t> bytes_in_use;
+	std::atomic<int64_t> peak_bytes_in_use;
+	std::atomic<int64_t> bytes_cached;
+};
+
+namespace
+{
+	typedef torch::CachingAllocator::State State;
+
+	// Size classes are powers of two starting from 4KB -- smaller
+	// tensors are mostly parameters and they are not allocated per frame.
+	// Requests bigger than the last class (2GB) bypass the cache.
+	const int MIN_SIZE_CLASS_LOG2 = 12;
+	const int NUM_SIZE_CLASSES = 20;
+
+	static_assert(NUM_SIZE_CLASSES == sizeof(State::shared_free_lists) / sizeof(State::shared_free_lists[0]),
+		"shared free lists have to cover all size classes");
+
+	const size_t CACHE_LINE_SIZE = 64;
+	const size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+	std::atomic<uint64_t> allocator_counter(0);
+
+	// Incremented by the destructor of every allocator, so the threads
+	// know when to drop the caches of destroyed allocators
+	std::atomic<uint64_t> destroyed_allocators(0);
+
+	// Identifies the thread which allocated a block
+	std::atomic<uint64_t> thread_counter(0);
+	thread_local uint64_t current_thread_id = ++thread_counter;
+
+	int size_class_index(size_t bytes)
+	{
+		int index = 0;
+		size_t class_size = size_t(1) << MIN_SIZE_CLASS_LOG2;
+
+		while (class_size < bytes)
+		{
+			class_size <<= 1;
+			++index;
+		}
+
+		return index;
+	}
+
+	size_t size_class_bytes(int index)
+	{
+		return size_t(1) << (MIN_SIZE_CLASS_LOG2 + index);
+	}
+
+	void * system_allocate(size_t bytes, bool use_huge_pages)
+	{
+		size_t alignment = CACHE_LINE_SIZE;
+
+		if (use_huge_pages && bytes >= HUGE_PAGE_SIZE)
+		{
+			alignment = HUGE_PAGE_SIZE;
+		}
+
+		void * pointer = nullptr;
+
+#ifdef _WIN32
+		pointer = _aligned_malloc(bytes, alignment);
+#else
+		if (posix_memalign(&pointer, alignment, bytes) != 0)
+		{
+			pointer = nullptr;
+		}
+#endif
+
+		if (pointer == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+
+#ifdef __linux__
+		if (alignment == HUGE_PAGE_SIZE)
+		{
+			// Only a hint -- fails quietly if THP are disabled
+			madvise(pointer, bytes, MADV_HUGEPAGE);
+		}
+#endif
+
+		return pointer;
+	}
+
+	void system_free(void * pointer)
+	{
+#ifdef _WIN32
+		_aligned_free(pointer);
+#else
+		free(pointer);
+#endif
+	}
+
+	// Free lists of one allocator owned by one thread. Blocks freed by
+	// the thread which allocated them are returned to its cache, the same
+	// way it's done in tcmalloc, so no locking is required.
+	struct ThreadCache
+	{
+		shared_ptr<State> state;
+		vector<void *> free_lists[NUM_SIZE_CLASSES];
+		int64_t cached_bytes = 0;
+
+		void clear()
+		{
+			for (int i = 0; i < NUM_SIZE_CLASSES; ++i)
+			{
+				for (auto pointer : free_lists[i])
+				{
+					system_free(pointer);
+				}
+
+				free_lists[i].clear();
+			}
+
+			state->bytes_cached -= cached_bytes;
+			cached_bytes = 0;
+		}
+
+		~ThreadCache()
+		{
+			if (state)
+			{
+				clear();
+			}
+		}
+	};
+
+	// Set when the caches of the thread are destroyed. Tensors freed
+	// after that (for example static ones) go straight to the system.
+	thread_local bool thread_caches_destroyed = false;
+
+	struct ThreadCaches
+	{
+		std::unordered_map<uint64_t, ThreadCache> caches;
+
+		// Value of destroyed_allocators when the caches were checked
+		uint64_t checked_destroyed_allocators = 0;
+
+		// Returns the blocks of destroyed allocators to the system
+		void drop_destroyed()
+		{
+			for (auto cache = caches.begin(); cache != caches.end();)
+			{
+				if (cache->second.state && cache->second.state->destroyed)
+				{
+					cache = caches.erase(cache);
+				}
+				else
+				{
+					++cache;
+				}
+			}
+		}
+
+		~ThreadCaches()
+		{
+			thread_caches_destroyed = true;
+		}
+	};
+
+	ThreadCaches & get_thread_caches()
+	{
+		// Destroyed on thread exit, which returns the cached blocks to the system
+		static thread_local ThreadCaches thread_caches;
+
+		return thread_caches;
+	}
+
+	ThreadCache & get_thread_cache(const shared_ptr<State> & state)
+	{
+		auto & thread_caches = get_thread_caches();
+
+		uint64_t destroyed_count = destroyed_allocators.load(std::memory_order_relaxed);
+
+		if (destroyed_count != thread_caches.checked_destroyed_allocators)
+		{
+			thread_caches.checked_destroyed_allocators = destroyed_count;
+			thread_caches.drop_destroyed();
+		}
+
+		auto & cache = thread_caches.caches[state->id];
+
+		if (!cache.state)
+		{
+			cache.state = state;
+		}
+
+		return cache;
+	}
+
+	void update_peak(State & state, int64_t bytes_in_use)
+	{
+		int64_t peak = state.peak_bytes_in_use.load();
+
+		while (bytes_in_use > peak &&
+			!state.peak_bytes_in_use.compare_exchange_weak(peak, bytes_in_use))
+		{
+		}
+	}
+
+	void * take_shared_block(State & state, int size_class)
+	{
+		std::lock_guard<std::mutex> lock(state.shared_mutex);
+
+		auto & free_list = state.shared_free_lists[size_class];
+
+		if (free_list.empty())
+		{
+			return nullptr;
+		}
+
+		void * pointer = free_list.back();
+		free_list.pop_back();
+
+		int64_t bytes = size_class_bytes(size_class);
+
+		state.shared_cached_bytes -= bytes;
+		state.bytes_cached -= bytes;
+
+		return pointer;
+	}
+
+	// Returns false if the shared pool is full
+	bool put_shared_block(State & state, void * pointer, int size_class)
+	{
+		int64_t bytes = size_class_bytes(size_class);
+
+		std::lock_guard<std::mutex> lock(state.shared_mutex);
+
+		if (state.destroyed || state.shared_cached_bytes + bytes > state.max_cached_bytes_per_thread)
+		{
+			return false;
+		}
+
+		state.shared_free_lists[size_class].push_back(pointer);
+		state.shared_cached_bytes += bytes;
+		state.bytes_cached += bytes;
+
+		return true;
+	}
+
+	void clear_shared_blocks(State & state)
+	{
+		std::lock_guard<std::mutex> lock(state.shared_mutex);
+
+		for (auto & free_list : state.shared_free_lists)
+		{
+			for (auto pointer : free_list)
+			{
+				system_free(pointer);
+			}
+
+			free_list.clear();
+		}
+
+		state.bytes_cached -= state.shared_cached_bytes;
+		state.shared_cached_bytes = 0;
+	}
+
+	void * allocate_block(const shared_ptr<State> & state, int size_class)
+	{
+		size_t bytes = size_class_bytes(size_class);
+
+		auto & cache = get_thread_cache(state);
+		auto & free_list = cache.free_lists[size_class];
+
+		void * pointer;
+
+		if (!free_list.empty())
+		{
+			pointer = free_list.back();
+			free_list.pop_back();
+
+			cache.cached_bytes -= bytes;
+			state->bytes_cached -= bytes;
+			state->hits++;
+		}
+		else if ((pointer = take_shared_block(*state, size_class)) != nullptr)
+		{
+			state->hits++;
+		}
+		else
+		{
+			pointer = system_allocate(bytes, state->use_huge_pages);
+			state->misses++;
+		}
+
+		update_peak(*state, state->bytes_in_use += bytes);
+
+		return pointer;
+	}
+
+	void release_block(const shared_ptr<State> & state, void * pointer, int size_class, uint64_t allocating_thread)
+	{
+		int64_t bytes = size_class_bytes(size_class);
+
+		state->bytes_in_use -= bytes;
+
+		if (thread_caches_destroyed || state->destroyed)
+		{
+			system_free(pointer);
+			return;
+		}
+
+		// The allocating thread would never find it in the cache of this one
+		if (allocating_thread != current_thread_id)
+		{
+			if (!put_shared_block(*state, pointer, size_class))
+			{
+				system_free(pointer);
+			}
+
+			return;
+		}
+
+		auto & cache = get_thread_cache(state);
+
+		if (cache.cached_bytes + bytes > state->max_cached_bytes_per_thread)
+		{
+			system_free(pointer);
+			return;
+		}
+
+		cache.free_lists[size_class].push_back(pointer);
+		cache.cached_bytes += bytes;
+		state->bytes_cached += bytes;
+	}
+}
+
+torch::CachingAllocator::CachingAllocator(bool use_huge_pages, int64_t max_cached_bytes_per_thread) :
+	state(make_shared<State>())
+{
+	state->id = allocator_counter++;
+	state->use_huge_pages = use_huge_pages;
+	state->max_cached_bytes_per_thread = max_cached_bytes_per_thread;
+
+	state->destroyed = false;
+	state->shared_cached_bytes = 0;
+
+	state->bytes_in_use = 0;
+	state->bytes_cached = 0;
+	reset_statistics();
+}
+
+torch::CachingAllocator::~CachingAllocator()
+{
+	// Tensors which are still alive keep the state through their deleters
+	// and free their blocks to the system. Other threads drop their caches
+	// of this allocator the next time they use any caching allocator.
+	{
+		std::lock_guard<std::mutex> lock(state->shared_mutex);
+		state->destroyed = true;
+	}
+
+	destroyed_allocators++;
+
+	if (!thread_caches_destroyed)
+	{
+		get_thread_caches().drop_destroyed();
+	}
+
+	clear_shared_blocks(*state);
+}
+
+Tensor torch::CachingAllocator::tensor(const Type & type, IntList sizes)
+{
+	if (type.is_cuda())
+	{
+		return type.tensor(sizes);
+	}
+
+	int64_t numel = 1;
+
+	for (auto size : sizes)
+	{
+		numel *= size;
+	}
+
+	size_t bytes = size_t(numel) * type.elementSizeInBytes();
+
+	if (bytes == 0 || bytes > size_class_bytes(NUM_SIZE_CLASSES - 1))
+	{
+		return type.tensor(sizes);
+	}
+
+	int size_class = size_class_index(bytes);
+	void * pointer = allocate_block(state, size_class);
+
+	// The deleter keeps the state alive, so the tensor can
+	// outlive the allocator
+	auto deleter_state = state;
+	uint64_t allocating_thread = current_thread_id;
+
+	return type.tensorFromBlob(pointer, sizes, [deleter_state, size_class, allocating_thread](void * data)
+	{
+		release_block(deleter_state, data, size_class, allocating_thread);
+	});
+}
+
+torch::CachingAllocator::Statistics torch::CachingAllocator::statistics() const
+{
+	Statistics statistics;
+
+	statistics.hits = state->hits;
+	statistics.misses = state->misses;
+	statistics.bytes_in_use = state->bytes_in_use;
+	statistics.peak_bytes_in_use = state->peak_bytes_in_use;
+	statistics.bytes_cached = state->bytes_cached;
+
+	return statistics;
+}
+
+void torch::CachingAllocator::reset_statistics()
+{
+	state->hits = 0;
+	state->misses = 0;
+	state->peak_bytes_in_use = state->bytes_in_use.load();
+}
+
+void torch::CachingAllocator::empty_cache()
+{
+	if (!thread_caches_destroyed)
+	{
+		get_thread_cache(state).clear();
+	}
+
+	clear_shared_blocks(*state);
+}
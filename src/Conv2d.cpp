@@ -1,5 +1,272 @@
 #include "pytorch.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace
+{
+	// Geometry of a convolution along dims 2 and 3 of the input
+	struct ConvolutionShape
+	{
+		int64_t channels;
+		int64_t height;
+		int64_t width;
+		int64_t output_height;
+		int64_t output_width;
+
+		int kernel[2];
+		int stride[2];
+		int padding[2];
+		int dilation[2];
+	};
+
+	// Columns of all the images of the block are put next to each other, so
+	// one matrix multiplication computes the whole block:
+	// columns[channel, ky, kx][image, y, x]
+	void im2col(const float * input, int64_t images, const ConvolutionShape & shape, float * columns)
+	{
+		int64_t plane_size = shape.output_height * shape.output_width;
+		int64_t columns_width = images * plane_size;
+		int64_t rows = shape.channels * shape.kernel[0] * shape.kernel[1];
+
+		#pragma omp parallel for
+		for (int64_t row = 0; row < rows; ++row)
+		{
+			int64_t kernel_x = row % shape.kernel[1];
+			int64_t kernel_y = (row / shape.kernel[1]) % shape.kernel[0];
+			int64_t channel = row / (shape.kernel[0] * shape.kernel[1]);
+
+			for (int64_t image = 0; image < images; ++image)
+			{
+				const float * input_plane = input + (image * shape.channels + channel) * shape.height * shape.width;
+				float * output_plane = columns + row * columns_width + image * plane_size;
+
+				for (int64_t y = 0; y < shape.output_height; ++y)
+				{
+					int64_t input_y = y * shape.stride[0] - shape.padding[0] + kernel_y * shape.dilation[0];
+					float * output_row = output_plane + y * shape.output_width;
+
+					if (input_y < 0 || input_y >= shape.height)
+					{
+						std::fill(output_row, output_row + shape.output_width, 0.0f);
+						continue;
+					}
+
+					const float * input_row = input_plane + input_y * shape.width;
+
+					for (int64_t x = 0; x < shape.output_width; ++x)
+					{
+						int64_t input_x = x * shape.stride[1] - shape.padding[1] + kernel_x * shape.dilation[1];
+
+						output_row[x] = (input_x >= 0 && input_x < shape.width) ? input_row[input_x] : 0.0f;
+					}
+				}
+			}
+		}
+	}
+
+	// Winograd F(2x2, 3x3): every 2x2 tile of the output is computed from
+	// a 4x4 tile of the input with 16 multiplications instead of 36.
+	// Y = A^T [(G g G^T) * (B^T d B)] A, the elementwise products are summed
+	// over the input channels with 16 matrix multiplications.
+
+	// U[16][out_channels][in_channels] = G g G^T
+	void winograd_transform_weight(const float * weight, int64_t out_channels, int64_t in_channels, float * transformed)
+	{
+		int64_t matrix_size = out_channels * in_channels;
+
+		#pragma omp parallel for
+		for (int64_t index = 0; index < matrix_size; ++index)
+		{
+			const float * g = weight + index * 9;
+			float temporary[4][3];
+
+			for (int j = 0; j < 3; ++j)
+			{
+				temporary[0][j] = g[j];
+				temporary[1][j] = 0.5f * (g[j] + g[3 + j] + g[6 + j]);
+				temporary[2][j] = 0.5f * (g[j] - g[3 + j] + g[6 + j]);
+				temporary[3][j] = g[6 + j];
+			}
+
+			for (int i = 0; i < 4; ++i)
+			{
+				float u[4];
+
+				u[0] = temporary[i][0];
+				u[1] = 0.5f * (temporary[i][0] + temporary[i][1] + temporary[i][2]);
+				u[2] = 0.5f * (temporary[i][0] - temporary[i][1] + temporary[i][2]);
+				u[3] = temporary[i][2];
+
+				for (int j = 0; j < 4; ++j)
+				{
+					transformed[(i * 4 + j) * matrix_size + index] = u[j];
+				}
+			}
+		}
+	}
+
+	// V[16][channels][tiles] = B^T d B
+	void winograd_transform_input(const float * input, int64_t batch_size, const ConvolutionShape & shape,
+		int64_t tiles_y, int64_t tiles_x, float * transformed)
+	{
+		int64_t tiles_count = batch_size * tiles_y * tiles_x;
+		int64_t matrix_size = shape.channels * tiles_count;
+
+		#pragma omp parallel for
+		for (int64_t channel = 0; channel < shape.channels; ++channel)
+		{
+			for (int64_t image = 0; image < batch_size; ++image)
+			{
+				const float * input_plane = input + (image * shape.channels + channel) * shape.height * shape.width;
+
+				for (int64_t tile_y = 0; tile_y < tiles_y; ++tile_y)
+				{
+					for (int64_t tile_x = 0; tile_x < tiles_x; ++tile_x)
+					{
+						float d[4][4];
+
+						for (int i = 0; i < 4; ++i)
+						{
+							int64_t y = tile_y * 2 - shape.padding[0] + i;
+
+							for (int j = 0; j < 4; ++j)
+							{
+								int64_t x = tile_x * 2 - shape.padding[1] + j;
+
+								bool inside = (y >= 0 && y < shape.height && x >= 0 && x < shape.width);
+
+								d[i][j] = inside ? input_plane[y * shape.width + x] : 0.0f;
+							}
+						}
+
+						float temporary[4][4];
+
+						for (int j = 0; j < 4; ++j)
+						{
+							temporary[0][j] = d[0][j] - d[2][j];
+							temporary[1][j] = d[1][j] + d[2][j];
+							temporary[2][j] = d[2][j] - d[1][j];
+							temporary[3][j] = d[1][j] - d[3][j];
+						}
+
+						int64_t tile = (image * tiles_y + tile_y) * tiles_x + tile_x;
+						float * output = transformed + channel * tiles_count + tile;
+
+						for (int i = 0; i < 4; ++i)
+						{
+							output[(i * 4 + 0) * matrix_size] = temporary[i][0] - temporary[i][2];
+							output[(i * 4 + 1) * matrix_size] = temporary[i][1] + temporary[i][2];
+							output[(i * 4 + 2) * matrix_size] = temporary[i][2] - temporary[i][1];
+							output[(i * 4 + 3) * matrix_size] = temporary[i][1] - temporary[i][3];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Y = A^T m A for every tile, m is [16][out_channels][tiles]
+	void winograd_transform_output(const float * products, const float * bias, int64_t batch_size,
+		int64_t out_channels, const ConvolutionShape & shape, int64_t tiles_y, int64_t tiles_x, float * output)
+	{
+		int64_t tiles_count = batch_size * tiles_y * tiles_x;
+		int64_t matrix_size = out_channels * tiles_count;
+
+		#pragma omp parallel for
+		for (int64_t channel = 0; channel < out_channels; ++channel)
+		{
+			float channel_bias = bias ? bias[channel] : 0.0f;
+
+			for (int64_t tile = 0; tile < tiles_count; ++tile)
+			{
+				const float * input = products + channel * tiles_count + tile;
+				float m[4][4];
+
+				for (int i = 0; i < 16; ++i)
+				{
+					m[i / 4][i % 4] = input[i * matrix_size];
+				}
+
+				float temporary[2][4];
+
+				for (int j = 0; j < 4; ++j)
+				{
+					temporary[0][j] = m[0][j] + m[1][j] + m[2][j];
+					temporary[1][j] = m[1][j] - m[2][j] - m[3][j];
+				}
+
+				int64_t image = tile / (tiles_y * tiles_x);
+				int64_t tile_y = (tile / tiles_x) % tiles_y;
+				int64_t tile_x = tile % tiles_x;
+
+				float * output_plane = output + (image * out_channels + channel) * shape.output_height * shape.output_width;
+
+				for (int i = 0; i < 2; ++i)
+				{
+					int64_t y = tile_y * 2 + i;
+
+					if (y >= shape.output_height)
+					{
+						continue;
+					}
+
+					float values[2];
+
+					values[0] = temporary[i][0] + temporary[i][1] + temporary[i][2];
+					values[1] = temporary[i][1] - temporary[i][2] - temporary[i][3];
+
+					for (int j = 0; j < 2; ++j)
+					{
+						int64_t x = tile_x * 2 + j;
+
+						if (x < shape.output_width)
+						{
+							output_plane[y * shape.output_width + x] = values[j] + channel_bias;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Largest difference relative to the magnitude of the reference
+	float relative_difference(const Tensor & output, const Tensor & reference)
+	{
+		auto output_contiguous = output.contiguous();
+		auto reference_contiguous = reference.contiguous();
+
+		const float * output_data = output_contiguous.data<float>();
+		const float * reference_data = reference_contiguous.data<float>();
+
+		float max_difference = 0;
+		float max_value = 1;
+
+		for (int64_t i = 0; i < reference_contiguous.numel(); ++i)
+		{
+			max_difference = std::max(max_difference, std::abs(output_data[i] - reference_data[i]));
+			max_value = std::max(max_value, std::abs(reference_data[i]));
+		}
+
+		return max_difference / max_value;
+	}
+
+	int max_threads()
+	{
+#ifdef _OPENMP
+		return omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
+}
+
 torch::Conv2d::Conv2d(
 	int in_channels,
 	int out_channels,
@@ -27,8 +294,8 @@ torch::Conv2d::Conv2d(
 	bias(bias)
 {
 	// Register "wight" as a parameter in order to be able to
-	// restore it from a file later on
-	parameters["weight"] = TENSOR_DEFAULT_TYPE.zeros({ out_channels,
+	// restore it from a file later on. It's allocated on the load.
+	declare_parameter("weight", { out_channels,
 		in_channels / groups,
 		kernel_width,
 		kernel_height });
@@ -36,7 +303,7 @@ torch::Conv2d::Conv2d(
 	// Check if we need bias for our convolution
 	if (bias)
 	{
-		parameters["bias"] = TENSOR_DEFAULT_TYPE.zeros({ out_channels });
+		declare_parameter("bias", { out_channels });
 	}
 	else
 	{
@@ -45,18 +312,8 @@ torch::Conv2d::Conv2d(
 		parameters["bias"] = Tensor();
 	}
 
-	// These variables are not needed for forward inferece,
-	// but we need them in order to call an underlying C
-	// function. Later they will be used for backward pass
-
-	grads["finput"] = TENSOR_DEFAULT_TYPE.tensor();
-	grads["fgradInput"] = TENSOR_DEFAULT_TYPE.tensor();
-
-	// These variables depend on # of groups, so far only
-	// one group is supported. Needs to be changed to tensor_list
-	// in order to support multiple groups.
-	grads["ones"] = TENSOR_DEFAULT_TYPE.tensor();
-	grads["columns"] = TENSOR_DEFAULT_TYPE.tensor();
+	// Buffers of the THNN backward pass (finput, fgradInput, ones, columns)
+	// are not created: conv2d() manages its own and there is no training.
 
 	// There are separate functions for dilated and non-dilated convolutions
 	dilated = false;
@@ -66,6 +323,7 @@ torch::Conv2d::Conv2d(
 		dilated = true;
 	}
 
+	module_name = "Conv2d";
 };
 
 torch::Conv2d::~Conv2d()
@@ -73,6 +331,14 @@ torch::Conv2d::~Conv2d()
 
 };
 
+torch::Module::Ptr torch::Conv2d::clone() const
+{
+	auto copy = make_shared<Conv2d>(*this);
+	copy->clone_contents();
+
+	return copy;
+};
+
 
 string torch::Conv2d::tostring(int indentation_level)
 {
@@ -93,8 +359,437 @@ string torch::Conv2d::tostring(int indentation_level)
 	return string_stream.str();
 };
 
-Tensor torch::Conv2d::forward(Tensor input)
+Tensor torch::Conv2d::forward(const Tensor & input)
 {
+	ForwardScope scope(this);
+
+	int algorithm = select_algorithm(input);
+
+	if (algorithm != CONV_ALGORITHM_DEFAULT)
+	{
+		return forward_with(input, algorithm);
+	}
+
 	return conv2d(input, parameters["weight"], parameters["bias"], {stride_width, stride_height}, {padding_width, padding_height}, {dilation_width, dilation_height}, groups);
 	//return cudnn_convolution(input, parameters["weight"], parameters["bias"], {stride_width, stride_height}, {padding_width, padding_height}, {dilation_width, dilation_height}, groups, false, false);
 };
+
+Tensor & torch::Conv2d::forward_out(const Tensor & input, Tensor & output)
+{
+	ForwardScope scope(this);
+
+	// 1x1 convolution with unit stride is a matrix multiplication, so it can
+	// be written directly into the output. This is what the fully convolutional
+	// resnets use as the last layer, also on GPU. Other configurations go through forward().
+	bool pointwise = is_pointwise(input);
+
+	// Output provided by the caller can be strided, then the matrices
+	// can't be viewed in it
+	if (!pointwise || (output.defined() && !output.is_contiguous()))
+	{
+		return Module::forward_out(input, output);
+	}
+
+	forward_pointwise(input, output);
+
+	return output;
+};
+
+void torch::Conv2d::weights_updated()
+{
+	std::atomic_store(&winograd_weight, shared_ptr<const Tensor>());
+}
+
+vector<int> torch::Conv2d::applicable_algorithms(const Tensor & input) const
+{
+	vector<int> algorithms = {CONV_ALGORITHM_DEFAULT};
+
+	// Own algorithms are written for float images on CPU
+	if (&input.type() != &CPU(kFloat) || input.dim() != 4 || groups != 1)
+	{
+		return algorithms;
+	}
+
+	bool unit_stride = (stride_width == 1) && (stride_height == 1);
+
+	if (is_pointwise(input))
+	{
+		algorithms.push_back(CONV_ALGORITHM_POINTWISE_GEMM);
+	}
+
+	algorithms.push_back(CONV_ALGORITHM_IM2COL_GEMM_BLOCK_1);
+
+	if (input.size(0) > 1)
+	{
+		algorithms.push_back(CONV_ALGORITHM_IM2COL_GEMM_BLOCK_4);
+	}
+
+	if (input.size(0) > 4)
+	{
+		algorithms.push_back(CONV_ALGORITHM_IM2COL_GEMM_BLOCK_16);
+	}
+
+	if (kernel_width == 3 && kernel_height == 3 && unit_stride && !dilated)
+	{
+		algorithms.push_back(CONV_ALGORITHM_WINOGRAD);
+	}
+
+	return algorithms;
+}
+
+Tensor torch::Conv2d::forward_with(const Tensor & input, int algorithm)
+{
+	switch (algorithm)
+	{
+	case CONV_ALGORITHM_POINTWISE_GEMM:
+	{
+		Tensor output;
+
+		forward_pointwise(input, output);
+
+		return output;
+	}
+
+	case CONV_ALGORITHM_IM2COL_GEMM_BLOCK_1:
+		return forward_im2col(input, 1);
+
+	case CONV_ALGORITHM_IM2COL_GEMM_BLOCK_4:
+		return forward_im2col(input, 4);
+
+	case CONV_ALGORITHM_IM2COL_GEMM_BLOCK_16:
+		return forward_im2col(input, 16);
+
+	case CONV_ALGORITHM_WINOGRAD:
+		return forward_winograd(input);
+
+	default:
+		return conv2d(input, parameters["weight"], parameters["bias"], {stride_width, stride_height}, {padding_width, padding_height}, {dilation_width, dilation_height}, groups);
+	}
+}
+
+string torch::Conv2d::tuner_key(const Tensor & input) const
+{
+	std::stringstream key;
+
+	// Best algorithm depends on the number of threads as well
+	key << ConvolutionTuner::global().cpu_model()
+		<< " threads=" << max_threads()
+		<< " in_channels=" << in_channels
+		<< " out_channels=" << out_channels
+		<< " kernel_size=" << kernel_width << "x" << kernel_height
+		<< " stride=" << stride_width << "x" << stride_height
+		<< " padding=" << padding_width << "x" << padding_height
+		<< " dilation=" << dilation_width << "x" << dilation_height
+		<< " groups=" << groups
+		<< " bias=" << bias
+		<< " input=" << input.sizes();
+
+	return key.str();
+}
+
+int torch::Conv2d::select_algorithm(const Tensor & input)
+{
+	int forced_algorithm = ConvolutionTuner::global().forced();
+
+	if (forced_algorithm >= 0)
+	{
+		auto algorithms = applicable_algorithms(input);
+
+		if (std::find(algorithms.begin(), algorithms.end(), forced_algorithm) != algorithms.end())
+		{
+			return forced_algorithm;
+		}
+	}
+
+	auto choice = std::atomic_load(&algorithm_choice);
+
+	if (choice && input.sizes().equals(choice->input_sizes))
+	{
+		return choice->algorithm;
+	}
+
+	int algorithm = CONV_ALGORITHM_DEFAULT;
+	auto algorithms = applicable_algorithms(input);
+
+	if (algorithms.size() > 1)
+	{
+		auto & tuner = ConvolutionTuner::global();
+
+		algorithm = tuner.find(tuner_key(input));
+
+		if (algorithm < 0)
+		{
+			algorithm = tuner.enabled() ? tune(input) : int(CONV_ALGORITHM_DEFAULT);
+		}
+
+		// The cache file could be written by a different version
+		if (std::find(algorithms.begin(), algorithms.end(), algorithm) == algorithms.end())
+		{
+			algorithm = CONV_ALGORITHM_DEFAULT;
+		}
+	}
+
+	auto new_choice = make_shared<AlgorithmChoice>();
+
+	new_choice->input_sizes = input.sizes().vec();
+	new_choice->algorithm = algorithm;
+
+	std::atomic_store(&algorithm_choice, shared_ptr<const AlgorithmChoice>(new_choice));
+
+	return algorithm;
+}
+
+int torch::Conv2d::tune(const Tensor & input)
+{
+	auto & tuner = ConvolutionTuner::global();
+
+	auto reference = forward_with(input, CONV_ALGORITHM_DEFAULT);
+
+	int best_algorithm = CONV_ALGORITHM_DEFAULT;
+	double best_time = std::numeric_limits<double>::max();
+
+	for (auto algorithm : applicable_algorithms(input))
+	{
+		try
+		{
+			// The first run is a warmup, it also checks the result
+			auto output = forward_with(input, algorithm);
+
+			if (relative_difference(output, reference) > 1e-3f)
+			{
+				cout << "WARNING: convolution algorithm " << ConvolutionTuner::algorithm_name(algorithm)
+					<< " gives wrong results for " << tuner_key(input) << ". It is not used." << endl;
+
+				continue;
+			}
+
+			for (int i = 0; i < std::max(tuner.benchmark_iterations, 1); ++i)
+			{
+				auto start = std::chrono::steady_clock::now();
+
+				forward_with(input, algorithm);
+
+				double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+				if (time < best_time)
+				{
+					best_time = time;
+					best_algorithm = algorithm;
+				}
+			}
+		}
+		catch (std::exception & error)
+		{
+			cout << "WARNING: convolution algorithm " << ConvolutionTuner::algorithm_name(algorithm)
+				<< " failed: " << error.what() << endl;
+		}
+	}
+
+	tuner.insert(tuner_key(input), best_algorithm);
+
+	return best_algorithm;
+}
+
+bool torch::Conv2d::is_pointwise(const Tensor & input) const
+{
+	return (input.dim() == 4) && (groups == 1) &&
+		(kernel_width == 1) && (kernel_height == 1) &&
+		(stride_width == 1) && (stride_height == 1) &&
+		(padding_width == 0) && (padding_height == 0);
+}
+
+void torch::Conv2d::forward_pointwise(const Tensor & input, Tensor & output)
+{
+	auto batch_size = input.size(0);
+	auto height = input.size(2);
+	auto width = input.size(3);
+
+	prepare_output(output, input.type(), {batch_size, out_channels, height, width});
+
+	auto weight = parameters["weight"].view({out_channels, in_channels});
+	auto input_contiguous = input.contiguous();
+
+	for (int64_t i = 0; i < batch_size; ++i)
+	{
+		auto output_matrix = output[i].view({out_channels, height * width});
+
+		if (bias)
+		{
+			output_matrix.copy_(parameters["bias"].view({out_channels, 1}).expand({out_channels, height * width}));
+		}
+		else
+		{
+			output_matrix.zero_();
+		}
+
+		output_matrix.addmm_(weight, input_contiguous[i].view({in_channels, height * width}), 1, 1);
+	}
+}
+
+Tensor torch::Conv2d::forward_im2col(const Tensor & input, int64_t images_per_gemm)
+{
+	auto input_contiguous = input.contiguous();
+
+	ConvolutionShape shape;
+
+	shape.channels = in_channels;
+	shape.height = input.size(2);
+	shape.width = input.size(3);
+
+	// The order of the members is the same as in the call of conv2d()
+	shape.kernel[0] = kernel_width;
+	shape.kernel[1] = kernel_height;
+	shape.stride[0] = stride_width;
+	shape.stride[1] = stride_height;
+	shape.padding[0] = padding_width;
+	shape.padding[1] = padding_height;
+	shape.dilation[0] = dilation_width;
+	shape.dilation[1] = dilation_height;
+
+	shape.output_height = (shape.height + 2 * padding_width - dilation_width * (kernel_width - 1) - 1) / stride_width + 1;
+	shape.output_width = (shape.width + 2 * padding_height - dilation_height * (kernel_height - 1) - 1) / stride_height + 1;
+
+	int64_t batch_size = input.size(0);
+	int64_t plane_size = shape.output_height * shape.output_width;
+	int64_t rows = in_channels * kernel_width * kernel_height;
+
+	// Columns of big images take a lot of memory, they are
+	// limited to 64MB unless a single image needs more
+	const int64_t max_columns_elements = int64_t(16) << 20;
+
+	images_per_gemm = std::min(images_per_gemm, batch_size);
+	images_per_gemm = std::max(std::min(images_per_gemm, max_columns_elements / (rows * plane_size)), int64_t(1));
+
+	auto output = new_tensor(input.type(), {batch_size, out_channels, shape.output_height, shape.output_width});
+	auto weight = parameters["weight"].contiguous().view({out_channels, rows});
+	auto columns = new_tensor(input.type(), {rows, images_per_gemm * plane_size});
+
+	Tensor block_output;
+
+	if (images_per_gemm > 1)
+	{
+		block_output = new_tensor(input.type(), {out_channels, images_per_gemm * plane_size});
+	}
+
+	const float * input_data = input_contiguous.data<float>();
+	int64_t image_size = in_channels * shape.height * shape.width;
+
+	for (int64_t first_image = 0; first_image < batch_size; first_image += images_per_gemm)
+	{
+		int64_t images = std::min(images_per_gemm, batch_size - first_image);
+
+		im2col(input_data + first_image * image_size, images, shape, columns.data<float>());
+
+		// A single image is written straight into the output
+		auto result = (images_per_gemm == 1) ?
+			output[first_image].view({out_channels, plane_size}) :
+			block_output.narrow(1, 0, images * plane_size);
+
+		if (bias)
+		{
+			result.copy_(parameters["bias"].view({out_channels, 1}).expand({out_channels, images * plane_size}));
+		}
+		else
+		{
+			result.zero_();
+		}
+
+		result.addmm_(weight, columns.narrow(1, 0, images * plane_size), 1, 1);
+
+		if (images_per_gemm > 1)
+		{
+			for (int64_t i = 0; i < images; ++i)
+			{
+				output[first_image + i].view({out_channels, plane_size}).copy_(result.narrow(1, i * plane_size, plane_size));
+			}
+		}
+	}
+
+	return output;
+}
+
+Tensor torch::Conv2d::forward_winograd(const Tensor & input)
+{
+	// Transformed weights are kept until the weights change
+	auto transformed_weight = std::atomic_load(&winograd_weight);
+
+	if (!transformed_weight)
+	{
+		auto weight = parameters["weight"].contiguous();
+		auto transformed = make_shared<Tensor>(CPU(kFloat).tensor({16, out_channels, in_channels}));
+
+		winograd_transform_weight(weight.data<float>(), out_channels, in_channels, transformed->data<float>());
+
+		transformed_weight = transformed;
+		std::atomic_store(&winograd_weight, transformed_weight);
+	}
+
+	auto input_contiguous = input.contiguous();
+
+	ConvolutionShape shape;
+
+	shape.channels = in_channels;
+	shape.height = input.size(2);
+	shape.width = input.size(3);
+	shape.padding[0] = padding_width;
+	shape.padding[1] = padding_height;
+	shape.output_height = shape.height + 2 * padding_width - 2;
+	shape.output_width = shape.width + 2 * padding_height - 2;
+
+	int64_t batch_size = input.size(0);
+	int64_t tiles_y = (shape.output_height + 1) / 2;
+	int64_t tiles_x = (shape.output_width + 1) / 2;
+	int64_t tiles_count = batch_size * tiles_y * tiles_x;
+
+	auto transformed_input = new_tensor(input.type(), {16, in_channels, tiles_count});
+
+	winograd_transform_input(input_contiguous.data<float>(), batch_size, shape, tiles_y, tiles_x, transformed_input.data<float>());
+
+	// [16, out_channels, tiles]
+	auto products = transformed_weight->bmm(transformed_input).contiguous();
+
+	auto output = new_tensor(input.type(), {batch_size, out_channels, shape.output_height, shape.output_width});
+
+	Tensor bias_contiguous;
+
+	if (bias)
+	{
+		bias_contiguous = parameters["bias"].contiguous();
+	}
+
+	winograd_transform_output(products.data<float>(),
+		bias ? bias_contiguous.data<float>() : nullptr,
+		batch_size,
+		out_channels,
+		shape,
+		tiles_y,
+		tiles_x,
+		output.data<float>());
+
+	return output;
+}
+
+vector<int64_t> torch::Conv2d::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	if (input_sizes.size() != 4 || input_sizes[1] != in_channels)
+	{
+		throw std::runtime_error("analyze(): Conv2d ('" + path + "') expects N x " +
+			std::to_string(in_channels) + " x H x W input");
+	}
+
+	// Same dimensions as in forward()
+	int64_t output_height = pooling_output_size(input_sizes[2], dilation_width * (kernel_width - 1) + 1,
+		stride_width, padding_width, false);
+	int64_t output_width = pooling_output_size(input_sizes[3], dilation_height * (kernel_height - 1) + 1,
+		stride_height, padding_height, false);
+
+	vector<int64_t> output_sizes = {input_sizes[0], out_channels, output_height, output_width};
+
+	int64_t macs = input_sizes[0] * out_channels * output_height * output_width *
+		(in_channels / groups) * kernel_width * kernel_height;
+
+	return analysis.add_layer(module_name, weight_bytes(), path, input_sizes, output_sizes, macs, in_place, false);
+}
@@ -0,0 +1,157 @@
+#include "pytorch.h"
+
+#include <fstream>
+
+namespace
+{
+	const char * ALGORITHM_NAMES[torch::CONV_ALGORITHMS_COUNT] =
+	{
+		"default",
+		"pointwise_gemm",
+		"im2col_gemm_block_1",
+		"im2col_gemm_block_4",
+		"im2col_gemm_block_16",
+		"winograd_2x2_3x3"
+	};
+
+	string read_cpu_model()
+	{
+		std::ifstream cpuinfo("/proc/cpuinfo");
+		string line;
+
+		while (std::getline(cpuinfo, line))
+		{
+			if (line.compare(0, 10, "model name") != 0)
+			{
+				continue;
+			}
+
+			auto value_start = line.find_first_not_of(" \t", line.find(':') + 1);
+
+			if (value_start != string::npos)
+			{
+				return line.substr(value_start);
+			}
+		}
+
+		return "unknown-cpu";
+	}
+}
+
+torch::ConvolutionTuner::ConvolutionTuner() :
+	benchmark_iterations(3),
+	tuning(false),
+	forced_algorithm(-1),
+	cpu_model_name(read_cpu_model())
+{
+
+}
+
+torch::ConvolutionTuner & torch::ConvolutionTuner::global()
+{
+	static ConvolutionTuner tuner;
+
+	return tuner;
+}
+
+void torch::ConvolutionTuner::enable(const string & cache_filename)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	this->cache_filename = cache_filename;
+	tuning = true;
+
+	if (cache_filename.empty())
+	{
+		return;
+	}
+
+	// One choice per line: key, tab, name of the algorithm.
+	// Later lines override the earlier ones.
+	std::ifstream cache_file(cache_filename);
+	string line;
+
+	while (std::getline(cache_file, line))
+	{
+		auto separator = line.rfind('\t');
+
+		if (separator == string::npos)
+		{
+			continue;
+		}
+
+		auto name = line.substr(separator + 1);
+
+		for (int algorithm = 0; algorithm < CONV_ALGORITHMS_COUNT; ++algorithm)
+		{
+			if (name == ALGORITHM_NAMES[algorithm])
+			{
+				choices[line.substr(0, separator)] = algorithm;
+			}
+		}
+	}
+}
+
+void torch::ConvolutionTuner::disable()
+{
+	tuning = false;
+}
+
+bool torch::ConvolutionTuner::enabled() const
+{
+	return tuning;
+}
+
+int torch::ConvolutionTuner::find(const string & key) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto choice = choices.find(key);
+
+	return (choice == choices.end()) ? -1 : choice->second;
+}
+
+void torch::ConvolutionTuner::insert(const string & key, int algorithm)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	choices[key] = algorithm;
+
+	if (!cache_filename.empty())
+	{
+		// Appended, so several processes tuning at once don't lose each other's choices
+		std::ofstream cache_file(cache_filename, std::ios::app);
+
+		cache_file << key << '\t' << ALGORITHM_NAMES[algorithm] << endl;
+
+		if (!cache_file)
+		{
+			cout << "WARNING: can't write the convolution algorithms to '" << cache_filename << "'." << endl;
+		}
+	}
+}
+
+const string & torch::ConvolutionTuner::cpu_model() const
+{
+	return cpu_model_name;
+}
+
+const char * torch::ConvolutionTuner::algorithm_name(int algorithm)
+{
+	if (algorithm < 0 || algorithm >= CONV_ALGORITHMS_COUNT)
+	{
+		return "unknown";
+	}
+
+	return ALGORITHM_NAMES[algorithm];
+}
+
+void torch::ConvolutionTuner::force(int algorithm)
+{
+	forced_algorithm = algorithm;
+}
+
+int torch::ConvolutionTuner::forced() const
+{
+	return forced_algorithm;
+}
@@ -0,0 +1,272 @@
+#include "pytorch.h"
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <thread>
+
+// Thread which runs the forward passes of one group of cores.
+// It's pinned to the cores of the group for its whole lifetime,
+// so the replica it creates is allocated in the local memory.
+struct torch::DataParallel::Worker
+{
+	vector<int> cores;
+	Module::Ptr replica;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<std::packaged_task<void()>> tasks;
+	bool stopping;
+
+	std::thread thread;
+
+	Worker(const vector<int> & cores) :
+		cores(cores),
+		stopping(false)
+	{
+		thread = std::thread(&Worker::run, this);
+	}
+
+	~Worker()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+
+		condition.notify_one();
+		thread.join();
+	}
+
+	std::future<void> submit(std::function<void()> function)
+	{
+		std::packaged_task<void()> task(function);
+		auto result = task.get_future();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+
+		condition.notify_one();
+
+		return result;
+	}
+
+	void run()
+	{
+		auto config = make_shared<ExecutionConfig>();
+		config->cpu_affinity = cores;
+
+		// Kept for the lifetime of the thread
+		ExecutionGuard guard(config);
+
+		Tracer::set_thread_name("DataParallel worker");
+
+		for (;;)
+		{
+			std::packaged_task<void()> task;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+				if (tasks.empty())
+				{
+					return;
+				}
+
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+
+			TraceScope trace_scope("data_parallel", "task");
+
+			task();
+		}
+	}
+};
+
+namespace
+{
+	// Parses the cpulist format of sysfs, for example "0-7,16-23"
+	vector<int> parse_cpu_list(const string & cpu_list)
+	{
+		vector<int> cores;
+		std::stringstream stream(cpu_list);
+		string range;
+
+		while (std::getline(stream, range, ','))
+		{
+			if (range.empty() || range[0] == '\n')
+			{
+				continue;
+			}
+
+			auto dash_position = range.find('-');
+
+			int first = std::stoi(range.substr(0, dash_position));
+			int last = (dash_position == string::npos) ? first : std::stoi(range.substr(dash_position + 1));
+
+			for (int core = first; core <= last; ++core)
+			{
+				cores.push_back(core);
+			}
+		}
+
+		return cores;
+	}
+}
+
+torch::DataParallel::DataParallel(Module::Ptr module, vector<vector<int>> core_groups) :
+	module(module),
+	core_groups(core_groups),
+	replicated(false)
+{
+	if (this->core_groups.empty())
+	{
+		this->core_groups = numa_nodes();
+	}
+
+	for (auto & cores : this->core_groups)
+	{
+		workers.push_back(make_shared<Worker>(cores));
+	}
+
+	// Same name as in Pytorch, so the checkpoints
+	// of DataParallel models can be loaded
+	add_module("module", module);
+
+	module_name = "DataParallel";
+}
+
+torch::DataParallel::~DataParallel()
+{
+
+}
+
+torch::Module::Ptr torch::DataParallel::clone() const
+{
+	return make_shared<DataParallel>(module->clone(), core_groups);
+}
+
+void torch::DataParallel::replicate()
+{
+	vector<std::future<void>> results;
+
+	for (auto & worker : workers)
+	{
+		auto module = this->module;
+		Worker * worker_pointer = worker.get();
+
+		results.push_back(worker->submit([worker_pointer, module]()
+		{
+			worker_pointer->replica = module->clone();
+		}));
+	}
+
+	for (auto & result : results)
+	{
+		result.get();
+	}
+
+	replicated = true;
+}
+
+Tensor torch::DataParallel::forward(const Tensor & input)
+{
+	ForwardScope scope(this);
+
+	if (input.type().is_cuda() || workers.size() < 2)
+	{
+		return module->forward(input);
+	}
+
+	if (!replicated)
+	{
+		replicate();
+	}
+
+	int64_t batch_size = input.size(0);
+	int64_t shards_count = std::min(int64_t(workers.size()), batch_size);
+
+	vector<Tensor> outputs(shards_count);
+	vector<std::future<void>> results;
+
+	int64_t shard_start = 0;
+
+	for (int64_t i = 0; i < shards_count; ++i)
+	{
+		// First batch_size % shards_count shards get one more sample
+		int64_t shard_size = batch_size / shards_count + ((i < batch_size % shards_count) ? 1 : 0);
+
+		Tensor shard = input.narrow(0, shard_start, shard_size);
+		Worker * worker = workers[i].get();
+		Tensor * output = &outputs[i];
+
+		results.push_back(worker->submit([worker, shard, output]()
+		{
+			// Shard is copied by the worker in order to
+			// place it in the memory local to the node
+			*output = worker->replica->forward(shard.type().copy(shard));
+		}));
+
+		shard_start += shard_size;
+	}
+
+	// Rethrows the exceptions of the workers
+	for (auto & result : results)
+	{
+		result.get();
+	}
+
+	return cat(outputs, 0);
+}
+
+vector<vector<int>> torch::DataParallel::numa_nodes()
+{
+	vector<vector<int>> nodes;
+
+#ifdef __linux__
+	// Node numbers can have gaps, so we check all possible ones
+	const int MAX_NUMA_NODES = 256;
+
+	for (int node = 0; node < MAX_NUMA_NODES; ++node)
+	{
+		std::ifstream cpu_list_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+
+		if (!cpu_list_file.is_open())
+		{
+			continue;
+		}
+
+		string cpu_list;
+		std::getline(cpu_list_file, cpu_list);
+
+		auto cores = parse_cpu_list(cpu_list);
+
+		// Memory-only nodes don't have cores
+		if (!cores.empty())
+		{
+			nodes.push_back(cores);
+		}
+	}
+#endif
+
+	if (nodes.empty())
+	{
+		vector<int> cores;
+		int cores_count = std::max(1u, std::thread::hardware_concurrency());
+
+		for (int core = 0; core < cores_count; ++core)
+		{
+			cores.push_back(core);
+		}
+
+		nodes.push_back(cores);
+	}
+
+	return nodes;
+}
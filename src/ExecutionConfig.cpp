@@ -0,0 +1,296 @@
+#include "pytorch.h"
+
+#include <cstdlib>
+#include <cctype>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace
+{
+	// Config of the guard which is active on the current thread
+	thread_local const torch::ExecutionConfig * current_config = nullptr;
+
+	int team_size()
+	{
+#ifdef _OPENMP
+		return omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
+
+	int thread_index()
+	{
+#ifdef _OPENMP
+		return omp_get_thread_num();
+#else
+		return 0;
+#endif
+	}
+
+	vector<int> get_thread_affinity()
+	{
+		vector<int> cores;
+
+#ifdef __linux__
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+
+		if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0)
+		{
+			for (int core = 0; core < CPU_SETSIZE; ++core)
+			{
+				if (CPU_ISSET(core, &cpu_set))
+				{
+					cores.push_back(core);
+				}
+			}
+		}
+#endif
+
+		return cores;
+	}
+
+	void set_thread_affinity(const vector<int> & cores)
+	{
+#ifdef __linux__
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+
+		for (auto core : cores)
+		{
+			CPU_SET(core, &cpu_set);
+		}
+
+		sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+#endif
+	}
+
+	void check_openmp_wait_policy(torch::ExecutionConfig::WaitPolicy wait_policy)
+	{
+		if (wait_policy == torch::ExecutionConfig::WAIT_DEFAULT)
+		{
+			return;
+		}
+
+		const char * expected = (wait_policy == torch::ExecutionConfig::WAIT_SPIN) ? "ACTIVE" : "PASSIVE";
+		const char * environment_policy = std::getenv("OMP_WAIT_POLICY");
+
+		if (environment_policy != nullptr)
+		{
+			string policy = environment_policy;
+
+			for (auto & character : policy)
+			{
+				character = char(std::toupper(character));
+			}
+
+			if (policy == expected)
+			{
+				return;
+			}
+		}
+
+		static bool warned = false;
+
+		if (!warned)
+		{
+			warned = true;
+
+			cout << "WARNING: OpenMP threads read their wait policy on startup. "
+				<< "Run the process with OMP_WAIT_POLICY=" << expected
+				<< " to apply it to the kernels of ATen." << endl;
+		}
+	}
+}
+
+torch::ExecutionGuard::ExecutionGuard(const ExecutionConfig::Ptr & config) :
+	active(false),
+	previous_num_threads(0)
+{
+	if (!config || current_config != nullptr)
+	{
+		return;
+	}
+
+	active = true;
+	current_config = config.get();
+
+	int num_threads = config->num_threads;
+
+	if (num_threads <= 0 && !config->cpu_affinity.empty())
+	{
+		num_threads = int(config->cpu_affinity.size());
+	}
+
+#ifdef _OPENMP
+	// Only what differs is changed and restored, so a config which matches
+	// the settings of the thread costs no calls into OpenMP
+	if (num_threads > 0 && num_threads != team_size())
+	{
+		previous_num_threads = team_size();
+		omp_set_num_threads(num_threads);
+	}
+#endif
+
+	if (!config->cpu_affinity.empty())
+	{
+		// OpenMP reuses the threads of the team between parallel regions,
+		// so pinning them once here holds for all the kernels which are
+		// called while the guard is active
+		const vector<int> & cores = config->cpu_affinity;
+
+		previous_affinity.resize(team_size());
+
+#ifdef _OPENMP
+		#pragma omp parallel num_threads(int(previous_affinity.size()))
+#endif
+		{
+			int thread = thread_index();
+
+			previous_affinity[thread] = get_thread_affinity();
+			set_thread_affinity({ cores[thread % cores.size()] });
+		}
+	}
+
+	check_openmp_wait_policy(config->wait_policy);
+}
+
+torch::ExecutionGuard::~ExecutionGuard()
+{
+	if (!active)
+	{
+		return;
+	}
+
+	// The calling thread is a member of the team too, so it
+	// gets its own affinity back as well
+	if (!previous_affinity.empty())
+	{
+#ifdef _OPENMP
+		#pragma omp parallel num_threads(int(previous_affinity.size()))
+#endif
+		{
+			set_thread_affinity(previous_affinity[thread_index()]);
+		}
+	}
+
+#ifdef _OPENMP
+	if (previous_num_threads > 0)
+	{
+		omp_set_num_threads(previous_num_threads);
+	}
+#endif
+
+	current_config = nullptr;
+}
+
+const torch::ExecutionConfig * torch::ExecutionGuard::active_config()
+{
+	return current_config;
+}
+
+const torch::ExecutionConfig * torch::ExecutionGuard::set_active_config(const ExecutionConfig * config)
+{
+	const ExecutionConfig * previous = current_config;
+
+	current_config = config;
+
+	return previous;
+}
+
+bool torch::concurrent_branches_enabled()
+{
+	return (current_config != nullptr) && current_config->concurrent_branches;
+}
+
+thread_local vector<torch::Module *> * torch::ForwardScope::execution_order = nullptr;
+thread_local torch::WeightStream * torch::ForwardScope::active_stream = nullptr;
+thread_local torch::PerfCounters * torch::ForwardScope::perf_counters = nullptr;
+thread_local torch::Module * torch::ForwardScope::current_module = nullptr;
+
+torch::ForwardScope::ForwardScope(Module * module) :
+	previous_module(current_module),
+	nested(module == current_module),
+	trace_scope("forward", module->module_name, !nested),
+	execution_guard(nested ? ExecutionConfig::Ptr() : module->execution_config),
+	module(module),
+	previous_stream(active_stream)
+{
+	if (nested)
+	{
+		return;
+	}
+
+	if (execution_order != nullptr)
+	{
+		execution_order->push_back(module);
+	}
+
+	// Allocating them here wouldn't be safe when the model is run by several threads
+	if (!module->is_materialized())
+	{
+		throw std::runtime_error("forward(): weights of " + module->module_name +
+			" are not allocated. Call load_weights() or materialize() first.");
+	}
+
+	// After the check, the destructor doesn't run if it throws
+	current_module = module;
+
+	if (module->weight_stream)
+	{
+		active_stream = module->weight_stream.get();
+	}
+
+	if (active_stream != nullptr)
+	{
+		active_stream->module_started(module);
+	}
+
+	// Last, so the counts don't include the work of the scope
+	if (perf_counters != nullptr)
+	{
+		perf_counters->module_started(module);
+	}
+}
+
+torch::WeightStream * torch::ForwardScope::current_stream()
+{
+	return active_stream;
+}
+
+torch::WeightStream * torch::ForwardScope::set_current_stream(WeightStream * stream)
+{
+	WeightStream * previous = active_stream;
+
+	active_stream = stream;
+
+	return previous;
+}
+
+torch::ForwardScope::~ForwardScope()
+{
+	if (nested)
+	{
+		return;
+	}
+
+	if (perf_counters != nullptr)
+	{
+		perf_counters->module_finished(module);
+	}
+
+	if (active_stream != nullptr)
+	{
+		active_stream->module_finished(module);
+	}
+
+	active_stream = previous_stream;
+	current_module = previous_module;
+}
@@ -0,0 +1,50 @@
+#include "pytorch.h"
+
+torch::Flatten::Flatten()
+{
+	module_name = "Flatten";
+};
+
+torch::Flatten::~Flatten()
+{
+
+};
+
+torch::Module::Ptr torch::Flatten::clone() const
+{
+	auto copy = make_shared<Flatten>(*this);
+	copy->clone_contents();
+
+	return copy;
+};
+
+Tensor torch::Flatten::forward(const Tensor & input)
+{
+	ForwardScope scope(this);
+
+	return input.contiguous().view({input.size(0), -1});
+};
+
+string torch::Flatten::tostring(int indentation_level)
+{
+	string indentation = string(indentation_level, ' ');
+
+	return indentation + std::string("Flatten");
+}
+
+vector<int64_t> torch::Flatten::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	int64_t elements = 1;
+
+	for (size_t i = 1; i < input_sizes.size(); ++i)
+	{
+		elements *= input_sizes[i];
+	}
+
+	// A view when the input is contiguous, counted as a copy
+	// when the input is still used by the caller
+	return analysis.add_layer(module_name, 0, path, input_sizes, {input_sizes[0], elements}, 0, in_place, true);
+}
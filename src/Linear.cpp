@@ -9,13 +9,14 @@ torch::Linear::Linear( int in_features,
 {
     // Initialize weights here
 
-    parameters["weight"] = TENSOR_DEFAULT_TYPE.zeros({out_features, in_features});
+    // Allocated on the load
+    declare_parameter("weight", {out_features, in_features});
 
     // Check if we need bias for our convolution
     if(bias)
     {
 
-    parameters["bias"] = TENSOR_DEFAULT_TYPE.ones({out_features});
+    declare_parameter("bias", {out_features}, 1);
     }
     else
     {
@@ -23,6 +24,8 @@ torch::Linear::Linear( int in_features,
     // don't know why this works yet, doesn't work with TENSOR_DEFAULT_TYPE.tensor();
     parameters["bias"] = Tensor();
     }
+
+    module_name = "Linear";
 };
 
 torch::Linear::~Linear() 
@@ -30,6 +33,14 @@ torch::Linear::~Linear()
 
 };
 
+torch::Module::Ptr torch::Linear::clone() const
+{
+    auto copy = make_shared<Linear>(*this);
+    copy->clone_contents();
+
+    return copy;
+};
+
 string torch::Linear::tostring(int indentation_level)
 {
 
@@ -47,19 +58,54 @@ string torch::Linear::tostring(int indentation_level)
 
 };
 
-Tensor torch::Linear::forward(Tensor input)
+Tensor torch::Linear::forward(const Tensor & input)
 {
+	ForwardScope scope(this);
+
+    Tensor output;
+
+    forward_out(input, output);
+
+    return output; 
+};
+
+Tensor & torch::Linear::forward_out(const Tensor & input, Tensor & output)
+{
+	ForwardScope scope(this);
+
     // https://github.com/pytorch/pytorch/blob/49ec984c406e67107aae2891d24c8839b7dc7c33/torch/nn/_functions/linear.py
 
-    Tensor output = input.type().zeros({input.size(0), parameters["weight"].size(0)});
+    prepare_output(output, input.type(), {input.size(0), parameters["weight"].size(0)});
 
-    output.addmm_(input, parameters["weight"].t(), 0, 1);
-         
+    // Bias is written first and then accumulated by addmm
+    // which saves us a separate pass over the output
     if(bias)
     {
-    // TODO: check if in-place resize affects the result
-    output.add_(parameters["bias"].expand({output.size(0), output.size(1)}));  
+    output.copy_(parameters["bias"].expand({output.size(0), output.size(1)}));
     }
-         
-    return output; 
+    else
+    {
+    output.zero_();
+    }
+
+    output.addmm_(input, parameters["weight"].t(), 1, 1);
+
+    return output;
 };
+
+vector<int64_t> torch::Linear::analyze_module(const vector<int64_t> & input_sizes,
+    ShapeAnalysis & analysis,
+    const string & path,
+    bool in_place)
+{
+    if (input_sizes.size() != 2 || input_sizes[1] != in_features)
+    {
+        throw std::runtime_error("analyze(): Linear ('" + path + "') expects N x " +
+            std::to_string(in_features) + " input");
+    }
+
+    vector<int64_t> output_sizes = {input_sizes[0], out_features};
+
+    return analysis.add_layer(module_name, weight_bytes(), path, input_sizes, output_sizes,
+        input_sizes[0] * in_features * out_features, in_place, false);
+}
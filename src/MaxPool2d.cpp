@@ -1,5 +1,11 @@
 #include "pytorch.h"
 
+namespace
+{
+	// Guards grads["indices"] of the modules run by several threads
+	std::mutex indices_mutex;
+}
+
 torch::MaxPool2d::MaxPool2d(
 	int kernel_width,
 	int kernel_height,
@@ -20,6 +26,8 @@ torch::MaxPool2d::MaxPool2d(
 	// Change to make it gpu or cpu depending
 	// on the network placement
 	grads["indices"] = CPU(kLong).tensor();
+
+	module_name = "MaxPool2d";
 };
 
 torch::MaxPool2d::~MaxPool2d()
@@ -27,12 +35,56 @@ torch::MaxPool2d::~MaxPool2d()
 
 };
 
-Tensor torch::MaxPool2d::forward(Tensor input)
+torch::Module::Ptr torch::MaxPool2d::clone() const
+{
+	auto copy = make_shared<MaxPool2d>(*this);
+	copy->clone_contents();
+
+	return copy;
+};
+
+Tensor torch::MaxPool2d::forward(const Tensor & input)
+{
+	ForwardScope scope(this);
+
+	Tensor output;
+
+	return forward_out(input, output);
+};
+
+Tensor & torch::MaxPool2d::forward_out(const Tensor & input, Tensor & output)
 {
-	Tensor output = input.type().tensor();
+	ForwardScope scope(this);
 
-	max_pool2d_forward_out(input, grads["indices"], output, {kernel_width, kernel_height}, {stride_width, stride_height}, {padding_width, padding_height}, {0, 0}, ceil_mode);
+	// The kernel writes the output as if it was contiguous,
+	// so the strided ones get a copy
+	if (output.defined() && !output.is_contiguous())
+	{
+		return Module::forward_out(input, output);
+	}
 
+	// Sizes are computed in the same order as the arguments of
+	// max_pool2d_forward_out() are passed
+	auto output_sizes = input.sizes().vec();
+	auto dims = output_sizes.size();
+
+	output_sizes[dims - 2] = pooling_output_size(input.size(dims - 2), kernel_width, stride_width, padding_width, ceil_mode);
+	output_sizes[dims - 1] = pooling_output_size(input.size(dims - 1), kernel_height, stride_height, padding_height, ceil_mode);
+
+	prepare_output(output, input.type(), output_sizes);
+
+	// Indices are written by every call, so the same module can be run by several
+	// threads at once. The allocator of the module (if any) reuses their memory.
+	Tensor indices = new_tensor(input.type().toScalarType(kLong), output_sizes);
+
+	max_pool2d_forward_out(input, indices, output, {kernel_width, kernel_height}, {stride_width, stride_height}, {padding_width, padding_height}, {0, 0}, ceil_mode);
+
+	// Indices of the last call are kept for the backward pass
+	{
+		std::lock_guard<std::mutex> lock(indices_mutex);
+
+		grads["indices"] = indices;
+	}
 
 	return output;
 };
@@ -51,3 +103,25 @@ string torch::MaxPool2d::tostring(int indentation_level)
 
 	return string_stream.str();
 };
+
+vector<int64_t> torch::MaxPool2d::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	auto output_sizes = input_sizes;
+	auto dims = output_sizes.size();
+
+	output_sizes[dims - 2] = pooling_output_size(input_sizes[dims - 2], kernel_width, stride_width, padding_width, ceil_mode);
+	output_sizes[dims - 1] = pooling_output_size(input_sizes[dims - 1], kernel_height, stride_height, padding_height, ceil_mode);
+
+	int64_t output_elements = 1;
+
+	for (auto size : output_sizes)
+	{
+		output_elements *= size;
+	}
+
+	return analysis.add_layer(module_name, 0, path, input_sizes, output_sizes,
+		output_elements * kernel_width * kernel_height, in_place, false);
+}
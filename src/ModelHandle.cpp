@@ -0,0 +1,69 @@
+#include "pytorch.h"
+
+torch::ModelHandle::ModelHandle(Factory model_factory, const string & hdf5_filename, Transform transform) :
+	model_factory(model_factory),
+	transform(transform),
+	current_version(1)
+{
+	std::atomic_store(&model, load(hdf5_filename));
+}
+
+torch::ModelHandle::~ModelHandle()
+{
+	std::lock_guard<std::mutex> lock(reload_mutex);
+
+	if (last_reload.valid())
+	{
+		last_reload.wait();
+	}
+}
+
+torch::Module::Ptr torch::ModelHandle::get() const
+{
+	return std::atomic_load(&model);
+}
+
+uint64_t torch::ModelHandle::version() const
+{
+	return current_version;
+}
+
+torch::Module::Ptr torch::ModelHandle::load(const string & hdf5_filename)
+{
+	auto new_model = model_factory();
+
+	new_model->load_weights(hdf5_filename);
+
+	if (transform)
+	{
+		new_model = transform(new_model);
+	}
+
+	return new_model;
+}
+
+std::shared_future<void> torch::ModelHandle::reload(const string & hdf5_filename)
+{
+	std::lock_guard<std::mutex> lock(reload_mutex);
+
+	auto previous_reload = last_reload;
+
+	last_reload = std::async(std::launch::async, [this, hdf5_filename, previous_reload]
+	{
+		// Reloads are applied in the order of the calls, a failed
+		// one doesn't stop the next
+		if (previous_reload.valid())
+		{
+			previous_reload.wait();
+		}
+
+		auto new_model = load(hdf5_filename);
+
+		// Requests which already hold the old version keep it alive,
+		// the new ones get the new version
+		std::atomic_store(&model, new_model);
+		current_version++;
+	}).share();
+
+	return last_reload;
+}
@@ -1,5 +1,85 @@
 #include "pytorch.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <typeinfo>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace
+{
+	// Tensors in the arena start at multiples of 64 bytes
+	const int64_t ARENA_ALIGNMENT = 64;
+
+	// Execution config and weight stream of the thread which runs
+	// the forward pass, set on a worker for the time of a branch
+	struct BranchContext
+	{
+		const torch::ExecutionConfig * previous_config;
+		torch::WeightStream * previous_stream;
+
+		BranchContext(const torch::ExecutionConfig * config, torch::WeightStream * stream) :
+			previous_config(torch::ExecutionGuard::set_active_config(config)),
+			previous_stream(torch::ForwardScope::set_current_stream(stream))
+		{
+		}
+
+		~BranchContext()
+		{
+			torch::ForwardScope::set_current_stream(previous_stream);
+			torch::ExecutionGuard::set_active_config(previous_config);
+		}
+	};
+
+	Tensor allocate_arena(const Type & type, int64_t elements)
+	{
+		if (type.is_cuda())
+		{
+			return type.tensor({elements});
+		}
+
+		size_t bytes = std::max(size_t(elements) * type.elementSizeInBytes(), size_t(ARENA_ALIGNMENT));
+		void * data = nullptr;
+
+#ifdef _WIN32
+		data = _aligned_malloc(bytes, ARENA_ALIGNMENT);
+#else
+		if (posix_memalign(&data, ARENA_ALIGNMENT, bytes) != 0)
+		{
+			data = nullptr;
+		}
+#endif
+
+		if (data == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+
+		return torch::from_buffer(data, type, {elements}, {}, [](void * pointer)
+		{
+#ifdef _WIN32
+			_aligned_free(pointer);
+#else
+			free(pointer);
+#endif
+		});
+	}
+
+	int64_t elements_count(const vector<int64_t> & sizes)
+	{
+		int64_t count = 1;
+
+		for (auto size : sizes)
+		{
+			count *= size;
+		}
+
+		return count;
+	}
+}
+
 torch::Module::Module()
 {
 	submodule_counter = 0;
@@ -10,11 +90,54 @@ torch::Module::~Module()
 
 }
 
-Tensor torch::Module::forward(Tensor input)
+Tensor torch::Module::forward(const Tensor & input)
 {
 	return input;
 }
 
+Tensor torch::Module::forward_(Tensor & input)
+{
+	return forward(input);
+}
+
+Tensor & torch::Module::forward_out(const Tensor & input, Tensor & output)
+{
+	Tensor result = forward(input);
+
+	prepare_output(output, result.type(), result.sizes());
+	output.copy_(result);
+
+	return output;
+}
+
+void torch::Module::prepare_output(Tensor & output, const Type & type, IntList sizes)
+{
+	// First call -- allocate the buffer which will be reused later on
+	if (!output.defined())
+	{
+		output = new_tensor(type, sizes);
+		return;
+	}
+
+	// We don't silently resize the output: the caller expects the
+	// provided memory to be used, so it's better to fail fast
+	if (&output.type() != &type)
+	{
+		throw std::runtime_error(string("forward_out(): expected output of type ") + type.toString() +
+			" but got " + output.type().toString());
+	}
+
+	if (!output.sizes().equals(sizes))
+	{
+		std::stringstream error_message;
+
+		error_message << "forward_out(): expected output of size " << sizes
+			<< " but got " << output.sizes();
+
+		throw std::runtime_error(error_message.str());
+	}
+}
+
 string  torch::Module::tostring(int indentation_level)
 {
 
@@ -24,7 +147,7 @@ string  torch::Module::tostring(int indentation_level)
 
 	s << indentation << module_name << " (" << std::endl;
 
-	for (auto name_module_pair : modules)
+	for (auto & name_module_pair : modules)
 	{
 
 		s << indentation << " (" << name_module_pair.first << ") "
@@ -36,6 +159,162 @@ string  torch::Module::tostring(int indentation_level)
 	return s.str();
 }
 
+void torch::Module::set_allocator(CachingAllocator::Ptr allocator)
+{
+	this->allocator = allocator;
+
+	for (auto & name_module_pair : modules)
+	{
+		name_module_pair.second->set_allocator(allocator);
+	}
+}
+
+void torch::Module::set_execution_config(ExecutionConfig::Ptr execution_config)
+{
+	this->execution_config = execution_config;
+
+	for (auto & name_module_pair : modules)
+	{
+		name_module_pair.second->set_execution_config(execution_config);
+	}
+}
+
+Tensor torch::Module::new_tensor(const Type & type, IntList sizes)
+{
+	if (allocator)
+	{
+		return allocator->tensor(type, sizes);
+	}
+
+	return type.tensor(sizes);
+}
+
+torch::Module::Ptr torch::Module::clone() const
+{
+	// Copying a derived module as a Module would lose its forward()
+	if (typeid(*this) != typeid(Module))
+	{
+		throw std::runtime_error("clone() is not implemented for " + module_name +
+			", override it in the module");
+	}
+
+	auto copy = make_shared<Module>(*this);
+	copy->clone_contents();
+
+	return copy;
+}
+
+void torch::Module::clone_contents()
+{
+	// Tensors of the copy are allocated separately
+	arena = Tensor();
+	arena_index.clear();
+	weight_stream.reset();
+
+	auto copy_tensor = [](Tensor & tensor)
+	{
+		return tensor.type().copy(tensor);
+	};
+
+	for (auto & name_parameter_pair : parameters)
+	{
+		if (name_parameter_pair.second.defined())
+		{
+			name_parameter_pair.second = copy_tensor(name_parameter_pair.second);
+		}
+	}
+
+	for (auto & name_buffer_pair : buffers)
+	{
+		name_buffer_pair.second = copy_tensor(name_buffer_pair.second);
+	}
+
+	for (auto & name_grad_pair : grads)
+	{
+		name_grad_pair.second = copy_tensor(name_grad_pair.second);
+	}
+
+	for (auto & name_module_pair : modules)
+	{
+		name_module_pair.second = name_module_pair.second->clone();
+	}
+}
+
+torch::Module::Ptr torch::Module::get_module(const string & name) const
+{
+	for (auto & name_module_pair : modules)
+	{
+		if (name_module_pair.first == name)
+		{
+			return name_module_pair.second;
+		}
+	}
+
+	return nullptr;
+}
+
+vector<Tensor> torch::Module::forward_branches(const vector<std::function<Tensor()>> & branches)
+{
+	vector<Tensor> outputs(branches.size());
+
+	if (!concurrent_branches_enabled() || branches.size() < 2)
+	{
+		for (size_t i = 0; i < branches.size(); ++i)
+		{
+			outputs[i] = branches[i]();
+		}
+
+		return outputs;
+	}
+
+	// The calling thread runs the first branch itself
+	TaskGroup group;
+
+	// The config is only marked active on the workers, so the modules of
+	// the branches don't change threads_per_task of the pool or pin the
+	// workers. Streamed weights of the branches are handled there too.
+	const ExecutionConfig * config = ExecutionGuard::active_config();
+	WeightStream * stream = ForwardScope::current_stream();
+
+	for (size_t i = 1; i < branches.size(); ++i)
+	{
+		auto & branch = branches[i];
+		auto & output = outputs[i];
+
+		group.run([&branch, &output, config, stream]()
+		{
+			BranchContext context(config, stream);
+
+			output = branch();
+		});
+	}
+
+	outputs[0] = branches[0]();
+
+	group.wait();
+
+	return outputs;
+}
+
+vector<Tensor> torch::Module::forward_branches(const vector<Module::Ptr> & branches, const vector<Tensor> & inputs)
+{
+	vector<std::function<Tensor()>> calls;
+
+	for (size_t i = 0; i < branches.size(); ++i)
+	{
+		calls.push_back([&branches, &inputs, i]() { return branches[i]->forward(inputs[i]); });
+	}
+
+	return forward_branches(calls);
+}
+
+vector<torch::Module::Ptr> torch::Module::split_stages()
+{
+	// Forward pass of an arbitrary module can use
+	// its submodules in any order
+	return vector<Module::Ptr>();
+}
+
 void torch::Module::add_module(string module_name, Module::Ptr module)
 {
 	modules.push_back(pair<string, Module::Ptr>(module_name, module));
@@ -48,56 +327,92 @@ void torch::Module::add(Module::Ptr module)
 	submodule_counter++;
 }
 
-map<string, Tensor> torch::Module::state_dict(map<string, Tensor> & destination, string prefix)
+map<string, Tensor> & torch::Module::state_dict(map<string, Tensor> & destination, const string & prefix)
 {
 	// TODO: add another function that will not accept any parameters
 	// and just return the state_dict()
-	for (auto name_parameter_pair : parameters)
+	// Packed weights have a flat index with the names ready
+	if (arena.defined())
+	{
+		for (auto & entry : arena_index)
+		{
+			auto & tensors = entry.is_buffer ? entry.module->buffers : entry.module->parameters;
+
+			destination[prefix.empty() ? entry.name : prefix + entry.name] = tensors[entry.local_name];
+		}
+
+		return destination;
+	}
+
+	string prefix_buffer = prefix;
+
+	// Declared tensors have to exist to be saved or copied into
+	materialize();
+
+	collect_state_dict(destination, prefix_buffer);
+
+	return destination;
+}
+
+void torch::Module::collect_state_dict(map<string, Tensor> & destination, string & prefix)
+{
+	// Names are appended to the prefix and the prefix is truncated
+	// back afterwards, so no new strings are created for submodules
+	const size_t prefix_length = prefix.size();
+
+	for (auto & name_parameter_pair : parameters)
 	{
 		// Check if the parameter defined -- for example if we don't use bias
 		// in the convolution, the bias weight will be undefined.
 		// We need this in order to match the state_dict() function of Pytorch
 		if (name_parameter_pair.second.defined())
 		{
-			destination[prefix + name_parameter_pair.first] = name_parameter_pair.second;
+			prefix.append(name_parameter_pair.first);
+			destination[prefix] = name_parameter_pair.second;
+			prefix.resize(prefix_length);
 		}
 	}
 
-	for (auto name_buffer_pair : buffers)
+	for (auto & name_buffer_pair : buffers)
 	{
-		destination[prefix + name_buffer_pair.first] = name_buffer_pair.second;
+		prefix.append(name_buffer_pair.first);
+		destination[prefix] = name_buffer_pair.second;
+		prefix.resize(prefix_length);
 	}
 
-	for (auto name_module_pair : modules)
+	for (auto & name_module_pair : modules)
 	{
-		name_module_pair.second->state_dict(destination, prefix + name_module_pair.first + '.');
+		prefix.append(name_module_pair.first);
+		prefix.push_back('.');
+		name_module_pair.second->collect_state_dict(destination, prefix);
+		prefix.resize(prefix_length);
 	}
-
-	return destination;
 }
 
 template<typename Func>	void torch::Module::apply(Func closure)
 {
-	for (auto name_parameter_pair : parameters)
+	// Iterating by reference lets us assign the result in place
+	// instead of doing a second lookup in the map
+	for (auto & name_parameter_pair : parameters)
 	{
 		if (name_parameter_pair.second.defined())
 		{
 			// maybe catch if it is undefined here
-			parameters[name_parameter_pair.first] = closure(name_parameter_pair.second);
+			name_parameter_pair.second = closure(name_parameter_pair.second);
 		}
 	}
 
-	for (auto name_buffer_pair : buffers)
+	for (auto & name_buffer_pair : buffers)
 	{
-		buffers[name_buffer_pair.first] = closure(name_buffer_pair.second);
+		name_buffer_pair.second = closure(name_buffer_pair.second);
 	}
 
-	for (auto name_grad_pair : grads)
+	for (auto & name_grad_pair : grads)
 	{
-		grads[name_grad_pair.first] = closure(name_grad_pair.second);
+		name_grad_pair.second = closure(name_grad_pair.second);
 	}
 
-	for (auto name_module_pair : modules)
+	for (auto & name_module_pair : modules)
 	{
 		name_module_pair.second->apply(closure);
 	}
@@ -106,30 +421,54 @@ template<typename Func>	void torch::Module::apply(Func closure)
 void torch::Module::cuda()
 {
 	// Transfer each tensor to GPU
+	// Packed weights are moved in one transfer, then
+	// apply() has nothing to do for them
+	move_arena(Backend::CUDA);
+
 	this->apply([](Tensor & tensor)
 	{
 		return tensor.toBackend(Backend::CUDA);
 	}
 	);
+
+	// Declared tensors will be allocated on GPU right away
+	set_declared_backend(Backend::CUDA);
+
+	weights_updated();
 }
 
 void torch::Module::cpu()
 {
 	// Transfer each tensor to CPU
+	move_arena(Backend::CPU);
+
 	this->apply([](Tensor & tensor)
 	{
 		return tensor.toBackend(Backend::CPU);
 	});
+
+	set_declared_backend(Backend::CPU);
+
+	weights_updated();
 }
 
-void torch::Module::save_weights(string hdf5_filename)
+void torch::Module::save_weights(const string & hdf5_filename)
 {
 	map<string, Tensor> model_state_dict;
 	this->state_dict(model_state_dict);
 	save(hdf5_filename, model_state_dict);
 }
 
-void torch::Module::load_weights(string hdf5_filename)
+void torch::Module::load_weights(const string & hdf5_filename, const LoadOptions & options)
+{
+	H5::H5File file = H5::H5File(hdf5_filename, H5F_ACC_RDONLY);
+
+	load_weights(file, options);
+
+	file.close();
+}
+
+void torch::Module::load_weights(H5::H5File & file, const LoadOptions & options)
 {
 	// TODO:
 	// (1) Add check to make sure that the network is on cpu
@@ -140,22 +479,75 @@ void torch::Module::load_weights(string hdf5_filename)
 	map<string, Tensor> model_state_dict;
 	map<string, Tensor> checkpoint_dict;
 
+	// Packed weights are read straight into the arena
+	if (arena.defined())
+	{
+		this->state_dict(model_state_dict);
+
+		auto loaded_names = load_into(file, model_state_dict, options);
+
+		for (auto & name_tensor_pair : model_state_dict)
+		{
+			if (loaded_names.count(name_tensor_pair.first) == 0)
+			{
+				cout << "WARNING: model requires parameter ('" << name_tensor_pair.first << "') "
+					<< "which is not present in the checkpoint file. Using model's default." << endl;
+			}
+		}
+
+		for (auto & checkpoint_name : get_hdf5_file_keys(file))
+		{
+			auto name = options.target_name(checkpoint_name);
+
+			if (!name.empty() && model_state_dict.count(name) != 1)
+			{
+				cout << "WARNING: checkpoint file contains parameter ('" << name << "') "
+					<< "which is not required by the model. The parameter is not used." << endl;
+			}
+		}
+
+		weights_updated();
+
+		return;
+	}
+
+	checkpoint_dict = load(file, options);
+
+	// Declared tensors take the tensors of the checkpoint instead
+	// of being allocated and overwritten
+	std::set<string> adopted;
+	string prefix_buffer;
+
+	adopt_declared_tensors(checkpoint_dict, prefix_buffer, true, true, adopted);
+
 	this->state_dict(model_state_dict);
-	checkpoint_dict = load(hdf5_filename);
 
 	// Compare model_state_dict -> checkpoint_dict keys consistency
+	// and copy the weights that are present in-place
 
-	for (auto name_tensor_pair : model_state_dict)
+	for (auto & name_tensor_pair : model_state_dict)
 	{
-		if (checkpoint_dict.count(name_tensor_pair.first) != 1)
+		if (adopted.count(name_tensor_pair.first) != 0)
+		{
+			continue;
+		}
+
+		auto checkpoint_entry = checkpoint_dict.find(name_tensor_pair.first);
+
+		if (checkpoint_entry == checkpoint_dict.end())
 		{
 			cout << "WARNING: model requires parameter ('" << name_tensor_pair.first << "') "
 				<< "which is not present in the checkpoint file. Using model's default." << endl;
+
+			continue;
 		}
+
+		// Copy in-place
+		name_tensor_pair.second.copy_(checkpoint_entry->second);
 	}
 
 	// Compare checkpoint_dict -> model_state_dict keys consistency
-	for (auto name_tensor_pair : checkpoint_dict)
+	for (auto & name_tensor_pair : checkpoint_dict)
 	{
 		if (model_state_dict.count(name_tensor_pair.first) != 1)
 		{
@@ -164,12 +556,404 @@ void torch::Module::load_weights(string hdf5_filename)
 		}
 	}
 
-	for (auto name_tensor_pair : model_state_dict)
+	weights_updated();
+}
+void torch::Module::bind_weights(const map<string, Tensor> & dict, bool check_types)
+{
+	string prefix_buffer;
+	std::set<string> adopted;
+
+	// The tensors of the model won't be in the arena anymore
+	arena = Tensor();
+	arena_index.clear();
+	weight_stream.reset();
+
+	// Declared tensors are bound without being allocated first
+	adopt_declared_tensors(dict, prefix_buffer, false, check_types, adopted);
+	materialize();
+
+	size_t bound_count = bind_state_dict(dict, prefix_buffer, check_types);
+
+	weights_updated();
+
+	if (bound_count != dict.size())
+	{
+		cout << "WARNING: " << dict.size() - bound_count << " tensors of the dict "
+			<< "are not required by the model. They are not used." << endl;
+	}
+}
+
+size_t torch::Module::bind_state_dict(const map<string, Tensor> & dict, string & prefix, bool check_types)
+{
+	const size_t prefix_length = prefix.size();
+	size_t bound_count = 0;
+
+	// Same names as the ones of state_dict()
+	auto bind_tensors = [&](map<string, Tensor> & tensors)
+	{
+		for (auto & name_tensor_pair : tensors)
+		{
+			prefix.append(name_tensor_pair.first);
+
+			auto entry = dict.find(prefix);
+
+			// Undefined ones (a convolution without bias) can be
+			// defined by the dict only if the types aren't checked
+			if (!name_tensor_pair.second.defined())
+			{
+				if (!check_types && entry != dict.end())
+				{
+					name_tensor_pair.second = entry->second;
+					++bound_count;
+				}
+			}
+			else if (entry == dict.end())
+			{
+				cout << "WARNING: model requires parameter ('" << prefix << "') "
+					<< "which is not present in the dict. Using model's default." << endl;
+			}
+			else if (check_types && (&entry->second.type() != &name_tensor_pair.second.type() ||
+				!entry->second.sizes().equals(name_tensor_pair.second.sizes())))
+			{
+				std::stringstream error_message;
+
+				error_message << "bind_weights(): parameter ('" << prefix << "') of the model is "
+					<< name_tensor_pair.second.type().toString() << " " << name_tensor_pair.second.sizes()
+					<< " but got " << entry->second.type().toString() << " " << entry->second.sizes();
+
+				throw std::runtime_error(error_message.str());
+			}
+			else
+			{
+				name_tensor_pair.second = entry->second;
+				++bound_count;
+			}
+
+			prefix.resize(prefix_length);
+		}
+	};
+
+	bind_tensors(parameters);
+	bind_tensors(buffers);
+
+	for (auto & name_module_pair : modules)
+	{
+		prefix.append(name_module_pair.first);
+		prefix.push_back('.');
+		bound_count += name_module_pair.second->bind_state_dict(dict, prefix, check_types);
+		prefix.resize(prefix_length);
+	}
+
+	return bound_count;
+}
+
+void torch::Module::weights_updated()
+{
+	for (auto & name_module_pair : modules)
+	{
+		name_module_pair.second->weights_updated();
+	}
+}
+
+void torch::Module::declare_parameter(const string & name, IntList sizes, double fill_value)
+{
+	if (declared_type == nullptr)
+	{
+		declared_type = &default_type();
+	}
+
+	declared_tensors[name] = DeclaredTensor{sizes.vec(), fill_value, false};
+}
+
+void torch::Module::declare_buffer(const string & name, IntList sizes, double fill_value)
+{
+	if (declared_type == nullptr)
+	{
+		declared_type = &default_type();
+	}
+
+	declared_tensors[name] = DeclaredTensor{sizes.vec(), fill_value, true};
+}
+
+bool torch::Module::is_materialized() const
+{
+	return declared_tensors.empty();
+}
+
+void torch::Module::materialize()
+{
+	for (auto & name_declared_pair : declared_tensors)
+	{
+		auto & declared = name_declared_pair.second;
+
+		auto tensor = declared_type->zeros(declared.sizes);
+
+		if (declared.fill_value != 0)
+		{
+			tensor.fill_(declared.fill_value);
+		}
+
+		if (declared.is_buffer)
+		{
+			buffers[name_declared_pair.first] = tensor;
+		}
+		else
+		{
+			parameters[name_declared_pair.first] = tensor;
+		}
+	}
+
+	declared_tensors.clear();
+
+	for (auto & name_module_pair : modules)
+	{
+		name_module_pair.second->materialize();
+	}
+}
+
+void torch::Module::adopt_declared_tensors(const map<string, Tensor> & dict, string & prefix,
+	bool convert_type, bool check_types, std::set<string> & adopted)
+{
+	const size_t prefix_length = prefix.size();
+
+	for (auto declared = declared_tensors.begin(); declared != declared_tensors.end();)
+	{
+		prefix.append(declared->first);
+
+		auto entry = dict.find(prefix);
+		bool taken = false;
+
+		// Tensors of other sizes are left to the caller, which reports them
+		if (entry != dict.end() && (!check_types || entry->second.sizes().equals(declared->second.sizes)))
+		{
+			Tensor tensor;
+
+			if (!check_types || &entry->second.type() == declared_type)
+			{
+				tensor = entry->second;
+			}
+			else if (convert_type)
+			{
+				tensor = declared_type->copy(entry->second);
+			}
+
+			if (tensor.defined())
+			{
+				auto & tensors = declared->second.is_buffer ? buffers : parameters;
+
+				tensors[declared->first] = tensor;
+				adopted.insert(prefix);
+				taken = true;
+			}
+		}
+
+		prefix.resize(prefix_length);
+
+		declared = taken ? declared_tensors.erase(declared) : std::next(declared);
+	}
+
+	for (auto & name_module_pair : modules)
+	{
+		prefix.append(name_module_pair.first);
+		prefix.push_back('.');
+		name_module_pair.second->adopt_declared_tensors(dict, prefix, convert_type, check_types, adopted);
+		prefix.resize(prefix_length);
+	}
+}
+
+void torch::Module::set_declared_backend(Backend backend)
+{
+	if (declared_type != nullptr)
+	{
+		declared_type = &declared_type->toBackend(backend);
+	}
+
+	for (auto & name_module_pair : modules)
 	{
-		if (checkpoint_dict.count(name_tensor_pair.first) == 1)
+		name_module_pair.second->set_declared_backend(backend);
+	}
+}
+
+void torch::Module::collect_named_modules(string & prefix, vector<pair<string, Module *>> & named_modules)
+{
+	const size_t prefix_length = prefix.size();
+
+	named_modules.push_back(std::make_pair(prefix, this));
+
+	for (auto & name_module_pair : modules)
+	{
+		prefix.append(name_module_pair.first);
+		prefix.push_back('.');
+		name_module_pair.second->collect_named_modules(prefix, named_modules);
+		prefix.resize(prefix_length);
+	}
+}
+
+vector<pair<string, torch::Module *>> torch::Module::named_modules()
+{
+	vector<pair<string, Module *>> named_modules;
+	string prefix_buffer;
+
+	collect_named_modules(prefix_buffer, named_modules);
+
+	// Prefixes end with a dot
+	for (auto & name_module_pair : named_modules)
+	{
+		if (!name_module_pair.first.empty())
 		{
-			// Copy in-place
-			name_tensor_pair.second.copy_(checkpoint_dict[name_tensor_pair.first]);
+			name_module_pair.first.pop_back();
 		}
 	}
-}
\ No newline at end of file
+
+	return named_modules;
+}
+
+void torch::Module::pack_weights(const Tensor & sample_input)
+{
+	materialize();
+
+	vector<pair<string, Module *>> named_modules;
+	string prefix_buffer;
+
+	collect_named_modules(prefix_buffer, named_modules);
+
+	if (sample_input.defined())
+	{
+		vector<Module *> execution_order;
+
+		ForwardScope::execution_order = &execution_order;
+
+		try
+		{
+			forward(sample_input);
+		}
+		catch (...)
+		{
+			ForwardScope::execution_order = nullptr;
+			throw;
+		}
+
+		ForwardScope::execution_order = nullptr;
+
+		// The first run of a module counts. Modules which didn't
+		// run at all go after the others in the same order as before.
+		map<Module *, size_t> ranks;
+
+		for (size_t i = 0; i < execution_order.size(); ++i)
+		{
+			ranks.insert(std::make_pair(execution_order[i], i));
+		}
+
+		auto rank = [&ranks](const pair<string, Module *> & named_module)
+		{
+			auto entry = ranks.find(named_module.second);
+
+			return (entry == ranks.end()) ? ranks.size() : entry->second;
+		};
+
+		std::stable_sort(named_modules.begin(), named_modules.end(),
+			[&rank](const pair<string, Module *> & first, const pair<string, Module *> & second)
+		{
+			return rank(first) < rank(second);
+		});
+	}
+
+	vector<ArenaEntry> new_index;
+	vector<Tensor> tensors_to_pack;
+	int64_t arena_size = 0;
+	const Type * arena_type = nullptr;
+
+	for (auto & named_module : named_modules)
+	{
+		for (int is_buffer = 0; is_buffer < 2; ++is_buffer)
+		{
+			auto & tensors = is_buffer ? named_module.second->buffers : named_module.second->parameters;
+
+			for (auto & name_tensor_pair : tensors)
+			{
+				auto & tensor = name_tensor_pair.second;
+
+				if (!tensor.defined())
+				{
+					continue;
+				}
+
+				if (arena_type == nullptr)
+				{
+					arena_type = &tensor.type();
+				}
+				else if (&tensor.type() != arena_type)
+				{
+					throw std::runtime_error(string("pack_weights(): all weights have to be of the same type, got ") +
+						arena_type->toString() + " and " + tensor.type().toString());
+				}
+
+				ArenaEntry entry;
+
+				entry.name = named_module.first + name_tensor_pair.first;
+				entry.module = named_module.second;
+				entry.local_name = name_tensor_pair.first;
+				entry.is_buffer = bool(is_buffer);
+				entry.offset = arena_size;
+				entry.sizes = tensor.sizes().vec();
+
+				int64_t alignment = ARENA_ALIGNMENT / int64_t(tensor.type().elementSizeInBytes());
+
+				arena_size += (tensor.numel() + alignment - 1) / alignment * alignment;
+
+				new_index.push_back(entry);
+				tensors_to_pack.push_back(tensor);
+			}
+		}
+	}
+
+	if (new_index.empty())
+	{
+		return;
+	}
+
+	arena = allocate_arena(*arena_type, arena_size);
+	arena_index = new_index;
+	weight_stream.reset();
+
+	bind_arena_views();
+
+	for (size_t i = 0; i < arena_index.size(); ++i)
+	{
+		auto & entry = arena_index[i];
+		auto & tensors = entry.is_buffer ? entry.module->buffers : entry.module->parameters;
+
+		tensors[entry.local_name].copy_(tensors_to_pack[i]);
+	}
+}
+
+Tensor torch::Module::weights_arena() const
+{
+	return arena;
+}
+
+void torch::Module::bind_arena_views()
+{
+	for (auto & entry : arena_index)
+	{
+		auto & tensors = entry.is_buffer ? entry.module->buffers : entry.module->parameters;
+
+		tensors[entry.local_name] = arena.narrow(0, entry.offset, elements_count(entry.sizes)).view(entry.sizes);
+	}
+}
+
+void torch::Module::move_arena(Backend backend)
+{
+	if (!arena.defined() || arena.type().backend() == backend)
+	{
+		return;
+	}
+
+	auto new_arena = allocate_arena(arena.type().toBackend(backend), arena.numel());
+
+	new_arena.copy_(arena);
+	arena = new_arena;
+	weight_stream.reset();
+
+	bind_arena_views();
+}
@@ -0,0 +1,374 @@
+#include "pytorch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+#ifdef __linux__
+	// Event of the calling thread, counted in user space only, so it works
+	// with the default perf_event_paranoid setting
+	int open_counter(uint32_t type, uint64_t config, int group_file_descriptor)
+	{
+		perf_event_attr attributes;
+
+		std::memset(&attributes, 0, sizeof(attributes));
+
+		attributes.size = sizeof(attributes);
+		attributes.type = type;
+		attributes.config = config;
+		attributes.disabled = (group_file_descriptor == -1) ? 1 : 0;
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+		attributes.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		return int(syscall(__NR_perf_event_open, &attributes, 0, -1, group_file_descriptor, 0));
+	}
+#endif
+
+	string format_count(int64_t value, double divisor, double scale)
+	{
+		if (value < 0 || divisor <= 0)
+		{
+			return "n/a";
+		}
+
+		std::stringstream text;
+
+		text << std::fixed << std::setprecision(2) << value / divisor * scale;
+
+		return text.str();
+	}
+
+	// MACs of one call of the module. Layers which run several times in a
+	// forward pass (like the ReLU of residual blocks) have several entries
+	// in the analysis, their sum is divided by the number of the calls.
+	double module_macs(const torch::ShapeAnalysis & analysis, const string & path)
+	{
+		int64_t macs = 0;
+		int calls = 0;
+
+		for (auto & layer : analysis.layers)
+		{
+			bool inside = path.empty() || layer.path == path ||
+				(layer.path.size() > path.size() && layer.path.compare(0, path.size(), path) == 0 &&
+				layer.path[path.size()] == '.');
+
+			if (inside)
+			{
+				macs += layer.macs;
+			}
+
+			if (layer.path == path)
+			{
+				calls++;
+			}
+		}
+
+		return double(macs) / std::max(calls, 1);
+	}
+}
+
+double torch::PerfCounters::ModuleCounters::ipc() const
+{
+	if (values[CYCLES] <= 0 || values[INSTRUCTIONS] < 0)
+	{
+		return 0.0;
+	}
+
+	return double(values[INSTRUCTIONS]) / values[CYCLES];
+}
+
+torch::PerfCounters::PerfCounters(const shared_ptr<Module> & model) :
+	model(model)
+{
+	for (auto & file_descriptor : file_descriptors)
+	{
+		file_descriptor = -1;
+	}
+
+	for (auto & path_module_pair : model->named_modules())
+	{
+		paths.insert(std::make_pair(path_module_pair.second, path_module_pair.first));
+	}
+}
+
+torch::PerfCounters::~PerfCounters()
+{
+	stop();
+}
+
+void torch::PerfCounters::start()
+{
+#ifdef __linux__
+	stop();
+
+	file_descriptors[CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+
+	if (file_descriptors[CYCLES] == -1)
+	{
+		throw std::runtime_error(string("PerfCounters: can't open the counters (") + std::strerror(errno) +
+			"), check /proc/sys/kernel/perf_event_paranoid");
+	}
+
+	const uint64_t llc_read_miss = PERF_COUNT_HW_CACHE_LL |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+	// Virtual machines often don't have all of them, the missing ones are reported as n/a
+	file_descriptors[INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, file_descriptors[CYCLES]);
+	file_descriptors[LLC_MISSES] = open_counter(PERF_TYPE_HW_CACHE, llc_read_miss, file_descriptors[CYCLES]);
+	file_descriptors[BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, file_descriptors[CYCLES]);
+
+	ioctl(file_descriptors[CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(file_descriptors[CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+	started_values.clear();
+	started_scaled.clear();
+	ForwardScope::perf_counters = this;
+#else
+	throw std::runtime_error("PerfCounters: hardware counters are only supported on Linux");
+#endif
+}
+
+void torch::PerfCounters::stop()
+{
+	if (ForwardScope::perf_counters == this)
+	{
+		ForwardScope::perf_counters = nullptr;
+	}
+
+	close_counters();
+}
+
+void torch::PerfCounters::close_counters()
+{
+#ifdef __linux__
+	// Members of the group first, then the leader
+	for (int counter = COUNTERS_COUNT - 1; counter >= 0; --counter)
+	{
+		if (file_descriptors[counter] != -1)
+		{
+			close(file_descriptors[counter]);
+			file_descriptors[counter] = -1;
+		}
+	}
+#endif
+}
+
+void torch::PerfCounters::reset()
+{
+	counters.clear();
+	positions.clear();
+}
+
+const vector<torch::PerfCounters::ModuleCounters> & torch::PerfCounters::modules() const
+{
+	return counters;
+}
+
+vector<int64_t> torch::PerfCounters::read_values(bool & scaled) const
+{
+	vector<int64_t> values(COUNTERS_COUNT, -1);
+
+	scaled = false;
+
+#ifdef __linux__
+	// The group is read at once: the number of counters, the time it was
+	// enabled and running, then the values in the order they were opened
+	uint64_t buffer[COUNTERS_COUNT + 3];
+
+	if (read(file_descriptors[CYCLES], buffer, sizeof(buffer)) <= 0)
+	{
+		return values;
+	}
+
+	uint64_t time_enabled = buffer[1];
+	uint64_t time_running = buffer[2];
+
+	// Never scheduled on the PMU, nothing is known
+	if (time_running == 0)
+	{
+		return values;
+	}
+
+	// Other users of the PMU (NMI watchdog, other profilers) can make the
+	// kernel multiplex the group, then the counts are estimated
+	double scale = 1.0;
+
+	if (time_running < time_enabled)
+	{
+		scale = double(time_enabled) / time_running;
+		scaled = true;
+	}
+
+	uint64_t position = 3;
+
+	for (int counter = 0; counter < COUNTERS_COUNT && position < buffer[0] + 3; ++counter)
+	{
+		if (file_descriptors[counter] != -1)
+		{
+			values[counter] = int64_t(buffer[position++] * scale);
+		}
+	}
+#endif
+
+	return values;
+}
+
+void torch::PerfCounters::module_started(Module * module)
+{
+	// Added when they start, so modules come before their submodules
+	if (positions.find(module) == positions.end())
+	{
+		ModuleCounters module_counters;
+		auto path = paths.find(module);
+
+		module_counters.path = (path != paths.end()) ? path->second : module->module_name;
+		module_counters.module_name = module->module_name;
+		module_counters.calls = 0;
+		module_counters.scaled = false;
+
+		for (int counter = 0; counter < COUNTERS_COUNT; ++counter)
+		{
+			module_counters.values[counter] = (file_descriptors[counter] == -1) ? -1 : 0;
+		}
+
+		positions.insert(std::make_pair(module, counters.size()));
+		counters.push_back(module_counters);
+	}
+
+	bool scaled;
+
+	started_values.push_back(read_values(scaled));
+	started_scaled.push_back(scaled);
+}
+
+void torch::PerfCounters::module_finished(Module * module)
+{
+	if (started_values.empty())
+	{
+		return;
+	}
+
+	bool scaled;
+
+	auto end_values = read_values(scaled);
+	auto begin_values = std::move(started_values.back());
+
+	scaled = scaled || started_scaled.back();
+
+	started_values.pop_back();
+	started_scaled.pop_back();
+
+	auto position = positions.find(module);
+
+	// Started before reset()
+	if (position == positions.end())
+	{
+		return;
+	}
+
+	auto & module_counters = counters[position->second];
+
+	module_counters.calls++;
+	module_counters.scaled = module_counters.scaled || scaled;
+
+	for (int counter = 0; counter < COUNTERS_COUNT; ++counter)
+	{
+		if (module_counters.values[counter] >= 0 && end_values[counter] >= 0 && begin_values[counter] >= 0)
+		{
+			module_counters.values[counter] += end_values[counter] - begin_values[counter];
+		}
+	}
+}
+
+string torch::PerfCounters::tostring() const
+{
+	return tostring(ShapeAnalysis());
+}
+
+string torch::PerfCounters::tostring(const ShapeAnalysis & analysis) const
+{
+	bool has_macs = !analysis.layers.empty();
+
+	std::stringstream text;
+
+	text << std::left << std::setw(40) << "module"
+		<< std::right << std::setw(8) << "calls"
+		<< std::setw(12) << "Mcycles"
+		<< std::setw(8) << "IPC"
+		<< std::setw(14) << "LLC misses"
+		<< std::setw(14) << "branch misses";
+
+	if (has_macs)
+	{
+		text << std::setw(10) << "MMACs"
+			<< std::setw(16) << "LLC miss/kMAC"
+			<< std::setw(16) << "br. miss/kMAC";
+	}
+
+	text << endl;
+
+	bool any_scaled = false;
+
+	// Modules start before their submodules, so the order
+	// of the first forward pass is already a tree
+	for (auto & module_counters : counters)
+	{
+		const string & path = module_counters.path;
+		size_t depth = path.empty() ? 0 : std::count(path.begin(), path.end(), '.') + 1;
+		size_t name_start = path.rfind('.');
+
+		string name = path.empty() ? module_counters.module_name :
+			path.substr((name_start == string::npos) ? 0 : name_start + 1) + " (" + module_counters.module_name + ")";
+
+		if (module_counters.scaled)
+		{
+			name += " *";
+			any_scaled = true;
+		}
+
+		double calls = double(module_counters.calls);
+		auto & values = module_counters.values;
+
+		std::stringstream ipc;
+
+		ipc << std::fixed << std::setprecision(2) << module_counters.ipc();
+
+		text << std::left << std::setw(40) << string(2 * depth, ' ') + name
+			<< std::right << std::setw(8) << module_counters.calls
+			<< std::setw(12) << format_count(values[CYCLES], calls, 1e-6)
+			<< std::setw(8) << ((values[INSTRUCTIONS] < 0) ? "n/a" : ipc.str())
+			<< std::setw(14) << format_count(values[LLC_MISSES], calls, 1)
+			<< std::setw(14) << format_count(values[BRANCH_MISSES], calls, 1);
+
+		if (has_macs)
+		{
+			// The analysis is of a single forward pass, counts are per call
+			double macs = module_macs(analysis, path);
+
+			text << std::setw(10) << format_count(int64_t(macs), 1, 1e-6)
+				<< std::setw(16) << format_count(values[LLC_MISSES], calls * macs, 1000)
+				<< std::setw(16) << format_count(values[BRANCH_MISSES], calls * macs, 1000);
+		}
+
+		text << endl;
+	}
+
+	if (any_scaled)
+	{
+		text << endl << "* the counters were multiplexed with other events, the counts are estimated" << endl;
+	}
+
+	return text.str();
+}
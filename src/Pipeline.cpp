@@ -0,0 +1,306 @@
+#include "pytorch.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace
+{
+	// How many times an idle stage with the WAIT_SPIN policy
+	// checks its queue before going to sleep
+	const int SPIN_ITERATIONS = 100000;
+
+	struct Item
+	{
+		Tensor tensor;
+
+		// Set if one of the stages failed -- the item is passed
+		// through the rest of the pipeline and rethrown by pop()
+		std::exception_ptr error;
+
+		// Returned by the closed queues to stop the stages
+		bool closed = false;
+	};
+
+	// Cores the process is allowed to run on
+	vector<int> available_cores()
+	{
+		vector<int> cores;
+
+#ifdef __linux__
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+
+		if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0)
+		{
+			for (int core = 0; core < CPU_SETSIZE; ++core)
+			{
+				if (CPU_ISSET(core, &cpu_set))
+				{
+					cores.push_back(core);
+				}
+			}
+		}
+#endif
+
+		if (cores.empty())
+		{
+			int cores_count = std::max(1u, std::thread::hardware_concurrency());
+
+			for (int core = 0; core < cores_count; ++core)
+			{
+				cores.push_back(core);
+			}
+		}
+
+		return cores;
+	}
+
+	// Splits the cores evenly among the stages, so the OpenMP teams of the
+	// stages don't compete for the same cores. With more stages than cores
+	// every stage gets one thread and stages share the cores.
+	vector<torch::ExecutionConfig::Ptr> split_cores(size_t stages_count)
+	{
+		auto cores = available_cores();
+
+		vector<torch::ExecutionConfig::Ptr> configs;
+		size_t next_core = 0;
+
+		for (size_t i = 0; i < stages_count; ++i)
+		{
+			size_t stage_cores = std::max<size_t>(cores.size() / stages_count + (i < cores.size() % stages_count ? 1 : 0), 1);
+			auto config = make_shared<torch::ExecutionConfig>();
+
+			config->num_threads = int(stage_cores);
+
+			for (size_t core = 0; core < stage_cores; ++core)
+			{
+				config->cpu_affinity.push_back(cores[next_core++ % cores.size()]);
+			}
+
+			configs.push_back(config);
+		}
+
+		return configs;
+	}
+}
+
+struct torch::Pipeline::Queue
+{
+	std::mutex mutex;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+	std::deque<Item> items;
+	size_t capacity;
+	bool closed;
+
+	Queue(size_t capacity) :
+		capacity(capacity),
+		closed(false)
+	{
+
+	}
+
+	void push(Item item)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+
+			// Items pushed after closing are dropped
+			if (closed)
+			{
+				return;
+			}
+
+			items.push_back(std::move(item));
+		}
+
+		not_empty.notify_one();
+	}
+
+	Item pop(bool spin)
+	{
+		if (spin)
+		{
+			for (int i = 0; i < SPIN_ITERATIONS; ++i)
+			{
+				std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+
+				if (lock.owns_lock() && (closed || !items.empty()))
+				{
+					break;
+				}
+			}
+		}
+
+		Item item;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			not_empty.wait(lock, [this] { return closed || !items.empty(); });
+
+			if (items.empty())
+			{
+				item.closed = true;
+				return item;
+			}
+
+			item = std::move(items.front());
+			items.pop_front();
+		}
+
+		not_full.notify_one();
+
+		return item;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+		}
+
+		not_empty.notify_all();
+		not_full.notify_all();
+	}
+};
+
+torch::Pipeline::Pipeline(vector<Module::Ptr> stages,
+	vector<ExecutionConfig::Ptr> stage_configs,
+	int queue_capacity) :
+	stages(stages)
+{
+	start(stage_configs, queue_capacity);
+}
+
+torch::Pipeline::Pipeline(Module::Ptr model,
+	vector<ExecutionConfig::Ptr> stage_configs,
+	int queue_capacity) :
+	stages(model->split_stages()),
+	weight_stream(model->weight_stream)
+{
+	// The model can't be split, so it's run as a single stage
+	if (stages.empty())
+	{
+		stages.push_back(model);
+	}
+
+	start(stage_configs, queue_capacity);
+}
+
+torch::Pipeline::~Pipeline()
+{
+	// Frames which are still inside the pipeline are dropped
+	for (auto & queue : queues)
+	{
+		queue->close();
+	}
+
+	for (auto & thread : threads)
+	{
+		thread.join();
+	}
+}
+
+void torch::Pipeline::start(vector<ExecutionConfig::Ptr> stage_configs, int queue_capacity)
+{
+	if (stage_configs.empty())
+	{
+		stage_configs = split_cores(stages.size());
+	}
+
+	stage_configs.resize(stages.size());
+
+	for (size_t i = 0; i < stages.size() + 1; ++i)
+	{
+		queues.push_back(make_shared<Queue>(std::max(queue_capacity, 1)));
+	}
+
+	for (size_t i = 0; i < stages.size(); ++i)
+	{
+		auto stage = stages[i];
+		auto config = stage_configs[i];
+		auto input_queue = queues[i];
+		auto output_queue = queues[i + 1];
+
+		// Only the input of the first stage is shared with the caller,
+		// the other stages can reuse the memory of their inputs
+		bool owns_input = (i > 0);
+
+		auto stream = weight_stream;
+
+		threads.push_back(std::thread([i, stage, config, input_queue, output_queue, owns_input, stream]()
+		{
+			// Kept for the lifetime of the thread
+			ExecutionGuard guard(config);
+
+			ForwardScope::set_current_stream(stream.get());
+
+			Tracer::set_thread_name("Pipeline stage " + std::to_string(i));
+
+			bool spin = config && (config->wait_policy == ExecutionConfig::WAIT_SPIN);
+
+			for (;;)
+			{
+				Item item = input_queue->pop(spin);
+
+				if (item.closed)
+				{
+					return;
+				}
+
+				if (!item.error)
+				{
+					try
+					{
+						item.tensor = owns_input ? stage->forward_(item.tensor) : stage->forward(item.tensor);
+					}
+					catch (...)
+					{
+						item.tensor = Tensor();
+						item.error = std::current_exception();
+					}
+				}
+
+				output_queue->push(std::move(item));
+			}
+		}));
+	}
+}
+
+void torch::Pipeline::push(const Tensor & input)
+{
+	Item item;
+	item.tensor = input;
+
+	queues.front()->push(std::move(item));
+}
+
+Tensor torch::Pipeline::pop()
+{
+	Item item = queues.back()->pop(false);
+
+	if (item.closed)
+	{
+		throw std::runtime_error("Pipeline::pop(): the pipeline was closed");
+	}
+
+	if (item.error)
+	{
+		std::rethrow_exception(item.error);
+	}
+
+	return item.tensor;
+}
+
+int torch::Pipeline::stages_count() const
+{
+	return int(stages.size());
+}
@@ -2,7 +2,7 @@
 
 torch::ReLU::ReLU()
 {
-
+	module_name = "ReLU";
 };
 
 torch::ReLU::~ReLU()
@@ -10,12 +10,48 @@ torch::ReLU::~ReLU()
 
 };
 
-Tensor torch::ReLU::forward(Tensor input)
+torch::Module::Ptr torch::ReLU::clone() const
+{
+	auto copy = make_shared<ReLU>(*this);
+	copy->clone_contents();
+
+	return copy;
+};
+
+Tensor torch::ReLU::forward(const Tensor & input)
 {
+	ForwardScope scope(this);
+
+	// With a caching allocator the output comes from the cache
+	if (allocator)
+	{
+		Tensor output;
+		return forward_out(input, output);
+	}
+
 	//threshold_forward_out(input, input, 0, 0);
 	return input.clamp_min(0);
 };
 
+Tensor torch::ReLU::forward_(Tensor & input)
+{
+	ForwardScope scope(this);
+
+	return input.clamp_min_(0);
+};
+
+Tensor & torch::ReLU::forward_out(const Tensor & input, Tensor & output)
+{
+	ForwardScope scope(this);
+
+	prepare_output(output, input.type(), input.sizes());
+
+	output.copy_(input);
+	output.clamp_min_(0);
+
+	return output;
+};
+
 
 string torch::ReLU::tostring(int indentation_level)
 {
@@ -26,7 +62,7 @@ string torch::ReLU::tostring(int indentation_level)
 
 torch::CReLU::CReLU()
 {
-
+	module_name = "CReLU";
 };
 
 torch::CReLU::~CReLU()
@@ -34,12 +70,40 @@ torch::CReLU::~CReLU()
 
 };
 
-Tensor torch::CReLU::forward(Tensor input)
+torch::Module::Ptr torch::CReLU::clone() const
 {
-	//threshold_forward_out(input, input, 0, 0);
-	auto tmp = - input;
-	auto concat =  cat({input, tmp}, 1);
-	return concat.clamp_min(0);
+	auto copy = make_shared<CReLU>(*this);
+	copy->clone_contents();
+
+	return copy;
+};
+
+Tensor torch::CReLU::forward(const Tensor & input)
+{
+	ForwardScope scope(this);
+
+	// Writing both halves directly into the output avoids
+	// the temporary tensors of negation and concatenation
+	Tensor output;
+	return forward_out(input, output);
+};
+
+Tensor & torch::CReLU::forward_out(const Tensor & input, Tensor & output)
+{
+	ForwardScope scope(this);
+
+	// Output has twice as many channels: [relu(x), relu(-x)]
+	auto channels = input.size(1);
+	auto output_sizes = input.sizes().vec();
+	output_sizes[1] = 2 * channels;
+
+	prepare_output(output, input.type(), output_sizes);
+
+	output.narrow(1, 0, channels).copy_(input);
+	output.narrow(1, channels, channels).copy_(input).neg_();
+	output.clamp_min_(0);
+
+	return output;
 };
 
 
@@ -49,3 +113,36 @@ string torch::CReLU::tostring(int indentation_level)
 
 	return indentation + std::string("CReLU");
 }
+
+vector<int64_t> torch::ReLU::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	int64_t elements = 1;
+
+	for (auto size : input_sizes)
+	{
+		elements *= size;
+	}
+
+	return analysis.add_layer(module_name, 0, path, input_sizes, input_sizes, elements, in_place, true);
+}
+
+vector<int64_t> torch::CReLU::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	int64_t elements = 1;
+
+	for (auto size : input_sizes)
+	{
+		elements *= size;
+	}
+
+	auto output_sizes = input_sizes;
+	output_sizes[1] *= 2;
+
+	return analysis.add_layer(module_name, 0, path, input_sizes, output_sizes, 2 * elements, in_place, false);
+}
@@ -12,6 +12,8 @@ torch::Resnet18_8s::Resnet18_8s(int num_classes):
 	// Adding a module with this name to be able to easily load
 	// weights from pytorch models
 	add_module("resnet18_8s", resnet18_8s);
+
+	module_name = "Resnet18_8s";
 }
 
 torch::Resnet18_8s::~Resnet18_8s()
@@ -19,8 +21,20 @@ torch::Resnet18_8s::~Resnet18_8s()
 
 }
 
-Tensor torch::Resnet18_8s::forward(Tensor input)
+torch::Module::Ptr torch::Resnet18_8s::clone() const
+{
+	auto copy = make_shared<Resnet18_8s>(*this);
+	copy->clone_contents();
+
+	copy->resnet18_8s = copy->get_module("resnet18_8s");
+
+	return copy;
+}
+
+Tensor torch::Resnet18_8s::forward(const Tensor & input)
 {
+	ForwardScope scope(this);
+
 	// probably we can add some utility functions to add softmax on top 
 	// resize the ouput in a proper way
 
@@ -46,6 +60,8 @@ torch::Resnet34_8s::Resnet34_8s(int num_classes):
 	// Adding a module with this name to be able to easily load
 	// weights from pytorch models
 	add_module("resnet34_8s", resnet34_8s);
+
+	module_name = "Resnet34_8s";
 }
 
 torch::Resnet34_8s::~Resnet34_8s()
@@ -53,8 +69,20 @@ torch::Resnet34_8s::~Resnet34_8s()
 
 }
 
-Tensor torch::Resnet34_8s::forward(Tensor input)
+torch::Module::Ptr torch::Resnet34_8s::clone() const
+{
+	auto copy = make_shared<Resnet34_8s>(*this);
+	copy->clone_contents();
+
+	copy->resnet34_8s = copy->get_module("resnet34_8s");
+
+	return copy;
+}
+
+Tensor torch::Resnet34_8s::forward(const Tensor & input)
 {
+	ForwardScope scope(this);
+
 	// TODO:
 
 	// (1) This part with upsampling is the same for all fully conv models
@@ -162,3 +190,35 @@ Tensor torch::Resnet34_8s::forward(Tensor input)
  {
    return make_shared<torch::Resnet34_8s>(21);
  }
+
+vector<int64_t> torch::Resnet18_8s::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	auto sizes = resnet18_8s->analyze_module(input_sizes, analysis, ShapeAnalysis::child_path(path, "resnet18_8s"), in_place);
+
+	// Prediction is upsampled to the size of the input,
+	// every output element is interpolated from four
+	vector<int64_t> output_sizes = {sizes[0], sizes[1], input_sizes[2], input_sizes[3]};
+	int64_t output_elements = output_sizes[0] * output_sizes[1] * output_sizes[2] * output_sizes[3];
+
+	return analysis.add_layer("upsample_bilinear2d", 0, ShapeAnalysis::child_path(path, "upsample"),
+		sizes, output_sizes, 4 * output_elements, true, false);
+}
+
+vector<int64_t> torch::Resnet34_8s::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	auto sizes = resnet34_8s->analyze_module(input_sizes, analysis, ShapeAnalysis::child_path(path, "resnet34_8s"), in_place);
+
+	// Prediction is upsampled to the size of the input,
+	// every output element is interpolated from four
+	vector<int64_t> output_sizes = {sizes[0], sizes[1], input_sizes[2], input_sizes[3]};
+	int64_t output_elements = output_sizes[0] * output_sizes[1] * output_sizes[2] * output_sizes[3];
+
+	return analysis.add_layer("upsample_bilinear2d", 0, ShapeAnalysis::child_path(path, "upsample"),
+		sizes, output_sizes, 4 * output_elements, true, false);
+}
@@ -74,19 +74,97 @@ torch::ResNet<BlockType>::~ResNet()
 }
 
 template <class BlockType>
-Tensor torch::ResNet<BlockType>::forward(Tensor input)
+torch::Module::Ptr torch::ResNet<BlockType>::clone() const
 {
-	Tensor output = input.type().tensor();
+	auto copy = std::make_shared<ResNet<BlockType>>(*this);
+	copy->clone_contents();
+
+	// Named members point to the submodules of the original
+	copy->conv1 = copy->get_module("conv1");
+	copy->bn1 = copy->get_module("bn1");
+	copy->relu = copy->get_module("relu");
+	copy->maxpool = copy->get_module("maxpool");
+	copy->layer1 = copy->get_module("layer1");
+	copy->layer2 = copy->get_module("layer2");
+	copy->layer3 = copy->get_module("layer3");
+	copy->layer4 = copy->get_module("layer4");
+	copy->avgpool = copy->get_module("avgpool");
+	copy->fc = copy->get_module("fc");
+
+	return copy;
+}
+
+template <class BlockType>
+vector<int64_t> torch::ResNet<BlockType>::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	// Has to do the same as forward_features() and forward()
+	auto sizes = conv1->analyze_module(input_sizes, analysis, ShapeAnalysis::child_path(path, "conv1"), in_place);
+
+	sizes = bn1->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "bn1"), true);
+	sizes = relu->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "relu"), true);
+	sizes = maxpool->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "maxpool"), true);
+
+	sizes = layer1->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "layer1"), true);
+	sizes = layer2->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "layer2"), true);
+	sizes = layer3->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "layer3"), true);
+	sizes = layer4->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "layer4"), true);
+
+	if(!remove_avg_pool)
+	{
+	    sizes = avgpool->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "avgpool"), true);
+	}
+
+	if(!fully_conv)
+	{
+	    // Flattening is a view
+	    int64_t features = 1;
+
+	    for (size_t i = 1; i < sizes.size(); ++i)
+	    {
+	        features *= sizes[i];
+	    }
+
+	    sizes = {sizes[0], features};
+	}
+
+	return fc->analyze_module(sizes, analysis, ShapeAnalysis::child_path(path, "fc"), true);
+}
+
+template <class BlockType>
+Tensor torch::ResNet<BlockType>::forward(const Tensor & input)
+{
+	ForwardScope scope(this);
+
+	return fc->forward(forward_features(input));
+}
+
+template <class BlockType>
+Tensor & torch::ResNet<BlockType>::forward_out(const Tensor & input, Tensor & output)
+{
+	ForwardScope scope(this);
+
+	return fc->forward_out(forward_features(input), output);
+}
+
+template <class BlockType>
+Tensor torch::ResNet<BlockType>::forward_features(const Tensor & input)
+{
+	Tensor output;
 
+	// Output of the first convolution is not shared with the
+	// caller, so the rest of the network can work in-place
 	output = conv1->forward(input);
-	output = bn1->forward(output);
-	output = relu->forward(output);
+	output = bn1->forward_(output);
+	output = relu->forward_(output);
 	output = maxpool->forward(output);
 
-	output = layer1->forward(output);
-	output = layer2->forward(output);
-	output = layer3->forward(output);
-	output = layer4->forward(output);
+	output = layer1->forward_(output);
+	output = layer2->forward_(output);
+	output = layer3->forward_(output);
+	output = layer4->forward_(output);
 
 	if(!remove_avg_pool)
 	{
@@ -99,11 +177,37 @@ Tensor torch::ResNet<BlockType>::forward(Tensor input)
 	    output = output.view({output.size(0), -1});
 	}
 
-	output = fc->forward(output);
-
 	return output;
 }
 
+template <class BlockType>
+vector<torch::Module::Ptr> torch::ResNet<BlockType>::split_stages()
+{
+	// Has to do the same as forward_features() and forward()
+	auto stem = std::make_shared<torch::Sequential>();
+
+	stem->add(conv1);
+	stem->add(bn1);
+	stem->add(relu);
+	stem->add(maxpool);
+
+	auto head = std::make_shared<torch::Sequential>();
+
+	if(!remove_avg_pool)
+	{
+	    head->add(avgpool);
+	}
+
+	if(!fully_conv)
+	{
+	    head->add(std::make_shared<torch::Flatten>());
+	}
+
+	head->add(fc);
+
+	return {stem, layer1, layer2, layer3, layer4, head};
+}
+
 template <class BlockType>
 torch::Module::Ptr torch::ResNet<BlockType>::make_layer(int planes, int blocks, int stride)
 {
@@ -10,15 +10,120 @@ torch::Sequential::~Sequential()
 
 };
 
+torch::Module::Ptr torch::Sequential::clone() const
+{
+	auto copy = make_shared<Sequential>(*this);
+	copy->clone_contents();
+
+	return copy;
+};
+
 // Forward for sequential block makes forward pass
 // for each submodule and passed it to the next one
-Tensor torch::Sequential::forward(Tensor input)
+Tensor torch::Sequential::forward(const Tensor & input)
+{
+	ForwardScope scope(this);
+
+	return forward_first(input, modules.size());
+}
+
+Tensor & torch::Sequential::forward_out(const Tensor & input, Tensor & output)
+{
+	ForwardScope scope(this);
+
+	if (modules.empty())
+	{
+		return Module::forward_out(input, output);
+	}
+
+	// Only the last submodule writes into the output of the caller
+	Tensor out = forward_first(input, modules.size() - 1);
+
+	return modules.back().second->forward_out(out, output);
+}
+
+namespace
+{
+	// Bytes which the elements of the tensor can occupy
+	pair<const char *, const char *> memory_span(const Tensor & tensor)
+	{
+		const char * begin = static_cast<const char *>(tensor.data_ptr());
+		const char * end = begin;
+
+		if (tensor.numel() == 0)
+		{
+			return std::make_pair(begin, end);
+		}
+
+		int64_t element_size = tensor.type().elementSizeInBytes();
+		int64_t last_offset = 0;
+		int64_t first_offset = 0;
+
+		for (int64_t i = 0; i < tensor.dim(); ++i)
+		{
+			int64_t extent = (tensor.size(i) - 1) * tensor.stride(i);
+
+			// Negative strides reach below the data pointer
+			if (extent < 0)
+			{
+				first_offset += extent;
+			}
+			else
+			{
+				last_offset += extent;
+			}
+		}
+
+		return std::make_pair(begin + first_offset * element_size, begin + (last_offset + 1) * element_size);
+	}
+
+	// True if writing into one of the tensors can change the other one,
+	// for example a view like input.narrow() returned by a submodule
+	bool shares_memory(const Tensor & first, const Tensor & second)
+	{
+		auto first_span = memory_span(first);
+		auto second_span = memory_span(second);
+
+		return first_span.first < second_span.second && second_span.first < first_span.second;
+	}
+}
+
+Tensor torch::Sequential::forward_first(const Tensor & input, size_t modules_count)
 {
 	Tensor out = input;
 
-	for (auto name_module_pair : modules)
+	// The intermediate results can be modified in-place by the
+	// submodules, but only after we stopped sharing the memory
+	// with the input of the caller
+	bool owns_output = false;
+
+	for (size_t i = 0; i < modules_count; ++i)
 	{
-		out = name_module_pair.second->forward(out);
+		auto & module = modules[i].second;
+
+		if (owns_output)
+		{
+			out = module->forward_(out);
+		}
+		else
+		{
+			out = module->forward(out);
+			owns_output = !shares_memory(out, input);
+		}
+	}
+
+	return out;
+}
+
+Tensor torch::Sequential::forward_(Tensor & input)
+{
+	ForwardScope scope(this);
+
+	Tensor out = input;
+
+	for (auto & name_module_pair : modules)
+	{
+		out = name_module_pair.second->forward_(out);
 	}
 
 	return out;
@@ -27,4 +132,43 @@ Tensor torch::Sequential::forward(Tensor input)
 torch::Module::Ptr torch::Sequential::get(int i) const
 {
 	return modules[i].second;
-}
\ No newline at end of file
+}
+
+vector<torch::Module::Ptr> torch::Sequential::split_stages()
+{
+	vector<Module::Ptr> stages;
+
+	for (auto & name_module_pair : modules)
+	{
+		stages.push_back(name_module_pair.second);
+	}
+
+	return stages;
+}
+
+vector<int64_t> torch::Sequential::analyze_module(const vector<int64_t> & input_sizes,
+	ShapeAnalysis & analysis,
+	const string & path,
+	bool in_place)
+{
+	// Same as forward_first(): submodules work in-place once
+	// the output doesn't share the memory with the input
+	vector<int64_t> sizes = input_sizes;
+	bool owns_output = in_place;
+
+	for (auto & name_module_pair : modules)
+	{
+		sizes = name_module_pair.second->analyze_module(sizes, analysis,
+			ShapeAnalysis::child_path(path, name_module_pair.first), owns_output);
+
+		owns_output = true;
+	}
+
+	if (!owns_output)
+	{
+		// Empty module returns its input
+		analysis.allocate(sizes);
+	}
+
+	return sizes;
+}
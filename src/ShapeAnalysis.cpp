@@ -0,0 +1,201 @@
+#include "pytorch.h"
+
+#include <iomanip>
+
+namespace
+{
+	// Activations are float tensors
+	int64_t activation_bytes(const vector<int64_t> & sizes)
+	{
+		int64_t elements = 1;
+
+		for (auto size : sizes)
+		{
+			elements *= size;
+		}
+
+		return elements * int64_t(sizeof(float));
+	}
+
+	string sizes_to_string(const vector<int64_t> & sizes)
+	{
+		std::stringstream text;
+
+		for (size_t i = 0; i < sizes.size(); ++i)
+		{
+			text << (i == 0 ? "" : "x") << sizes[i];
+		}
+
+		return text.str();
+	}
+}
+
+double torch::ShapeAnalysis::Layer::arithmetic_intensity() const
+{
+	int64_t bytes = ::activation_bytes(input_sizes) + ::activation_bytes(output_sizes) + parameter_bytes;
+
+	return (bytes > 0) ? double(macs) / bytes : 0.0;
+}
+
+int64_t torch::ShapeAnalysis::total_macs() const
+{
+	int64_t macs = 0;
+
+	for (auto & layer : layers)
+	{
+		macs += layer.macs;
+	}
+
+	return macs;
+}
+
+int64_t torch::ShapeAnalysis::total_parameter_bytes() const
+{
+	int64_t bytes = 0;
+
+	for (auto & layer : layers)
+	{
+		bytes += layer.parameter_bytes;
+	}
+
+	return bytes;
+}
+
+void torch::ShapeAnalysis::allocate(const vector<int64_t> & sizes)
+{
+	live_bytes += ::activation_bytes(sizes);
+	peak_live_bytes = std::max(peak_live_bytes, live_bytes);
+}
+
+void torch::ShapeAnalysis::release(const vector<int64_t> & sizes)
+{
+	live_bytes -= ::activation_bytes(sizes);
+}
+
+vector<int64_t> torch::ShapeAnalysis::add_layer(const string & module_name,
+	int64_t parameter_bytes,
+	const string & path,
+	const vector<int64_t> & input_sizes,
+	const vector<int64_t> & output_sizes,
+	int64_t macs,
+	bool in_place,
+	bool works_in_place)
+{
+	bool reuses_input = in_place && works_in_place;
+
+	// Input and output are both alive while the layer runs
+	if (!reuses_input)
+	{
+		allocate(output_sizes);
+
+		if (in_place)
+		{
+			release(input_sizes);
+		}
+	}
+
+	Layer layer;
+
+	layer.path = path;
+	layer.module_name = module_name;
+	layer.input_sizes = input_sizes;
+	layer.output_sizes = output_sizes;
+	layer.macs = macs;
+	layer.parameter_bytes = parameter_bytes;
+	layer.activation_bytes = reuses_input ? 0 : ::activation_bytes(output_sizes);
+
+	layers.push_back(layer);
+
+	return output_sizes;
+}
+
+string torch::ShapeAnalysis::child_path(const string & path, const string & name)
+{
+	return path.empty() ? name : path + "." + name;
+}
+
+string torch::ShapeAnalysis::tostring() const
+{
+	std::stringstream text;
+
+	text << std::left << std::setw(32) << "layer"
+		<< std::setw(14) << "module"
+		<< std::setw(20) << "output"
+		<< std::right << std::setw(12) << "MMACs"
+		<< std::setw(12) << "params KB"
+		<< std::setw(14) << "output KB"
+		<< std::setw(12) << "MACs/byte" << endl;
+
+	text << std::fixed << std::setprecision(1);
+
+	for (auto & layer : layers)
+	{
+		text << std::left << std::setw(32) << layer.path
+			<< std::setw(14) << layer.module_name
+			<< std::setw(20) << sizes_to_string(layer.output_sizes)
+			<< std::right << std::setw(12) << layer.macs / 1e6
+			<< std::setw(12) << layer.parameter_bytes / 1024.0
+			<< std::setw(14) << layer.activation_bytes / 1024.0
+			<< std::setw(12) << layer.arithmetic_intensity() << endl;
+	}
+
+	text << endl
+		<< "Total GMACs: " << total_macs() / 1e9 << endl
+		<< "Parameters MB: " << total_parameter_bytes() / double(1 << 20) << endl
+		<< "Peak activations MB: " << peak_live_bytes / double(1 << 20) << endl;
+
+	return text.str();
+}
+
+torch::ShapeAnalysis torch::Module::analyze(IntList input_sizes)
+{
+	ShapeAnalysis analysis;
+
+	auto sizes = input_sizes.vec();
+
+	// The input is alive during the whole forward pass
+	analysis.allocate(sizes);
+
+	analyze_module(sizes, analysis, "", false);
+
+	return analysis;
+}
+
+int64_t torch::Module::weight_bytes() const
+{
+	int64_t bytes = 0;
+
+	for (auto tensors : {&parameters, &buffers})
+	{
+		for (auto & name_tensor_pair : *tensors)
+		{
+			if (name_tensor_pair.second.defined())
+			{
+				bytes += name_tensor_pair.second.numel() * name_tensor_pair.second.type().elementSizeInBytes();
+			}
+		}
+	}
+
+	for (auto & name_declared_pair : declared_tensors)
+	{
+		int64_t elements = 1;
+
+		for (auto size : name_declared_pair.second.sizes)
+		{
+			elements *= size;
+		}
+
+		bytes += elements * int64_t(sizeof(float));
+	}
+
+	return bytes;
+}
+
+vector<int64_t> torch::Module::analyze_module(const vector<int64_t> & /* input_sizes */,
+	ShapeAnalysis & /* analysis */,
+	const string & path,
+	bool /* in_place */)
+{
+	throw std::runtime_error("analyze(): shape inference is not implemented for " + module_name +
+		(path.empty() ? string() : " ('" + path + "')"));
+}
@@ -0,0 +1,820 @@
+#include "pytorch.h"
+
+#ifndef _WIN32
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+struct torch::SharedTensorQueue::Header
+{
+	uint64_t magic;
+	uint64_t capacity;
+	uint64_t slot_bytes;
+	uint64_t max_tensor_elements;
+
+	// Number of pushed and popped messages. They are written by different
+	// processes, so they are kept in separate cache lines.
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+};
+
+namespace
+{
+	const uint64_t SHARED_WEIGHTS_MAGIC = 0x5054574549474854ULL;
+	const uint64_t SHARED_QUEUE_MAGIC = 0x5054515545554531ULL;
+
+	const size_t ALIGNMENT = 64;
+
+	struct SharedWeightsHeader
+	{
+		uint64_t magic;
+		uint64_t tensors_count;
+		uint64_t data_offset;
+		uint64_t total_bytes;
+	};
+
+	struct SlotHeader
+	{
+		uint64_t tag;
+		uint32_t flags;
+
+		// -1 for an undefined tensor
+		int32_t dims;
+		int64_t sizes[torch::SharedTensorQueue::MAX_DIMS];
+	};
+
+	size_t align_up(size_t bytes)
+	{
+		return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+	}
+
+	const size_t QUEUE_HEADER_BYTES = align_up(sizeof(torch::SharedTensorQueue::Header));
+	const size_t SLOT_HEADER_BYTES = align_up(sizeof(SlotHeader));
+
+	string segment_name(const string & name)
+	{
+		return (!name.empty() && name[0] == '/') ? name : "/" + name;
+	}
+
+	void throw_system_error(const string & message)
+	{
+		throw std::runtime_error(message + ": " + strerror(errno));
+	}
+
+	// Spins for a while and then sleeps, so waiting for a slow
+	// process doesn't take a whole core
+	void wait_backoff(int & attempt)
+	{
+		if (attempt < 64)
+		{
+			std::this_thread::yield();
+		}
+		else
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+
+		++attempt;
+	}
+
+	// Unmapped when the last tensor which points into it is destroyed
+	struct SharedMapping
+	{
+		void * address;
+		size_t bytes;
+
+		SharedMapping(void * address, size_t bytes) :
+			address(address),
+			bytes(bytes)
+		{
+
+		}
+
+		~SharedMapping()
+		{
+			if (address != MAP_FAILED)
+			{
+				munmap(address, bytes);
+			}
+		}
+
+		// The caller becomes responsible for munmap()
+		void * release()
+		{
+			void * released_address = address;
+
+			address = MAP_FAILED;
+
+			return released_address;
+		}
+	};
+
+	// Creates the memory or opens an existing one (then bytes are ignored).
+	// Empty name -- anonymous memory shared with the children.
+	shared_ptr<SharedMapping> map_shared_memory(const string & name, size_t bytes, bool create, bool writable)
+	{
+		int protection = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+
+		if (name.empty())
+		{
+			void * address = mmap(nullptr, bytes, protection, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+			if (address == MAP_FAILED)
+			{
+				throw_system_error("mmap()");
+			}
+
+			return make_shared<SharedMapping>(address, bytes);
+		}
+
+		int flags = create ? (O_RDWR | O_CREAT | O_EXCL) : (writable ? O_RDWR : O_RDONLY);
+		int descriptor = shm_open(segment_name(name).c_str(), flags, 0600);
+
+		if (descriptor < 0)
+		{
+			throw_system_error("shm_open('" + name + "')");
+		}
+
+		if (create)
+		{
+			if (ftruncate(descriptor, bytes) != 0)
+			{
+				close(descriptor);
+				shm_unlink(segment_name(name).c_str());
+				throw_system_error("ftruncate('" + name + "')");
+			}
+		}
+		else
+		{
+			struct stat status;
+
+			if (fstat(descriptor, &status) != 0)
+			{
+				close(descriptor);
+				throw_system_error("fstat('" + name + "')");
+			}
+
+			bytes = status.st_size;
+		}
+
+		void * address = mmap(nullptr, bytes, protection, MAP_SHARED, descriptor, 0);
+
+		close(descriptor);
+
+		if (address == MAP_FAILED)
+		{
+			if (create)
+			{
+				shm_unlink(segment_name(name).c_str());
+			}
+
+			throw_system_error("mmap('" + name + "')");
+		}
+
+		return make_shared<SharedMapping>(address, bytes);
+	}
+
+	template<typename T> void write_value(vector<char> & buffer, const T & value)
+	{
+		const char * bytes = reinterpret_cast<const char *>(&value);
+
+		buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+	}
+
+	template<typename T> T read_value(const char * & position)
+	{
+		T value;
+
+		memcpy(&value, position, sizeof(T));
+		position += sizeof(T);
+
+		return value;
+	}
+
+	// Index of the segment: for every tensor the length of the name,
+	// the name, number of dims, sizes and the offset of the data
+	map<string, Tensor> shared_weights_tensors(const shared_ptr<SharedMapping> & mapping)
+	{
+		auto base = static_cast<const char *>(mapping->address);
+		auto header = reinterpret_cast<const SharedWeightsHeader *>(base);
+
+		if (mapping->bytes < sizeof(SharedWeightsHeader) || header->magic != SHARED_WEIGHTS_MAGIC)
+		{
+			throw std::runtime_error("open_shared_weights(): memory doesn't contain shared weights");
+		}
+
+		map<string, Tensor> tensors;
+
+		const char * position = base + sizeof(SharedWeightsHeader);
+
+		for (uint64_t i = 0; i < header->tensors_count; ++i)
+		{
+			auto name_length = read_value<uint64_t>(position);
+			string name(position, name_length);
+			position += name_length;
+
+			auto dims = read_value<uint64_t>(position);
+			vector<int64_t> sizes(dims);
+
+			for (auto & size : sizes)
+			{
+				size = read_value<int64_t>(position);
+			}
+
+			auto data_offset = read_value<uint64_t>(position);
+			auto data = const_cast<char *>(base + header->data_offset + data_offset);
+
+			// Every tensor keeps the mapping alive
+			tensors[name] = torch::from_buffer(data, CPU(kFloat), sizes, {}, [mapping](void *) {});
+		}
+
+		return tensors;
+	}
+}
+
+map<string, Tensor> torch::create_shared_weights(const map<string, Tensor> & dict, const string & name)
+{
+	vector<char> index;
+	size_t data_bytes = 0;
+
+	for (auto & name_tensor_pair : dict)
+	{
+		auto & tensor = name_tensor_pair.second;
+
+		if (&tensor.type() != &CPU(kFloat))
+		{
+			throw std::runtime_error("create_shared_weights(): parameter ('" + name_tensor_pair.first +
+				"') is " + tensor.type().toString() + ", only CPU float tensors are supported");
+		}
+
+		write_value<uint64_t>(index, name_tensor_pair.first.size());
+		index.insert(index.end(), name_tensor_pair.first.begin(), name_tensor_pair.first.end());
+
+		write_value<uint64_t>(index, tensor.dim());
+
+		for (auto size : tensor.sizes())
+		{
+			write_value<int64_t>(index, size);
+		}
+
+		write_value<uint64_t>(index, data_bytes);
+
+		data_bytes += align_up(tensor.numel() * sizeof(float));
+	}
+
+	SharedWeightsHeader header;
+
+	header.magic = SHARED_WEIGHTS_MAGIC;
+	header.tensors_count = dict.size();
+	header.data_offset = align_up(sizeof(SharedWeightsHeader) + index.size());
+	header.total_bytes = header.data_offset + data_bytes;
+
+	auto mapping = map_shared_memory(name, header.total_bytes, true, true);
+	auto base = static_cast<char *>(mapping->address);
+
+	memcpy(base, &header, sizeof(header));
+	memcpy(base + sizeof(header), index.data(), index.size());
+
+	char * data = base + header.data_offset;
+
+	for (auto & name_tensor_pair : dict)
+	{
+		auto tensor = name_tensor_pair.second.contiguous();
+		size_t tensor_bytes = tensor.numel() * sizeof(float);
+
+		memcpy(data, tensor.data_ptr(), tensor_bytes);
+		data += align_up(tensor_bytes);
+	}
+
+	// Nobody writes the weights after this point
+	mprotect(mapping->address, mapping->bytes, PROT_READ);
+
+	return shared_weights_tensors(mapping);
+}
+
+map<string, Tensor> torch::open_shared_weights(const string & name)
+{
+	return shared_weights_tensors(map_shared_memory(name, 0, false, false));
+}
+
+void torch::remove_shared_weights(const string & name)
+{
+	shm_unlink(segment_name(name).c_str());
+}
+
+torch::SharedTensorQueue::SharedTensorQueue(int capacity, int64_t max_tensor_elements, const string & name) :
+	name(name),
+	owner(true)
+{
+	if (capacity < 1 || max_tensor_elements < 0)
+	{
+		throw std::runtime_error("SharedTensorQueue: capacity has to be positive");
+	}
+
+	if (!std::atomic<uint64_t>().is_lock_free())
+	{
+		throw std::runtime_error("SharedTensorQueue: 64-bit atomics are not lock-free on this platform");
+	}
+
+	size_t slot_bytes = SLOT_HEADER_BYTES + align_up(max_tensor_elements * sizeof(float));
+
+	mapped_bytes = QUEUE_HEADER_BYTES + capacity * slot_bytes;
+
+	header = new (map_shared_memory(name, mapped_bytes, true, true)->release()) Header();
+
+	header->magic = SHARED_QUEUE_MAGIC;
+	header->capacity = capacity;
+	header->slot_bytes = slot_bytes;
+	header->max_tensor_elements = max_tensor_elements;
+	header->head = 0;
+	header->tail = 0;
+}
+
+torch::SharedTensorQueue::SharedTensorQueue(const string & name) :
+	name(name),
+	owner(false)
+{
+	auto mapping = map_shared_memory(name, 0, false, true);
+
+	mapped_bytes = mapping->bytes;
+	header = static_cast<Header *>(mapping->release());
+
+	if (mapped_bytes < QUEUE_HEADER_BYTES || header->magic != SHARED_QUEUE_MAGIC)
+	{
+		munmap(header, mapped_bytes);
+		throw std::runtime_error("SharedTensorQueue: memory ('" + name + "') doesn't contain a queue");
+	}
+}
+
+torch::SharedTensorQueue::~SharedTensorQueue()
+{
+	munmap(header, mapped_bytes);
+
+	if (owner && !name.empty())
+	{
+		shm_unlink(segment_name(name).c_str());
+	}
+}
+
+char * torch::SharedTensorQueue::slot(uint64_t index) const
+{
+	return reinterpret_cast<char *>(header) + QUEUE_HEADER_BYTES + (index % header->capacity) * header->slot_bytes;
+}
+
+bool torch::SharedTensorQueue::try_push(const Tensor & tensor, uint64_t tag, uint32_t flags)
+{
+	if (tensor.defined())
+	{
+		if (&tensor.type() != &CPU(kFloat))
+		{
+			throw std::runtime_error("SharedTensorQueue: only CPU float tensors are supported");
+		}
+
+		if (tensor.dim() > MAX_DIMS || uint64_t(tensor.numel()) > header->max_tensor_elements)
+		{
+			throw std::runtime_error("SharedTensorQueue: tensor doesn't fit in a slot of the queue");
+		}
+	}
+
+	uint64_t head = header->head.load(std::memory_order_relaxed);
+	uint64_t tail = header->tail.load(std::memory_order_acquire);
+
+	if (head - tail == header->capacity)
+	{
+		return false;
+	}
+
+	char * message = slot(head);
+	auto message_header = reinterpret_cast<SlotHeader *>(message);
+
+	message_header->tag = tag;
+	message_header->flags = flags;
+	message_header->dims = -1;
+
+	if (tensor.defined())
+	{
+		message_header->dims = tensor.dim();
+
+		for (int64_t i = 0; i < tensor.dim(); ++i)
+		{
+			message_header->sizes[i] = tensor.size(i);
+		}
+
+		auto contiguous = tensor.contiguous();
+
+		memcpy(message + SLOT_HEADER_BYTES, contiguous.data_ptr(), contiguous.numel() * sizeof(float));
+	}
+
+	// Publishes the message to the consumer
+	header->head.store(head + 1, std::memory_order_release);
+
+	return true;
+}
+
+bool torch::SharedTensorQueue::try_pop(Tensor & tensor, uint64_t & tag, uint32_t & flags)
+{
+	uint64_t tail = header->tail.load(std::memory_order_relaxed);
+	uint64_t head = header->head.load(std::memory_order_acquire);
+
+	if (tail == head)
+	{
+		return false;
+	}
+
+	const char * message = slot(tail);
+	auto message_header = reinterpret_cast<const SlotHeader *>(message);
+
+	tag = message_header->tag;
+	flags = message_header->flags;
+
+	if (message_header->dims < 0)
+	{
+		tensor = Tensor();
+	}
+	else
+	{
+		vector<int64_t> sizes(message_header->sizes, message_header->sizes + message_header->dims);
+
+		if (!tensor.defined() || &tensor.type() != &CPU(kFloat) ||
+			!tensor.is_contiguous() || !tensor.sizes().equals(sizes))
+		{
+			tensor = CPU(kFloat).tensor(sizes);
+		}
+
+		memcpy(tensor.data_ptr(), message + SLOT_HEADER_BYTES, tensor.numel() * sizeof(float));
+	}
+
+	// Gives the slot back to the producer
+	header->tail.store(tail + 1, std::memory_order_release);
+
+	return true;
+}
+
+void torch::SharedTensorQueue::push(const Tensor & tensor, uint64_t tag, uint32_t flags)
+{
+	int attempt = 0;
+
+	while (!try_push(tensor, tag, flags))
+	{
+		wait_backoff(attempt);
+	}
+}
+
+void torch::SharedTensorQueue::pop(Tensor & tensor, uint64_t & tag, uint32_t & flags)
+{
+	int attempt = 0;
+
+	while (!try_pop(tensor, tag, flags))
+	{
+		wait_backoff(attempt);
+	}
+}
+
+namespace
+{
+	std::atomic<int> process_pools_counter(0);
+
+	// Main loop of a worker process, never returns. The worker is forked
+	// before the dispatcher does any work with ATen, it waits for the
+	// start message and then opens the weights by name.
+	void run_worker(const std::function<torch::Module::Ptr()> & model_factory,
+		const string & weights_name,
+		torch::SharedTensorQueue & requests,
+		torch::SharedTensorQueue & responses)
+	{
+#ifdef __linux__
+		// Don't outlive the dispatcher
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+
+		Tensor input;
+		uint64_t tag;
+		uint32_t flags;
+
+		torch::Module::Ptr model;
+
+		requests.pop(input, tag, flags);
+
+		if (flags & torch::SHARED_MESSAGE_STOP)
+		{
+			_exit(0);
+		}
+
+		try
+		{
+			// The weights in shared memory are CPU tensors
+			torch::set_default_type(CPU(kFloat));
+
+			model = model_factory();
+			model->bind_weights(torch::open_shared_weights(weights_name));
+		}
+		catch (std::exception & error)
+		{
+			cout << "ERROR: worker " << getpid() << " failed: " << error.what() << endl;
+
+			responses.push(Tensor(), 0, torch::SHARED_MESSAGE_START | torch::SHARED_MESSAGE_ERROR);
+			_exit(1);
+		}
+
+		responses.push(Tensor(), 0, torch::SHARED_MESSAGE_START);
+
+		for (;;)
+		{
+			requests.pop(input, tag, flags);
+
+			if (flags & torch::SHARED_MESSAGE_STOP)
+			{
+				break;
+			}
+
+			// Every request gets a response, otherwise receive() would wait for it forever
+			try
+			{
+				responses.push(model->forward(input), tag);
+			}
+			catch (std::exception & error)
+			{
+				cout << "WARNING: request " << tag << " failed in worker " << getpid() << ": " << error.what() << endl;
+
+				responses.push(Tensor(), tag, torch::SHARED_MESSAGE_ERROR);
+			}
+			catch (...)
+			{
+				responses.push(Tensor(), tag, torch::SHARED_MESSAGE_ERROR);
+			}
+		}
+
+		// Objects of the dispatcher copied by fork() are not destroyed here
+		_exit(0);
+	}
+}
+
+torch::ProcessPool::RequestError::RequestError(uint64_t tag) :
+	std::runtime_error("ProcessPool: request " + std::to_string(tag) + " failed in the worker"),
+	tag(tag)
+{
+
+}
+
+torch::ProcessPool::ProcessPool(std::function<Module::Ptr()> model_factory,
+	const string & hdf5_filename,
+	int workers_count,
+	int queue_capacity,
+	int64_t max_tensor_elements) :
+	max_requests_in_flight(2 * queue_capacity + 1),
+	next_tag(0),
+	next_response_worker(0)
+{
+	if (workers_count < 1)
+	{
+		throw std::runtime_error("ProcessPool: at least one worker is required");
+	}
+
+	// Nothing of ATen runs before fork(): once OpenMP has started its threads
+	// in the dispatcher, the forked workers can hang in the kernels
+	string weights_name = "pytorch_process_pool_" + std::to_string(getpid()) + "_" +
+		std::to_string(process_pools_counter++);
+
+	for (int i = 0; i < workers_count; ++i)
+	{
+		Worker worker;
+
+		worker.process_id = -1;
+		worker.requests_in_flight = 0;
+		worker.requests = make_shared<SharedTensorQueue>(queue_capacity, max_tensor_elements);
+		worker.responses = make_shared<SharedTensorQueue>(queue_capacity, max_tensor_elements);
+
+		workers.push_back(worker);
+	}
+
+	for (auto & worker : workers)
+	{
+		// Flushed before fork(), otherwise the buffered output is printed twice
+		cout.flush();
+
+		int process_id = fork();
+
+		if (process_id < 0)
+		{
+			int fork_error = errno;
+
+			stop_workers();
+
+			errno = fork_error;
+			throw_system_error("ProcessPool: fork()");
+		}
+
+		if (process_id == 0)
+		{
+			run_worker(model_factory, weights_name, *worker.requests, *worker.responses);
+		}
+
+		worker.process_id = process_id;
+	}
+
+	try
+	{
+		weights = create_shared_weights(load(hdf5_filename), weights_name);
+
+		for (auto & worker : workers)
+		{
+			worker.requests->push(Tensor(), 0, SHARED_MESSAGE_START);
+		}
+
+		wait_for_workers_start();
+	}
+	catch (...)
+	{
+		stop_workers();
+		remove_shared_weights(weights_name);
+		throw;
+	}
+
+	// The workers have mapped it, the name isn't needed anymore
+	remove_shared_weights(weights_name);
+}
+
+void torch::ProcessPool::wait_for_workers_start()
+{
+	for (auto & worker : workers)
+	{
+		Tensor output;
+		uint64_t tag;
+		uint32_t flags;
+		int attempt = 0;
+
+		while (!worker.responses->try_pop(output, tag, flags))
+		{
+			if (attempt % 1024 == 1023)
+			{
+				check_workers();
+			}
+
+			wait_backoff(attempt);
+		}
+
+		if (flags & SHARED_MESSAGE_ERROR)
+		{
+			throw std::runtime_error("ProcessPool: a worker couldn't build the model, see its output");
+		}
+	}
+}
+
+torch::ProcessPool::~ProcessPool()
+{
+	stop_workers();
+}
+
+void torch::ProcessPool::stop_workers()
+{
+	for (auto & worker : workers)
+	{
+		if (worker.process_id <= 0)
+		{
+			continue;
+		}
+
+		// A worker which is stuck on a full response queue won't read the request
+		if (!worker.requests->try_push(Tensor(), 0, SHARED_MESSAGE_STOP))
+		{
+			kill(worker.process_id, SIGTERM);
+		}
+	}
+
+	for (auto & worker : workers)
+	{
+		if (worker.process_id > 0)
+		{
+			waitpid(worker.process_id, nullptr, 0);
+			worker.process_id = -1;
+		}
+	}
+}
+
+void torch::ProcessPool::check_workers()
+{
+	for (auto & worker : workers)
+	{
+		if (worker.process_id > 0 && waitpid(worker.process_id, nullptr, WNOHANG) == worker.process_id)
+		{
+			worker.process_id = -1;
+		}
+
+		if (worker.process_id <= 0)
+		{
+			throw std::runtime_error("ProcessPool: a worker process has exited");
+		}
+	}
+}
+
+uint64_t torch::ProcessPool::submit(const Tensor & input)
+{
+	size_t least_busy = 0;
+
+	for (size_t i = 1; i < workers.size(); ++i)
+	{
+		if (workers[i].requests_in_flight < workers[least_busy].requests_in_flight)
+		{
+			least_busy = i;
+		}
+	}
+
+	auto & worker = workers[least_busy];
+
+	if (worker.requests_in_flight >= max_requests_in_flight)
+	{
+		throw std::runtime_error("ProcessPool: too many requests in flight, receive() the outputs first");
+	}
+
+	uint64_t tag = next_tag++;
+	int attempt = 0;
+
+	while (!worker.requests->try_push(input, tag))
+	{
+		if (attempt % 1024 == 1023)
+		{
+			check_workers();
+		}
+
+		wait_backoff(attempt);
+	}
+
+	worker.requests_in_flight++;
+
+	return tag;
+}
+
+pair<uint64_t, Tensor> torch::ProcessPool::receive()
+{
+	int attempt = 0;
+
+	for (;;)
+	{
+		bool any_in_flight = false;
+
+		// Starts from the worker after the last one which responded,
+		// so busy workers don't hide the others
+		for (size_t i = 0; i < workers.size(); ++i)
+		{
+			size_t worker_index = (next_response_worker + i) % workers.size();
+			auto & worker = workers[worker_index];
+
+			if (worker.requests_in_flight == 0)
+			{
+				continue;
+			}
+
+			any_in_flight = true;
+
+			Tensor output;
+			uint64_t tag;
+			uint32_t flags;
+
+			if (worker.responses->try_pop(output, tag, flags))
+			{
+				worker.requests_in_flight--;
+				next_response_worker = (worker_index + 1) % workers.size();
+
+				if (flags & SHARED_MESSAGE_ERROR)
+				{
+					throw RequestError(tag);
+				}
+
+				return std::make_pair(tag, output);
+			}
+		}
+
+		if (!any_in_flight)
+		{
+			throw std::runtime_error("ProcessPool: receive() called without requests in flight");
+		}
+
+		if (attempt % 1024 == 1023)
+		{
+			check_workers();
+		}
+
+		wait_backoff(attempt);
+	}
+}
+
+int torch::ProcessPool::workers_count() const
+{
+	return workers.size();
+}
+
+#endif
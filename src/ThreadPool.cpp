@@ -0,0 +1,331 @@
+#include "pytorch.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace
+{
+	// How many times an idle worker with the WAIT_SPIN policy
+	// looks for tasks before going to sleep
+	const int SPIN_ITERATIONS = 100000;
+
+	struct WorkerQueue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+}
+
+struct torch::ThreadPool::State
+{
+	vector<shared_ptr<WorkerQueue>> queues;
+	vector<std::thread> threads;
+
+	// Workers sleep on it when there are no tasks
+	std::mutex mutex;
+	std::condition_variable condition;
+
+	std::atomic<int64_t> pending_tasks;
+	std::atomic<uint64_t> next_queue;
+
+	// Read without the lock by the spinning workers
+	std::atomic<bool> stopping;
+
+	int threads_per_task;
+	ExecutionConfig::WaitPolicy wait_policy;
+
+	// Own deque is used as a stack (newest task first, it's likely
+	// to have its data in cache), the others are robbed from the front
+	bool pop_task(size_t own_queue, std::function<void()> & task)
+	{
+		size_t queues_count = queues.size();
+
+		for (size_t i = 0; i < queues_count; ++i)
+		{
+			auto & queue = *queues[(own_queue + i) % queues_count];
+
+			std::lock_guard<std::mutex> lock(queue.mutex);
+
+			if (queue.tasks.empty())
+			{
+				continue;
+			}
+
+			if (i == 0)
+			{
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			}
+			else
+			{
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+
+			pending_tasks--;
+
+			return true;
+		}
+
+		return false;
+	}
+
+	void run_worker(size_t index);
+};
+
+namespace
+{
+	// Pool and queue of the worker which runs on the current thread
+	thread_local torch::ThreadPool::State * current_pool = nullptr;
+	thread_local size_t current_queue = 0;
+
+	void run_task(std::function<void()> & task)
+	{
+		torch::TraceScope trace_scope("thread_pool", "task");
+
+		try
+		{
+			task();
+		}
+		catch (std::exception & exception)
+		{
+			cout << "WARNING: task of the thread pool has thrown an exception: "
+				<< exception.what() << endl;
+		}
+		catch (...)
+		{
+			cout << "WARNING: task of the thread pool has thrown an exception." << endl;
+		}
+	}
+}
+
+void torch::ThreadPool::State::run_worker(size_t index)
+{
+	current_pool = this;
+	current_queue = index;
+
+	Tracer::set_thread_name("ThreadPool worker " + std::to_string(index));
+
+#ifdef _OPENMP
+	omp_set_num_threads(threads_per_task);
+#endif
+
+	std::function<void()> task;
+
+	for (;;)
+	{
+		if (pop_task(index, task))
+		{
+			run_task(task);
+			continue;
+		}
+
+		if (wait_policy == ExecutionConfig::WAIT_SPIN)
+		{
+			for (int i = 0; i < SPIN_ITERATIONS && pending_tasks == 0 && !stopping; ++i)
+			{
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+
+		condition.wait(lock, [this] { return stopping || pending_tasks > 0; });
+
+		if (stopping)
+		{
+			return;
+		}
+	}
+}
+
+torch::ThreadPool::ThreadPool(int threads_count, int threads_per_task, ExecutionConfig::WaitPolicy wait_policy) :
+	state(make_shared<State>())
+{
+	if (threads_count <= 0)
+	{
+		threads_count = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	state->pending_tasks = 0;
+	state->next_queue = 0;
+	state->stopping = false;
+	state->threads_per_task = std::max(threads_per_task, 1);
+	state->wait_policy = wait_policy;
+
+	for (int i = 0; i < threads_count; ++i)
+	{
+		state->queues.push_back(make_shared<WorkerQueue>());
+	}
+
+	for (int i = 0; i < threads_count; ++i)
+	{
+		state->threads.push_back(std::thread(&State::run_worker, state.get(), size_t(i)));
+	}
+}
+
+torch::ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->stopping = true;
+	}
+
+	state->condition.notify_all();
+
+	for (auto & thread : state->threads)
+	{
+		thread.join();
+	}
+}
+
+torch::ThreadPool & torch::ThreadPool::global()
+{
+	static ThreadPool pool;
+
+	return pool;
+}
+
+void torch::ThreadPool::submit(std::function<void()> task)
+{
+	// Workers put their tasks into their own deques,
+	// other threads spread them among the workers
+	size_t queue_index = (current_pool == state.get()) ?
+		current_queue :
+		size_t(state->next_queue++ % state->queues.size());
+
+	auto & queue = *state->queues[queue_index];
+
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back(std::move(task));
+	}
+
+	{
+		// Taking the lock makes sure that a worker which is about
+		// to sleep sees the new task
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->pending_tasks++;
+	}
+
+	state->condition.notify_one();
+}
+
+bool torch::ThreadPool::run_pending_task()
+{
+	std::function<void()> task;
+
+	size_t own_queue = (current_pool == state.get()) ? current_queue : 0;
+
+	if (!state->pop_task(own_queue, task))
+	{
+		return false;
+	}
+
+	run_task(task);
+
+	return true;
+}
+
+int torch::ThreadPool::threads_count() const
+{
+	return int(state->threads.size());
+}
+
+struct torch::TaskGroup::State
+{
+	std::atomic<int> pending_tasks;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::exception_ptr error;
+};
+
+torch::TaskGroup::TaskGroup(ThreadPool * pool) :
+	pool(pool)
+{
+
+}
+
+torch::TaskGroup::~TaskGroup()
+{
+	try
+	{
+		wait();
+	}
+	catch (...)
+	{
+	}
+}
+
+void torch::TaskGroup::run(std::function<void()> task)
+{
+	if (pool == nullptr)
+	{
+		pool = &ThreadPool::global();
+	}
+
+	if (!state)
+	{
+		state = make_shared<State>();
+		state->pending_tasks = 0;
+	}
+
+	state->pending_tasks++;
+
+	auto group_state = state;
+
+	pool->submit([group_state, task]()
+	{
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(group_state->mutex);
+
+			if (!group_state->error)
+			{
+				group_state->error = std::current_exception();
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(group_state->mutex);
+
+		if (--group_state->pending_tasks == 0)
+		{
+			group_state->condition.notify_all();
+		}
+	});
+}
+
+void torch::TaskGroup::wait()
+{
+	if (!state)
+	{
+		return;
+	}
+
+	// Help with the pending tasks -- ours are among them
+	while (state->pending_tasks > 0 && pool->run_pending_task())
+	{
+	}
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+
+	state->condition.wait(lock, [this] { return state->pending_tasks == 0; });
+
+	if (state->error)
+	{
+		auto error = state->error;
+		state->error = nullptr;
+
+		std::rethrow_exception(error);
+	}
+}
@@ -0,0 +1,219 @@
+#include "pytorch.h"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace
+{
+	struct TraceEvent
+	{
+		const char * category;
+		string name;
+		int64_t begin;
+		int64_t end;
+	};
+
+	// Events of one thread. Only that thread appends to it, so the
+	// lock is taken by the exporter and by start() and nobody else waits.
+	struct ThreadEvents
+	{
+		std::mutex mutex;
+		int thread_id;
+		string thread_name;
+		vector<TraceEvent> events;
+	};
+
+	std::mutex threads_mutex;
+	vector<shared_ptr<ThreadEvents>> threads_events;
+
+	// Timestamps of the trace are relative to the last start()
+	std::atomic<int64_t> start_time(0);
+
+	// Kept alive by threads_events after the thread exits
+	thread_local ThreadEvents * current_thread_events = nullptr;
+
+	ThreadEvents & thread_events()
+	{
+		if (current_thread_events == nullptr)
+		{
+			auto events = make_shared<ThreadEvents>();
+
+			std::lock_guard<std::mutex> lock(threads_mutex);
+
+			events->thread_id = int(threads_events.size()) + 1;
+			threads_events.push_back(events);
+
+			current_thread_events = events.get();
+		}
+
+		return *current_thread_events;
+	}
+
+	string json_escape(const string & text)
+	{
+		std::stringstream escaped;
+
+		for (char character : text)
+		{
+			switch (character)
+			{
+			case '"': escaped << "\\\""; break;
+			case '\\': escaped << "\\\\"; break;
+			case '\n': escaped << "\\n"; break;
+			case '\t': escaped << "\\t"; break;
+			default:
+				if (static_cast<unsigned char>(character) < 0x20)
+				{
+					escaped << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(character) << std::dec;
+				}
+				else
+				{
+					escaped << character;
+				}
+			}
+		}
+
+		return escaped.str();
+	}
+
+	int process_id()
+	{
+#ifdef _WIN32
+		return _getpid();
+#else
+		return int(getpid());
+#endif
+	}
+}
+
+std::atomic<bool> torch::Tracer::enabled_flag(false);
+
+void torch::Tracer::start()
+{
+	std::lock_guard<std::mutex> lock(threads_mutex);
+
+	for (auto & events : threads_events)
+	{
+		std::lock_guard<std::mutex> events_lock(events->mutex);
+
+		events->events.clear();
+	}
+
+	start_time = now();
+	enabled_flag = true;
+}
+
+void torch::Tracer::stop()
+{
+	enabled_flag = false;
+}
+
+int64_t torch::Tracer::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void torch::Tracer::add_event(const char * category, const string & name, int64_t begin, int64_t end)
+{
+	auto & events = thread_events();
+
+	std::lock_guard<std::mutex> lock(events.mutex);
+
+	events.events.push_back({ category, name, begin, end });
+}
+
+void torch::Tracer::set_thread_name(const string & name)
+{
+	auto & events = thread_events();
+
+	std::lock_guard<std::mutex> lock(events.mutex);
+
+	events.thread_name = name;
+}
+
+string torch::Tracer::chrome_trace()
+{
+	std::stringstream trace;
+
+	// Timestamps are in microseconds, nanoseconds are kept as decimals
+	trace << std::fixed << std::setprecision(3);
+
+	trace << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+
+	int pid = process_id();
+	int64_t trace_start = start_time;
+	bool first = true;
+
+	std::lock_guard<std::mutex> lock(threads_mutex);
+
+	for (auto & events : threads_events)
+	{
+		std::lock_guard<std::mutex> events_lock(events->mutex);
+
+		if (!events->thread_name.empty())
+		{
+			trace << (first ? "\n" : ",\n")
+				<< "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid
+				<< ", \"tid\": " << events->thread_id
+				<< ", \"args\": {\"name\": \"" << json_escape(events->thread_name) << "\"}}";
+
+			first = false;
+		}
+
+		for (auto & event : events->events)
+		{
+			trace << (first ? "\n" : ",\n")
+				<< "{\"name\": \"" << json_escape(event.name)
+				<< "\", \"cat\": \"" << event.category
+				<< "\", \"ph\": \"X\", \"ts\": " << (event.begin - trace_start) / 1000.0
+				<< ", \"dur\": " << (event.end - event.begin) / 1000.0
+				<< ", \"pid\": " << pid
+				<< ", \"tid\": " << events->thread_id << "}";
+
+			first = false;
+		}
+	}
+
+	trace << "\n]}\n";
+
+	return trace.str();
+}
+
+void torch::Tracer::write_chrome_trace(const string & filename)
+{
+	std::ofstream file(filename);
+
+	file << chrome_trace();
+
+	if (!file)
+	{
+		throw std::runtime_error("write_chrome_trace(): can't write '" + filename + "'");
+	}
+}
+
+torch::TraceScope::TraceScope(const char * category, const string & name, bool enabled) :
+	category(category),
+	begin(-1)
+{
+	if (enabled && Tracer::enabled())
+	{
+		this->name = name;
+		begin = Tracer::now();
+	}
+}
+
+torch::TraceScope::~TraceScope()
+{
+	if (begin >= 0)
+	{
+		Tracer::add_event(category, name, begin, Tracer::now());
+	}
+}
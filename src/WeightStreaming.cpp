@@ -0,0 +1,248 @@
+#include "pytorch.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace
+{
+	size_t page_size()
+	{
+		static const size_t size = size_t(sysconf(_SC_PAGESIZE));
+
+		return size;
+	}
+
+	size_t round_down_to_page(size_t offset)
+	{
+		return offset / page_size() * page_size();
+	}
+
+	size_t round_up_to_page(size_t offset)
+	{
+		return (offset + page_size() - 1) / page_size() * page_size();
+	}
+
+	void write_all(int file_descriptor, const char * data, size_t bytes, const string & filename)
+	{
+		while (bytes > 0)
+		{
+			ssize_t written = write(file_descriptor, data, bytes);
+
+			if (written < 0 && errno == EINTR)
+			{
+				continue;
+			}
+
+			if (written <= 0)
+			{
+				throw std::runtime_error("stream_weights(): can't write '" + filename + "': " + strerror(errno));
+			}
+
+			data += written;
+			bytes -= size_t(written);
+		}
+	}
+}
+
+#endif
+
+torch::WeightStream::WeightStream(Tensor arena, int file_descriptor, const vector<Range> & ranges, int prefetch_modules) :
+	arena(arena),
+	arena_data(static_cast<char *>(arena.data_ptr())),
+	file_descriptor(file_descriptor),
+	ranges(ranges),
+	prefetch_modules(prefetch_modules)
+{
+	for (size_t i = 0; i < ranges.size(); ++i)
+	{
+		positions.insert(std::make_pair(ranges[i].module, i));
+	}
+
+#ifndef _WIN32
+	size_t bytes = arena.numel() * arena.type().elementSizeInBytes();
+
+	// Nothing stays in memory until the first forward pass, dirty
+	// pages have to be written before they can be dropped
+	fdatasync(file_descriptor);
+	madvise(arena_data, round_up_to_page(bytes), MADV_DONTNEED);
+
+#ifdef __linux__
+	posix_fadvise(file_descriptor, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+#endif
+}
+
+torch::WeightStream::~WeightStream()
+{
+#ifndef _WIN32
+	close(file_descriptor);
+#endif
+}
+
+void torch::WeightStream::module_started(Module * module)
+{
+	auto position = positions.find(module);
+
+	if (position == positions.end())
+	{
+		return;
+	}
+
+	// Readahead is asynchronous, the layer starts computing right away
+	size_t last = std::min(position->second + size_t(prefetch_modules), ranges.size() - 1);
+
+	for (size_t i = position->second; i <= last; ++i)
+	{
+		prefetch(i);
+	}
+}
+
+void torch::WeightStream::module_finished(Module * module)
+{
+	auto position = positions.find(module);
+
+	if (position != positions.end())
+	{
+		release(position->second);
+	}
+}
+
+void torch::WeightStream::prefetch(size_t position)
+{
+#ifndef _WIN32
+	size_t begin = round_down_to_page(ranges[position].begin);
+	size_t end = round_up_to_page(ranges[position].end);
+
+	madvise(arena_data + begin, end - begin, MADV_WILLNEED);
+#endif
+}
+
+void torch::WeightStream::release(size_t position)
+{
+#ifndef _WIN32
+	// Only the pages which don't hold weights of the neighbouring layers
+	size_t begin = round_up_to_page(ranges[position].begin);
+	size_t end = round_down_to_page(ranges[position].end);
+
+	if (begin >= end)
+	{
+		return;
+	}
+
+	// The mapping is shared, so the page cache keeps the changed pages
+	// until they are written to the file
+	madvise(arena_data + begin, end - begin, MADV_DONTNEED);
+
+#ifdef __linux__
+	posix_fadvise(file_descriptor, off_t(begin), off_t(end - begin), POSIX_FADV_DONTNEED);
+#endif
+#endif
+}
+
+void torch::Module::stream_weights(const string & filename, int prefetch_modules)
+{
+#ifdef _WIN32
+	throw std::runtime_error("stream_weights(): not supported on Windows");
+#else
+	if (!arena.defined())
+	{
+		throw std::runtime_error("stream_weights(): the weights are not packed, call pack_weights() first");
+	}
+
+	if (arena.type().is_cuda())
+	{
+		throw std::runtime_error("stream_weights(): the weights have to be on CPU");
+	}
+
+	if (prefetch_modules < 0)
+	{
+		throw std::runtime_error("stream_weights(): prefetch_modules can't be negative");
+	}
+
+	const size_t element_bytes = arena.type().elementSizeInBytes();
+	const size_t bytes = arena.numel() * element_bytes;
+
+	// The arena has the weights of a module next to each other
+	vector<WeightStream::Range> ranges;
+
+	for (auto & entry : arena_index)
+	{
+		int64_t entry_elements = 1;
+
+		for (auto size : entry.sizes)
+		{
+			entry_elements *= size;
+		}
+
+		size_t begin = size_t(entry.offset) * element_bytes;
+		size_t end = begin + size_t(entry_elements) * element_bytes;
+
+		if (!ranges.empty() && ranges.back().module == entry.module)
+		{
+			ranges.back().end = end;
+			continue;
+		}
+
+		ranges.push_back({entry.module, begin, end});
+	}
+
+	int file_descriptor = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (file_descriptor < 0)
+	{
+		throw std::runtime_error("stream_weights(): can't create '" + filename + "': " + strerror(errno));
+	}
+
+	void * address = MAP_FAILED;
+	Tensor mapped_arena;
+	WeightStream::Ptr stream;
+
+	try
+	{
+		write_all(file_descriptor, static_cast<const char *>(arena.data_ptr()), bytes, filename);
+
+		address = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0);
+
+		if (address == MAP_FAILED)
+		{
+			throw std::runtime_error("stream_weights(): can't map '" + filename + "': " + strerror(errno));
+		}
+
+		// Pages are read when the stream asks for them, not by the readahead of the kernel
+		madvise(address, bytes, MADV_RANDOM);
+
+		mapped_arena = torch::from_buffer(address, arena.type(), {arena.numel()}, {}, [bytes](void * pointer)
+		{
+			munmap(pointer, bytes);
+		});
+
+		// From here on the mapping is owned by the tensor
+		address = MAP_FAILED;
+
+		stream = std::make_shared<WeightStream>(mapped_arena, file_descriptor, ranges, prefetch_modules);
+	}
+	catch (...)
+	{
+		if (address != MAP_FAILED)
+		{
+			munmap(address, bytes);
+		}
+
+		close(file_descriptor);
+		throw;
+	}
+
+	arena = mapped_arena;
+	bind_arena_views();
+
+	weight_stream = stream;
+#endif
+}
@@ -0,0 +1,289 @@
+#include "pytorch.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <random>
+
+namespace
+{
+	// 64-bit FNV-1a
+	const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+	const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+	uint64_t hash_bytes(const char * bytes, size_t count, uint64_t hash)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			hash ^= uint8_t(bytes[i]);
+			hash *= FNV_PRIME;
+		}
+
+		return hash;
+	}
+
+	uint64_t hash_file(const string & filename, uint64_t hash)
+	{
+		std::ifstream file(filename, std::ios::binary);
+
+		if (!file)
+		{
+			throw std::runtime_error("load_weights(): can't open '" + filename + "'");
+		}
+
+		vector<char> buffer(1 << 20);
+
+		while (file)
+		{
+			file.read(buffer.data(), buffer.size());
+			hash = hash_bytes(buffer.data(), file.gcount(), hash);
+		}
+
+		return hash;
+	}
+
+	uint64_t hash_string(const string & text, uint64_t hash)
+	{
+		// Length first, so the parts can't run into each other
+		uint64_t length = text.size();
+
+		hash = hash_bytes(reinterpret_cast<const char *>(&length), sizeof(length), hash);
+
+		return hash_bytes(text.data(), text.size(), hash);
+	}
+
+	bool file_exists(const string & filename)
+	{
+		return std::ifstream(filename).good();
+	}
+
+	// Part of the hash, changed whenever the layout of the cache files changes
+	const char * CACHE_FORMAT = "typed tensors";
+
+	// Transforms can change the type of the tensors (quantization),
+	// so they are saved with their own type instead of as floats
+	const H5::PredType * hdf5_type(ScalarType scalar_type)
+	{
+		switch (scalar_type)
+		{
+		case kFloat: return &H5::PredType::NATIVE_FLOAT;
+		case kDouble: return &H5::PredType::NATIVE_DOUBLE;
+		case kByte: return &H5::PredType::NATIVE_UINT8;
+		case kChar: return &H5::PredType::NATIVE_INT8;
+		case kShort: return &H5::PredType::NATIVE_INT16;
+		case kInt: return &H5::PredType::NATIVE_INT32;
+		case kLong: return &H5::PredType::NATIVE_INT64;
+		default: return nullptr;
+		}
+	}
+
+	ScalarType scalar_type(const H5::DataSet & dataset)
+	{
+		size_t size = dataset.getDataType().getSize();
+
+		if (dataset.getTypeClass() == H5T_FLOAT)
+		{
+			return (size == 8) ? kDouble : kFloat;
+		}
+
+		bool is_signed = (dataset.getIntType().getSign() != H5T_SGN_NONE);
+
+		switch (size)
+		{
+		case 1: return is_signed ? kChar : kByte;
+		case 2: return kShort;
+		case 4: return kInt;
+		default: return kLong;
+		}
+	}
+
+	// Name of a tensor which can't be saved with its type, empty if all of them can
+	string find_unsupported_tensor(const map<string, Tensor> & dict)
+	{
+		for (auto & name_tensor_pair : dict)
+		{
+			if (hdf5_type(name_tensor_pair.second.type().scalarType()) == nullptr)
+			{
+				return name_tensor_pair.first + " (" + name_tensor_pair.second.type().toString() + ")";
+			}
+		}
+
+		return string();
+	}
+
+	// Unlike save(), every tensor keeps its type and sizes
+	void save_transformed(const string & hdf5_filename, const map<string, Tensor> & dict)
+	{
+		H5::H5File file(hdf5_filename, H5F_ACC_TRUNC);
+
+		for (auto & name_tensor_pair : dict)
+		{
+			auto tensor = name_tensor_pair.second.toBackend(Backend::CPU).contiguous();
+			auto type = hdf5_type(tensor.type().scalarType());
+
+			vector<hsize_t> dims(tensor.sizes().begin(), tensor.sizes().end());
+			H5::DataSpace space(int(dims.size()), dims.data());
+
+			H5::DataSet dataset = file.createDataSet(name_tensor_pair.first, *type, space);
+
+			dataset.write(tensor.data_ptr(), *type);
+		}
+
+		file.close();
+	}
+
+	map<string, Tensor> load_transformed(const string & hdf5_filename)
+	{
+		H5::H5File file(hdf5_filename, H5F_ACC_RDONLY);
+
+		map<string, Tensor> dict;
+
+		for (auto & tensor_name : torch::get_hdf5_file_keys(file))
+		{
+			H5::DataSet dataset = file.openDataSet(tensor_name);
+			H5::DataSpace dataspace = dataset.getSpace();
+
+			vector<hsize_t> dims(dataspace.getSimpleExtentNdims());
+			dataspace.getSimpleExtentDims(dims.data(), nullptr);
+
+			auto type = scalar_type(dataset);
+			Tensor tensor = CPU(type).tensor(vector<int64_t>(dims.begin(), dims.end()));
+
+			dataset.read(tensor.data_ptr(), *hdf5_type(type));
+
+			dict[tensor_name] = tensor;
+		}
+
+		file.close();
+
+		return dict;
+	}
+}
+
+void torch::Module::load_weights(const string & hdf5_filename,
+	const string & cache_directory,
+	const string & transform_tag,
+	WeightsTransform transform)
+{
+	// Content of the checkpoint, not its name or time,
+	// so copies of it on other machines hit the cache too
+	uint64_t hash = hash_file(hdf5_filename, FNV_OFFSET_BASIS);
+
+	hash = hash_string(tostring(), hash);
+	hash = hash_string(transform_tag, hash);
+	hash = hash_string(CACHE_FORMAT, hash);
+
+	std::stringstream cache_filename;
+
+	cache_filename << cache_directory << "/weights_" << std::hex << std::setw(16) << std::setfill('0') << hash << ".h5";
+
+	// Bound instead of copied into the tensors of the model,
+	// which may have another type and sizes before the transform
+	if (file_exists(cache_filename.str()))
+	{
+		map<string, Tensor> cached_dict;
+		bool cached = false;
+
+		// HDF5 exceptions are not derived from std::exception. A truncated
+		// or corrupt file is rebuilt and replaced like a missing one.
+		try
+		{
+			cached_dict = load_transformed(cache_filename.str());
+			cached = true;
+		}
+		catch (...)
+		{
+			cout << "WARNING: cached weights '" << cache_filename.str() << "' can't be read, "
+				<< "they are transformed again." << endl;
+		}
+
+		if (cached)
+		{
+			// The file has CPU tensors, the model keeps its backend
+			// like it does when the weights are transformed
+			Backend backend = weights_backend();
+
+			for (auto & name_tensor_pair : cached_dict)
+			{
+				if (name_tensor_pair.second.type().backend() != backend)
+				{
+					name_tensor_pair.second = name_tensor_pair.second.toBackend(backend);
+				}
+			}
+
+			bind_weights(cached_dict, false);
+
+			return;
+		}
+	}
+
+	load_weights(hdf5_filename);
+
+	if (transform)
+	{
+		transform(*this);
+		weights_updated();
+	}
+
+	map<string, Tensor> transformed_dict;
+	this->state_dict(transformed_dict);
+
+	string unsupported_tensor = find_unsupported_tensor(transformed_dict);
+
+	if (!unsupported_tensor.empty())
+	{
+		cout << "WARNING: transformed weights are not cached, the type of "
+			<< unsupported_tensor << " can't be saved." << endl;
+
+		return;
+	}
+
+	// Written under a temporary name and renamed, so other processes
+	// never read a partially written file
+	string temporary_filename = cache_filename.str() + ".tmp" + std::to_string(std::random_device()());
+
+	bool saved = false;
+
+	// HDF5 exceptions are not derived from std::exception
+	try
+	{
+		save_transformed(temporary_filename, transformed_dict);
+
+		saved = (std::rename(temporary_filename.c_str(), cache_filename.str().c_str()) == 0);
+	}
+	catch (...)
+	{
+	}
+
+	if (!saved)
+	{
+		std::remove(temporary_filename.c_str());
+
+		cout << "WARNING: transformed weights can't be cached in '" << cache_directory << "'." << endl;
+	}
+}
+
+Backend torch::Module::weights_backend()
+{
+	// Declared tensors follow cuda() and cpu() too, so
+	// they tell it before the weights are allocated
+	for (auto & path_module_pair : named_modules())
+	{
+		Module * module = path_module_pair.second;
+
+		if (module->declared_type != nullptr)
+		{
+			return module->declared_type->backend();
+		}
+
+		for (auto & name_parameter_pair : module->parameters)
+		{
+			if (name_parameter_pair.second.defined())
+			{
+				return name_parameter_pair.second.type().backend();
+			}
+		}
+	}
+
+	return Backend::CPU;
+}
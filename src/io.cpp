@@ -1,126 +1,290 @@
 #include "pytorch.h"
 
-map<string, Tensor> torch::load(string hdf5_filename)
+#include <algorithm>
+
+#include <hdf5_hl.h>
+
+namespace
 {
-	map<string, Tensor> tensor_dict;
+	// Selects the hyperslab of the tensor in the dataspace if the options
+	// have one, returns the sizes of the selected part
+	vector<int64_t> select_dataset_part(H5::DataSpace & dataspace, const string & tensor_name, const torch::LoadOptions & options)
+	{
+		int ndims = dataspace.getSimpleExtentNdims();
+		vector<hsize_t> dims_hsize_t(ndims);
 
-	// use our get_names function
-	vector<string> tensor_names = get_hdf5_file_keys(hdf5_filename);
+		dataspace.getSimpleExtentDims(dims_hsize_t.data(), NULL);
+
+		auto slice_entry = options.slices.find(tensor_name);
+
+		if (slice_entry != options.slices.end())
+		{
+			auto & slice = slice_entry->second;
+
+			if (slice.size() > size_t(ndims))
+			{
+				throw std::runtime_error("load(): slice of ('" + tensor_name + "') has more dimensions than the dataset");
+			}
+
+			vector<hsize_t> offset(ndims, 0);
+
+			for (size_t i = 0; i < slice.size(); ++i)
+			{
+				if (slice[i].first < 0 || slice[i].second < 0 ||
+					hsize_t(slice[i].first + slice[i].second) > dims_hsize_t[i])
+				{
+					throw std::runtime_error("load(): slice of ('" + tensor_name + "') is out of the dataset");
+				}
+
+				offset[i] = hsize_t(slice[i].first);
+				dims_hsize_t[i] = hsize_t(slice[i].second);
+			}
+
+			dataspace.selectHyperslab(H5S_SELECT_SET, dims_hsize_t.data(), offset.data());
+		}
+
+		return vector<int64_t>(dims_hsize_t.begin(), dims_hsize_t.end());
+	}
+
+	// Reads the part of the dataset selected in the dataspace
+	void read_dataset_part(const H5::DataSet & dataset, const H5::DataSpace & dataspace, const vector<int64_t> & sizes, float * data)
+	{
+		if (dataspace.getSelectNpoints() == dataspace.getSimpleExtentNpoints())
+		{
+			dataset.read(data, H5::PredType::NATIVE_FLOAT, dataspace, dataspace);
+			return;
+		}
+
+		vector<hsize_t> dims_hsize_t(sizes.begin(), sizes.end());
+		H5::DataSpace memory_space(int(dims_hsize_t.size()), dims_hsize_t.data());
+
+		dataset.read(data, H5::PredType::NATIVE_FLOAT, memory_space, dataspace);
+	}
+}
+
+string torch::LoadOptions::target_name(const string & checkpoint_name) const
+{
+	auto starts_with = [&checkpoint_name](const string & prefix)
+	{
+		return checkpoint_name.compare(0, prefix.size(), prefix) == 0;
+	};
+
+	if (!include_prefixes.empty() &&
+		std::none_of(include_prefixes.begin(), include_prefixes.end(), starts_with))
+	{
+		return string();
+	}
+
+	if (std::any_of(exclude_prefixes.begin(), exclude_prefixes.end(), starts_with))
+	{
+		return string();
+	}
+
+	auto rename = rename_prefixes.end();
+
+	for (auto prefix_pair = rename_prefixes.begin(); prefix_pair != rename_prefixes.end(); ++prefix_pair)
+	{
+		if (starts_with(prefix_pair->first) &&
+			(rename == rename_prefixes.end() || prefix_pair->first.size() > rename->first.size()))
+		{
+			rename = prefix_pair;
+		}
+	}
+
+	if (rename == rename_prefixes.end())
+	{
+		return checkpoint_name;
+	}
+
+	return rename->second + checkpoint_name.substr(rename->first.size());
+}
+
+H5::H5File torch::open_hdf5_image(const void * data, size_t size)
+{
+	// The library reads the memory of the caller instead of copying it
+	hid_t file_id = H5LTopen_file_image(const_cast<void *>(data), size,
+		H5LT_FILE_IMAGE_DONT_COPY | H5LT_FILE_IMAGE_DONT_RELEASE);
+
+	if (file_id < 0)
+	{
+		throw std::runtime_error("open_hdf5_image(): the buffer doesn't contain an HDF5 file");
+	}
+
+	H5::H5File file(file_id);
+
+	// The wrapper holds its own reference to the file
+	H5Idec_ref(file_id);
+
+	return file;
+}
+
+map<string, Tensor> torch::load(const string & hdf5_filename, const LoadOptions & options)
+{
+	TraceScope trace_scope("io", hdf5_filename);
 
 	H5::H5File file = H5::H5File(hdf5_filename, H5F_ACC_RDONLY);
 
-	// Array to store the shape of the current tensor
-	hsize_t * dims_hsize_t;
+	auto tensor_dict = load(file, options);
 
-	// We need this because one function can't accept hsize_t
-	vector<int64_t> dims_int;
+	file.close();
 
-	// Float buffer to intermediately store weights
-	float * float_buffer;
+	return tensor_dict;
+}
 
-	// 'Rank' of the tensor
-	int ndims;
+map<string, Tensor> torch::load(H5::H5File & file, const LoadOptions & options)
+{
+	TraceScope trace_scope("io", "load");
 
-	// Number of elements in the current tensor
-	hsize_t tensor_flattened_size;
+	map<string, Tensor> tensor_dict;
 
-	Tensor buffer_tensor;
+	// use our get_names function
+	vector<string> tensor_names = get_hdf5_file_keys(file);
 
-	for (auto tensor_name : tensor_names)
+	for (auto & tensor_name : tensor_names)
 	{
-		dims_int.clear();
+		// Datasets which are not selected are never opened
+		string result_name = options.target_name(tensor_name);
+
+		if (result_name.empty())
+		{
+			continue;
+		}
+
+		TraceScope read_scope("io_read", tensor_name);
 
 		// Open a 'dataset' which stores current tensor
 		H5::DataSet current_dataset = file.openDataSet(tensor_name);
 
 		// We can infer the sizes of a store tensor from H5::DataSpace
 		H5::DataSpace dataspace = current_dataset.getSpace();
-		ndims = dataspace.getSimpleExtentNdims();
-
-		// Get the overall number of elements -- we need this
-		// to allocate the temporary buffer
-		tensor_flattened_size = dataspace.getSimpleExtentNpoints();
 
-		// Get the shame of the tensor
-		dims_hsize_t = new hsize_t[ndims];
-		dataspace.getSimpleExtentDims(dims_hsize_t, NULL);
+		auto dims_int = select_dataset_part(dataspace, tensor_name, options);
 
-		for (int i = 0; i < ndims; ++i)
-		{
-			// Converting hsize_t to int
-			dims_int.push_back(int64_t(dims_hsize_t[i]));
-		}
-
-		// Allocate temporary float buffer
+		// Read straight into the memory of the tensor
 		// TODO: add support for other types like int
 		// and make automatic type inference
-		float_buffer = new float[tensor_flattened_size];
+		Tensor tensor = CPU(kFloat).tensor(dims_int);
+
+		read_dataset_part(current_dataset, dataspace, dims_int, tensor.data<float>());
 
-		current_dataset.read(float_buffer, H5::PredType::NATIVE_FLOAT,
-			dataspace, dataspace);
+		tensor_dict[result_name] = tensor;
+	}
+
+	return tensor_dict;
+}
 
-		buffer_tensor = CPU(kFloat).tensorFromBlob(float_buffer, dims_int);
+std::set<string> torch::load_into(const string & hdf5_filename, const map<string, Tensor> & destination,
+	const LoadOptions & options)
+{
+	TraceScope trace_scope("io", hdf5_filename);
 
-		tensor_dict[tensor_name] = buffer_tensor.type().copy(buffer_tensor);
+	H5::H5File file = H5::H5File(hdf5_filename, H5F_ACC_RDONLY);
 
-		delete[] float_buffer;
-		delete[] dims_hsize_t;
-	}
+	auto loaded_names = load_into(file, destination, options);
 
 	file.close();
 
-	return tensor_dict;
+	return loaded_names;
 }
 
-void torch::save(string hdf5_filename, map<string, Tensor> dict_to_write)
+std::set<string> torch::load_into(H5::H5File & file, const map<string, Tensor> & destination,
+	const LoadOptions & options)
 {
-	H5::H5File file = H5::H5File(hdf5_filename, H5F_ACC_TRUNC);
+	TraceScope trace_scope("io", "load_into");
+
+	std::set<string> loaded_names;
 
-	for (auto name_tensor_pair : dict_to_write)
+	for (auto & checkpoint_name : get_hdf5_file_keys(file))
 	{
-		auto tensor_to_write = name_tensor_pair.second.contiguous();
-		auto tensor_name = name_tensor_pair.first;
+		string tensor_name = options.target_name(checkpoint_name);
+		auto destination_entry = destination.find(tensor_name);
 
-		auto dims = tensor_to_write.sizes();
+		if (tensor_name.empty() || destination_entry == destination.end())
+		{
+			continue;
+		}
 
-		// The dimensionality of the tensor
-		auto ndims = tensor_to_write.ndimension();
-		auto tensor_flattened_size = tensor_to_write.numel();
-		auto tensor_to_write_flatten = tensor_to_write.view({ -1 });
-		auto tensor_to_write_flatten_accessor = tensor_to_write_flatten.accessor<float, 1>();
+		TraceScope read_scope("io_read", checkpoint_name);
 
-		float * float_buffer = new float[tensor_flattened_size];
+		// Shares the memory of the tensor of the caller
+		Tensor destination_tensor = destination_entry->second;
 
-		// Convert an array of ints into an array of hsize_t
-		auto dims_hsize_t = new hsize_t[ndims];
+		H5::DataSet current_dataset = file.openDataSet(checkpoint_name);
+		H5::DataSpace dataspace = current_dataset.getSpace();
+
+		auto dims_int = select_dataset_part(dataspace, checkpoint_name, options);
 
-		for (int i = 0; i < ndims; ++i)
+		if (!destination_tensor.sizes().equals(dims_int))
 		{
-			dims_hsize_t[i] = dims[i];
+			std::stringstream error_message;
+
+			error_message << "load_into(): tensor ('" << tensor_name << "') has size " << destination_tensor.sizes()
+				<< " but the checkpoint has " << IntList(dims_int);
+
+			throw std::runtime_error(error_message.str());
 		}
 
-		for (int i = 0; i < tensor_flattened_size; ++i)
-		{
+		// Contiguous CPU tensors are read into directly,
+		// the other ones through a temporary tensor
+		bool direct = (&destination_tensor.type() == &CPU(kFloat)) && destination_tensor.is_contiguous();
+
+		Tensor read_tensor = direct ? destination_tensor : CPU(kFloat).tensor(dims_int);
 
-			float_buffer[i] = tensor_to_write_flatten_accessor[i];
+		read_dataset_part(current_dataset, dataspace, dims_int, read_tensor.data<float>());
+
+		if (!direct)
+		{
+			destination_tensor.copy_(read_tensor);
 		}
 
-		H5::DataSpace space(ndims, dims_hsize_t);
+		loaded_names.insert(tensor_name);
+	}
+
+	return loaded_names;
+}
+
+void torch::save(const string & hdf5_filename, const map<string, Tensor> & dict_to_write)
+{
+	TraceScope trace_scope("io", hdf5_filename);
+
+	H5::H5File file = H5::H5File(hdf5_filename, H5F_ACC_TRUNC);
+
+	for (auto & name_tensor_pair : dict_to_write)
+	{
+		TraceScope write_scope("io_write", name_tensor_pair.first);
+
+		// Written straight from the memory of the tensor, so packed
+		// weights are not copied at all
+		auto tensor_to_write = name_tensor_pair.second.toBackend(Backend::CPU).contiguous();
+		auto & tensor_name = name_tensor_pair.first;
+
+		auto dims = tensor_to_write.sizes();
+
+		// The dimensionality of the tensor
+		auto ndims = tensor_to_write.ndimension();
+
+		// Convert an array of ints into an array of hsize_t
+		vector<hsize_t> dims_hsize_t(dims.begin(), dims.end());
+
+		H5::DataSpace space(ndims, dims_hsize_t.data());
 
 		H5::DataSet dataset = H5::DataSet(file.createDataSet(tensor_name,
 			H5::PredType::NATIVE_FLOAT,
 			space));
 
+		// TODO: add support for other types like int
+		if (&tensor_to_write.type() != &CPU(kFloat))
+		{
+			tensor_to_write = CPU(kFloat).copy(tensor_to_write);
+		}
 
-		dataset.write(float_buffer, H5::PredType::NATIVE_FLOAT);
-
-		delete[] float_buffer;
+		dataset.write(tensor_to_write.data<float>(), H5::PredType::NATIVE_FLOAT);
 	}
 
 	file.close();
 }
 
-vector<string> torch::get_hdf5_file_keys(string hdf5_filename)
+vector<string> torch::get_hdf5_file_keys(const string & hdf5_filename)
 {
 	// We open and close hdf5 file here. It might be an overkill
 	// as we can open the file once, read keys and read tensors outright,
@@ -130,6 +294,15 @@ vector<string> torch::get_hdf5_file_keys(string hdf5_filename)
 	// Open the file
 	H5::H5File file = H5::H5File(hdf5_filename, H5F_ACC_RDONLY);
 
+	auto names = get_hdf5_file_keys(file);
+
+	file.close();
+
+	return names;
+}
+
+vector<string> torch::get_hdf5_file_keys(H5::H5File & file)
+{
 	vector<string> names;
 
 	// Define a closure to populate our names array
@@ -146,7 +319,5 @@ vector<string> torch::get_hdf5_file_keys(string hdf5_filename)
 	// Run our closure and populate array
 	H5Literate(file.getId(), H5_INDEX_NAME, H5_ITER_INC, NULL, closure, &names);
 
-	file.close();
-
 	return names;
 }
\ No newline at end of file
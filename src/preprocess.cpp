@@ -0,0 +1,287 @@
+#include "pytorch.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PYTORCH_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+	// Source pixels and the weight of the second one for every
+	// output column (or row)
+	struct Interpolation
+	{
+		vector<int> first;
+		vector<int> second;
+		vector<float> weight;
+	};
+
+	// Same mapping as the bilinear resize of OpenCV: centers of the pixels
+	// are aligned. offset -- position of the crop in the resized image.
+	Interpolation make_interpolation(int output_size, int offset, double scale, int input_size)
+	{
+		Interpolation interpolation;
+
+		interpolation.first.resize(output_size);
+		interpolation.second.resize(output_size);
+		interpolation.weight.resize(output_size);
+
+		for (int i = 0; i < output_size; ++i)
+		{
+			double position = std::max((i + offset + 0.5) / scale - 0.5, 0.0);
+
+			int first = std::min(int(position), input_size - 1);
+			int second = std::min(first + 1, input_size - 1);
+
+			interpolation.first[i] = first;
+			interpolation.second[i] = second;
+			interpolation.weight[i] = (first == second) ? 0.0f : float(position - first);
+		}
+
+		return interpolation;
+	}
+
+	// Deinterleaves one row of the image and resizes it horizontally.
+	// Columns are given as byte offsets of the pixels.
+	void interpolate_row(const uint8_t * row,
+		const Interpolation & columns,
+		const int channel_offsets[3],
+		float * output)
+	{
+		int output_width = columns.first.size();
+
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			const uint8_t * channel_row = row + channel_offsets[channel];
+			float * channel_output = output + channel * output_width;
+
+			int x = 0;
+
+#ifdef PYTORCH_USE_SSE2
+			// SSE2 has no gather, the bytes of four columns are loaded
+			// one by one and converted and interpolated together
+			for (; x + 4 <= output_width; x += 4)
+			{
+				const int * first_offsets = columns.first.data() + x;
+				const int * second_offsets = columns.second.data() + x;
+
+				__m128 first = _mm_cvtepi32_ps(_mm_setr_epi32(channel_row[first_offsets[0]],
+					channel_row[first_offsets[1]],
+					channel_row[first_offsets[2]],
+					channel_row[first_offsets[3]]));
+
+				__m128 second = _mm_cvtepi32_ps(_mm_setr_epi32(channel_row[second_offsets[0]],
+					channel_row[second_offsets[1]],
+					channel_row[second_offsets[2]],
+					channel_row[second_offsets[3]]));
+
+				__m128 weight = _mm_loadu_ps(columns.weight.data() + x);
+
+				_mm_storeu_ps(channel_output + x, _mm_add_ps(first, _mm_mul_ps(_mm_sub_ps(second, first), weight)));
+			}
+#endif
+
+			for (; x < output_width; ++x)
+			{
+				float first = channel_row[columns.first[x]];
+				float second = channel_row[columns.second[x]];
+
+				channel_output[x] = first + (second - first) * columns.weight[x];
+			}
+		}
+	}
+
+	// Resizes vertically and normalizes:
+	// output = (top + (bottom - top) * weight) * scale + shift
+	void blend_and_normalize(const float * top,
+		const float * bottom,
+		float weight,
+		float scale,
+		float shift,
+		float * output,
+		int count)
+	{
+		int i = 0;
+
+#ifdef PYTORCH_USE_SSE2
+		__m128 weight_vector = _mm_set1_ps(weight);
+		__m128 scale_vector = _mm_set1_ps(scale);
+		__m128 shift_vector = _mm_set1_ps(shift);
+
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 top_vector = _mm_loadu_ps(top + i);
+			__m128 bottom_vector = _mm_loadu_ps(bottom + i);
+
+			__m128 value = _mm_add_ps(top_vector, _mm_mul_ps(_mm_sub_ps(bottom_vector, top_vector), weight_vector));
+
+			_mm_storeu_ps(output + i, _mm_add_ps(_mm_mul_ps(value, scale_vector), shift_vector));
+		}
+#endif
+
+		for (; i < count; ++i)
+		{
+			float value = top[i] + (bottom[i] - top[i]) * weight;
+
+			output[i] = value * scale + shift;
+		}
+	}
+}
+
+Tensor & torch::preprocess_image_out(const uint8_t * image,
+	int width,
+	int height,
+	int64_t row_stride,
+	Tensor & output,
+	const ImagePreprocessing & options)
+{
+	if (image == nullptr || width <= 0 || height <= 0)
+	{
+		throw std::runtime_error("preprocess_image(): the image is empty");
+	}
+
+	if (row_stride == 0)
+	{
+		row_stride = int64_t(width) * 3;
+	}
+
+	double scale = 1;
+	int resized_width = width;
+	int resized_height = height;
+
+	if (options.resize_to > 0)
+	{
+		scale = double(options.resize_to) / std::min(width, height);
+		resized_width = std::max(int(std::round(width * scale)), 1);
+		resized_height = std::max(int(std::round(height * scale)), 1);
+	}
+
+	int output_width = resized_width;
+	int output_height = resized_height;
+	int offset_x = 0;
+	int offset_y = 0;
+
+	if (options.crop_size > 0)
+	{
+		if (options.crop_size > resized_width || options.crop_size > resized_height)
+		{
+			throw std::runtime_error("preprocess_image(): the crop is bigger than the image");
+		}
+
+		output_width = options.crop_size;
+		output_height = options.crop_size;
+		offset_x = (resized_width - output_width) / 2;
+		offset_y = (resized_height - output_height) / 2;
+	}
+
+	int64_t plane_size = int64_t(output_width) * output_height;
+
+	if (!output.defined())
+	{
+		output = CPU(kFloat).tensor({1, 3, output_height, output_width});
+	}
+	else if (&output.type() != &CPU(kFloat) || !output.is_contiguous() || output.numel() != 3 * plane_size)
+	{
+		std::stringstream message;
+
+		message << "preprocess_image(): output has to be a contiguous CPU float tensor with 3 x "
+			<< output_height << " x " << output_width << " elements";
+
+		throw std::runtime_error(message.str());
+	}
+
+	auto columns = make_interpolation(output_width, offset_x, scale, width);
+	auto rows = make_interpolation(output_height, offset_y, scale, height);
+
+	// Byte offsets of the pixels in a row
+	for (int x = 0; x < output_width; ++x)
+	{
+		columns.first[x] *= 3;
+		columns.second[x] *= 3;
+	}
+
+	// Output is always in RGB order
+	int rgb_offsets[3] = {0, 1, 2};
+	int bgr_offsets[3] = {2, 1, 0};
+	const int * channel_offsets = (options.pixel_format == PIXEL_FORMAT_BGR) ? bgr_offsets : rgb_offsets;
+
+	// Division by 255, subtraction of mean and division by std in one step
+	float scales[3];
+	float shifts[3];
+
+	for (int channel = 0; channel < 3; ++channel)
+	{
+		scales[channel] = 1.0f / (255.0f * options.std[channel]);
+		shifts[channel] = -options.mean[channel] / options.std[channel];
+	}
+
+	// Two last source rows resized horizontally. Rows of the output need
+	// non-decreasing rows of the source, so each one is processed only once.
+	vector<float> row_buffer(2 * 3 * output_width);
+	float * buffered_rows[2] = {row_buffer.data(), row_buffer.data() + 3 * output_width};
+	int buffered_row_indices[2] = {-1, -1};
+
+	auto load_row = [&](int row, int slot_to_keep)
+	{
+		for (int slot = 0; slot < 2; ++slot)
+		{
+			if (buffered_row_indices[slot] == row)
+			{
+				return slot;
+			}
+		}
+
+		int slot;
+
+		if (slot_to_keep >= 0)
+		{
+			slot = 1 - slot_to_keep;
+		}
+		else
+		{
+			slot = (buffered_row_indices[0] <= buffered_row_indices[1]) ? 0 : 1;
+		}
+
+		interpolate_row(image + row * row_stride, columns, channel_offsets, buffered_rows[slot]);
+		buffered_row_indices[slot] = row;
+
+		return slot;
+	};
+
+	float * output_data = output.data<float>();
+
+	for (int y = 0; y < output_height; ++y)
+	{
+		int top = load_row(rows.first[y], -1);
+		int bottom = load_row(rows.second[y], top);
+
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			blend_and_normalize(buffered_rows[top] + channel * output_width,
+				buffered_rows[bottom] + channel * output_width,
+				rows.weight[y],
+				scales[channel],
+				shifts[channel],
+				output_data + channel * plane_size + int64_t(y) * output_width,
+				output_width);
+		}
+	}
+
+	return output;
+}
+
+Tensor torch::preprocess_image(const uint8_t * image,
+	int width,
+	int height,
+	int64_t row_stride,
+	const ImagePreprocessing & options)
+{
+	Tensor output;
+
+	preprocess_image_out(image, width, height, row_stride, output, options);
+
+	return output;
+}
@@ -1,5 +1,24 @@
 #include "pytorch.h"
 
+namespace
+{
+	// nullptr -- CUDA(kFloat), which isn't looked up until it's needed,
+	// so programs which use only CPU don't touch CUDA
+	std::atomic<const Type *> default_tensor_type(nullptr);
+}
+
+const Type & torch::default_type()
+{
+	const Type * type = default_tensor_type;
+
+	return type ? *type : CUDA(kFloat);
+}
+
+void torch::set_default_type(const Type & type)
+{
+	default_tensor_type = &type;
+}
+
 Tensor torch::compute_full_padding_for_dilated_conv(Tensor kernel_size, int dilation)
 {
     // Convert IntList to Tensor to be able to use element-wise operations
@@ -62,39 +81,116 @@ torch::Module::Ptr torch::resnet_conv1x1(int in_planes, int planes)
                                     1, false);
 }    
 
+int64_t torch::pooling_output_size(int64_t input_size, int kernel_size, int stride, int padding, bool ceil_mode)
+{
+    // Same formula as the one used in THNN
+    int64_t output_size;
+
+    if (ceil_mode)
+    {
+        output_size = (input_size + 2 * padding - kernel_size + stride - 1) / stride + 1;
+
+        // Ensure that the last pooling window starts inside the image
+        if ((output_size - 1) * stride >= input_size + padding)
+        {
+            --output_size;
+        }
+    }
+    else
+    {
+        output_size = (input_size + 2 * padding - kernel_size) / stride + 1;
+    }
+
+    return output_size;
+}
+
+static Tensor channel_values(float red, float green, float blue)
+{
+    auto values = CPU(kFloat).tensor({1, 3, 1, 1});
+    auto data = values.data<float>();
+
+    data[0] = red;
+    data[1] = green;
+    data[2] = blue;
+
+    return values;
+}
+
 Tensor torch::preprocess_batch(Tensor input_batch)
 {
     // Subtracts mean and divides by std.
     // Important: image should be in a 0-1 range and not in 0-255
 
-    // TODO: create a pull request to add broadcastable
-    // operations
+    // See preprocess_image() for the faster way which starts
+    // from the 8-bit image.
 
-    auto mean_value = CPU(kFloat).ones({1, 3, 1, 1});
+    // Created only once, this is called for every frame.
+    // Division by std is done as multiplication by its inverse.
+    static const Tensor mean_value = channel_values(0.485f, 0.456f, 0.406f);
+    static const Tensor std_inverse_value = channel_values(1 / 0.229f, 1 / 0.224f, 1 / 0.225f);
 
-    mean_value[0][0][0][0] = 0.485f;
-    mean_value[0][1][0][0] = 0.456f;
-    mean_value[0][2][0][0] = 0.406f;
+    return (input_batch - mean_value.expand(input_batch.sizes())) * std_inverse_value.expand(input_batch.sizes());
+}
 
-    // Broadcast the value
-    auto mean_value_broadcasted = mean_value.expand(input_batch.sizes());
+Tensor torch::from_buffer(void * data,
+                          const Type & type,
+                          IntList sizes,
+                          IntList strides,
+                          std::function<void(void *)> release)
+{
+    if (data == nullptr)
+    {
+        throw std::runtime_error("from_buffer(): data is null");
+    }
 
-    auto std_value = CPU(kFloat).ones({1, 3, 1, 1});
+    // Kernels access the elements directly, misaligned ones
+    // are slow or crash on some platforms
+    if (reinterpret_cast<uintptr_t>(data) % type.elementSizeInBytes() != 0)
+    {
+        throw std::runtime_error("from_buffer(): data is not aligned to the size of " + string(type.toString()) + " elements");
+    }
 
-    std_value[0][0][0][0] = 0.229f;
-    std_value[0][1][0][0] = 0.224f;
-    std_value[0][2][0][0] = 0.225f;
+    vector<int64_t> buffer_strides(strides.begin(), strides.end());
+
+    if (buffer_strides.empty())
+    {
+        // Contiguous
+        buffer_strides.resize(sizes.size());
 
-    auto std_value_broadcasted = std_value.expand(input_batch.sizes());
+        int64_t stride = 1;
+
+        for (int64_t i = int64_t(sizes.size()) - 1; i >= 0; --i)
+        {
+            buffer_strides[i] = stride;
+            stride *= sizes[i];
+        }
+    }
+    else if (buffer_strides.size() != sizes.size())
+    {
+        throw std::runtime_error("from_buffer(): number of strides and sizes differ");
+    }
+
+    for (auto stride : buffer_strides)
+    {
+        if (stride < 0)
+        {
+            throw std::runtime_error("from_buffer(): negative strides are not supported");
+        }
+    }
+
+    if (!release)
+    {
+        return type.tensorFromBlob(data, sizes, buffer_strides, [](void *) {});
+    }
 
-    return (input_batch - mean_value_broadcasted) / std_value_broadcasted;
+    return type.tensorFromBlob(data, sizes, buffer_strides, release);
 }
 
-void torch::inspect_checkpoint(string hdf5_filename)
+void torch::inspect_checkpoint(const string & hdf5_filename)
 {
     auto dict = load(hdf5_filename);
 
-    for (auto name_tensor_pair : dict)
+    for (auto & name_tensor_pair : dict)
     {
     cout << name_tensor_pair.first << ": " << name_tensor_pair.second.sizes() <<endl;
     }
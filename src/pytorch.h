@@ -6,10 +6,17 @@
 
 #include <sstream>
 #include <map>
+#include <stdexcept>
+#include <thread>
+#include <future>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <set>
 #include "H5Cpp.h"
 
 
-#define TENSOR_DEFAULT_TYPE CUDA(kFloat)
+#define TENSOR_DEFAULT_TYPE torch::default_type()
 
 using namespace at;
 
@@ -26,13 +33,606 @@ using std::tie;
 
 namespace torch
 {
+	// Type of the tensors of the layers which are built from now on,
+	// CUDA(kFloat) unless changed. With CPU(kFloat) models are built
+	// for CPU and don't need the GPU at all.
+	const Type & default_type();
+	void set_default_type(const Type & type);
+
 	//IO
-	map<string, Tensor> load(string hdf5_filename);
-	void save(string hdf5_filename, map<string, Tensor> dict_to_write);
-	vector<string> get_hdf5_file_keys(string hdf5_filename);
-	void inspect_checkpoint(string hdf5_filename);
 
-	class Module
+	// Selects the datasets which are read from a checkpoint. The ones
+	// which are not selected are not read at all.
+	struct LoadOptions
+	{
+		// Only names which start with one of them are read, all if empty
+		vector<string> include_prefixes;
+
+		// Names which start with one of them are skipped
+		vector<string> exclude_prefixes;
+
+		// Prefix of a name in the checkpoint -> prefix used instead of it,
+		// the longest matching one is replaced. For example
+		// {"resnet18_8s.", ""} loads the backbone of a segmentation model.
+		map<string, string> rename_prefixes;
+
+		// Name in the checkpoint -> (start, length) per dimension, only this
+		// hyperslab of the dataset is read (channel-pruned models). Missing
+		// dimensions are read whole.
+		map<string, vector<pair<int64_t, int64_t>>> slices;
+
+		// Name of the tensor after renaming, empty if it's not selected
+		string target_name(const string & checkpoint_name) const;
+	};
+
+	map<string, Tensor> load(const string & hdf5_filename, const LoadOptions & options = LoadOptions());
+	void save(const string & hdf5_filename, const map<string, Tensor> & dict_to_write);
+
+	// Reads the datasets of the file into the tensors with the same names,
+	// without allocating new ones. Returns the names which were read.
+	std::set<string> load_into(const string & hdf5_filename, const map<string, Tensor> & destination,
+		const LoadOptions & options = LoadOptions());
+	vector<string> get_hdf5_file_keys(const string & hdf5_filename);
+
+	// Opens a checkpoint which is in memory (an HDF5 file image), for example
+	// in a bundle mapped into memory. The memory is not copied, so it has to
+	// stay valid until the file is closed.
+	H5::H5File open_hdf5_image(const void * data, size_t size);
+
+	// Same as the ones above, for an open file
+	map<string, Tensor> load(H5::H5File & file, const LoadOptions & options = LoadOptions());
+	std::set<string> load_into(H5::H5File & file, const map<string, Tensor> & destination,
+		const LoadOptions & options = LoadOptions());
+	vector<string> get_hdf5_file_keys(H5::H5File & file);
+	void inspect_checkpoint(const string & hdf5_filename);
+
+	// Wraps memory owned by the caller (camera frames, shared memory and so on)
+	// as a tensor without copying it. It can be used as an input or as an output
+	// of Module::forward_out().
+	// strides -- in elements, empty for a contiguous buffer.
+	// release -- called with data once the last tensor which uses the memory
+	// is destroyed, can be empty if the caller manages the memory.
+	// data has to be aligned at least to the size of the element.
+	Tensor from_buffer(void * data,
+		const Type & type,
+		IntList sizes,
+		IntList strides = {},
+		std::function<void(void *)> release = nullptr);
+
+	// Caching allocator for CPU tensors created by the layers.
+	// Freed blocks are kept in per-thread free lists of power-of-two
+	// size classes and are handed out again on the next request of the
+	// same size class, so steady-state inference doesn't go to malloc
+	// and doesn't touch fresh pages on every frame. Blocks freed by another
+	// thread than the allocating one go to a pool shared by all threads.
+	// Attach it to a model with Module::set_allocator().
+	class CachingAllocator
+	{
+	public:
+		typedef shared_ptr<CachingAllocator> Ptr;
+
+		struct Statistics
+		{
+			// Requests served from the cache and from the system
+			int64_t hits;
+			int64_t misses;
+
+			// Bytes are counted in size classes, not requested sizes
+			int64_t bytes_in_use;
+			int64_t peak_bytes_in_use;
+			int64_t bytes_cached;
+		};
+
+		// use_huge_pages -- blocks of 2MB and more are aligned to 2MB and
+		//                   advised to be backed by transparent huge pages (Linux only)
+		// max_cached_bytes_per_thread -- freed blocks which don't fit are
+		//                   returned to the system, same limit for the shared pool
+		CachingAllocator(bool use_huge_pages = false, int64_t max_cached_bytes_per_thread = int64_t(256) << 20);
+		~CachingAllocator();
+
+		// CUDA types are not cached and are allocated in the usual way
+		Tensor tensor(const Type & type, IntList sizes);
+
+		Statistics statistics() const;
+		void reset_statistics();
+
+		// Returns the blocks cached by the calling thread and the ones
+		// freed by other threads than their allocating one to the system
+		void empty_cache();
+
+		struct State;
+
+	private:
+		shared_ptr<State> state;
+	};
+
+	// Settings of the threads which run the forward pass. The kernels of
+	// ATen are parallelized with OpenMP, so the number of threads and
+	// their placement are applied to the OpenMP team of the calling thread.
+	struct ExecutionConfig
+	{
+		typedef shared_ptr<ExecutionConfig> Ptr;
+
+		enum WaitPolicy
+		{
+			WAIT_DEFAULT,
+			// Idle threads busy-wait for new work: lowest latency,
+			// but the cores are not available to other processes
+			WAIT_SPIN,
+			// Idle threads are put to sleep right away
+			WAIT_SLEEP
+		};
+
+		// 0 -- don't change, otherwise the number of OpenMP threads.
+		// If only the affinity is given, one thread per core is used.
+		int num_threads = 0;
+
+		// Cores to run on, thread i is pinned to cpu_affinity[i % size].
+		// Empty -- don't change. Only supported on Linux.
+		vector<int> cpu_affinity;
+
+		// Threads managed by the library follow this policy. OpenMP reads
+		// its policy from OMP_WAIT_POLICY once on startup, so if it differs
+		// a warning is printed.
+		WaitPolicy wait_policy = WAIT_DEFAULT;
+
+		// Run independent branches of the network (like the downsample branch
+		// of residual blocks) concurrently on the ThreadPool of the library.
+		// Helps with small batches, when the kernels can't occupy all the cores.
+		// Applies to modules which use Module::forward_branches() -- BasicBlock
+		// and Bottleneck. The branches on the workers of the pool keep the
+		// threads_per_task of the pool and are not pinned to cpu_affinity.
+		bool concurrent_branches = false;
+	};
+
+	// Applies the execution config to the calling thread for the lifetime
+	// of the guard and restores the previous settings afterwards. Only the
+	// settings which differ are changed. Guards don't nest -- while one is
+	// active on the thread, the inner ones do nothing. This way a config
+	// given for a single call overrides the one of the model:
+	//
+	// {
+	//     torch::ExecutionGuard guard(config);
+	//     net->forward(input);
+	// }
+	class ExecutionGuard
+	{
+	public:
+		ExecutionGuard(const ExecutionConfig::Ptr & config);
+		~ExecutionGuard();
+
+		// Config of the guard which is active on the calling thread or nullptr
+		static const ExecutionConfig * active_config();
+
+		// Marks the config as active on the calling thread without applying
+		// it, so the guards of the modules do nothing there. Used by tasks which
+		// run a part of a forward pass on other threads. Returns the previous one.
+		static const ExecutionConfig * set_active_config(const ExecutionConfig * config);
+
+	private:
+		bool active;
+
+		// 0 -- the number of threads wasn't changed
+		int previous_num_threads;
+
+		// Previous affinity of each thread of the team
+		vector<vector<int>> previous_affinity;
+	};
+
+	// Pool of threads used by the library to run independent parts of the
+	// forward pass at the same time. Every worker has its own deque of tasks:
+	// tasks submitted by a worker go to its own deque, the idle workers
+	// steal tasks from the others.
+	class ThreadPool
+	{
+	public:
+		// threads_count = 0 -- one thread per core.
+		// threads_per_task -- OpenMP threads used by kernels inside the tasks,
+		//                     by default one, as the calling thread already
+		//                     uses its own OpenMP team.
+		ThreadPool(int threads_count = 0,
+			int threads_per_task = 1,
+			ExecutionConfig::WaitPolicy wait_policy = ExecutionConfig::WAIT_DEFAULT);
+		~ThreadPool();
+
+		// Pool which is used by the library, started on the first use
+		static ThreadPool & global();
+
+		// Tasks shouldn't throw, use TaskGroup to get the exceptions
+		void submit(std::function<void()> task);
+
+		// Runs one of the pending tasks on the calling thread.
+		// Returns false if there are no pending tasks.
+		bool run_pending_task();
+
+		int threads_count() const;
+
+		struct State;
+
+	private:
+		shared_ptr<State> state;
+	};
+
+	// Tasks which are waited for together:
+	//
+	// torch::TaskGroup branches;
+	// branches.run([&] { residual = downsample->forward(input); });
+	// ... do other work ...
+	// branches.wait();
+	//
+	// While waiting, the thread runs the pending tasks of the pool,
+	// so the groups can be nested without deadlocks.
+	class TaskGroup
+	{
+	public:
+		// nullptr -- the global pool
+		TaskGroup(ThreadPool * pool = nullptr);
+
+		// Waits for the tasks, exceptions are ignored
+		~TaskGroup();
+
+		void run(std::function<void()> task);
+
+		// Rethrows the first exception thrown by the tasks
+		void wait();
+
+		struct State;
+
+	private:
+		ThreadPool * pool;
+
+		// Allocated on the first run(), so a group which is
+		// not used costs nothing
+		shared_ptr<State> state;
+	};
+
+	// True if branches should be run concurrently on the calling thread,
+	// see ExecutionConfig::concurrent_branches
+	bool concurrent_branches_enabled();
+
+	// Called with the output of an asynchronous forward pass,
+	// or with the exception if it failed or was cancelled
+	typedef std::function<void(const Tensor & output, std::exception_ptr error)> ForwardCallback;
+
+	// Runs the forward passes submitted with Module::forward_async() on its
+	// own threads. Number of requests which wait to be run is limited: when
+	// the limit is reached, new requests either block the caller or are
+	// rejected with an exception.
+	class AsyncExecutor
+	{
+	public:
+		enum OverflowPolicy
+		{
+			BLOCK_WHEN_FULL,
+			REJECT_WHEN_FULL
+		};
+
+		// config -- applied to the threads of the executor
+		AsyncExecutor(int threads_count = 1,
+			int max_pending_requests = 64,
+			OverflowPolicy overflow_policy = BLOCK_WHEN_FULL,
+			ExecutionConfig::Ptr config = nullptr);
+
+		// Pending requests are cancelled, running ones are finished
+		~AsyncExecutor();
+
+		// Executor which is used by the library, started on the first use
+		static AsyncExecutor & global();
+
+		// Number of requests which wait to be run
+		int pending_requests() const;
+
+		struct Request;
+		struct State;
+
+		// Used by Module::forward_async()
+		void submit(shared_ptr<Request> request);
+
+	private:
+		shared_ptr<State> state;
+	};
+
+	// Handle of a forward pass submitted with Module::forward_async()
+	class AsyncForward
+	{
+	public:
+		AsyncForward(shared_ptr<AsyncExecutor::Request> request);
+
+		// Waits for the output, rethrows the exception of the forward pass.
+		// Throws if the request was cancelled.
+		Tensor get();
+
+		bool ready() const;
+
+		// Cancels the request if it hasn't started yet.
+		// Returns false if it's already running or done.
+		bool cancel();
+
+	private:
+		shared_ptr<AsyncExecutor::Request> request;
+		std::shared_future<Tensor> output;
+	};
+
+	class Module;
+
+	// Result of Module::analyze(): shapes, amount of work and memory of the
+	// layers of a forward pass, inferred without running any kernel
+	class ShapeAnalysis
+	{
+	public:
+		struct Layer
+		{
+			// Name of the layer in the model, like "layer1.0.conv1"
+			string path;
+			string module_name;
+			vector<int64_t> input_sizes;
+			vector<int64_t> output_sizes;
+
+			// Multiply-accumulates. Pooling and element-wise layers
+			// count one per element they read.
+			int64_t macs;
+			int64_t parameter_bytes;
+
+			// Size of the output, 0 if the layer works in-place
+			int64_t activation_bytes;
+
+			// MACs per byte of the input, the output and the parameters
+			double arithmetic_intensity() const;
+		};
+
+		vector<Layer> layers;
+
+		// Bytes of the activations which are alive at the moment
+		// and the highest value during the forward pass
+		int64_t live_bytes = 0;
+		int64_t peak_live_bytes = 0;
+
+		int64_t total_macs() const;
+		int64_t total_parameter_bytes() const;
+
+		// Table of the layers followed by the totals
+		string tostring() const;
+
+		// Used by Module::analyze_module()
+		void allocate(const vector<int64_t> & sizes);
+		void release(const vector<int64_t> & sizes);
+
+		// Adds the layer and counts its output. Layers which can work in-place
+		// (works_in_place) reuse the input if the caller allows it (in_place),
+		// the other ones allocate the output and free the input if allowed.
+		vector<int64_t> add_layer(const string & module_name,
+			int64_t parameter_bytes,
+			const string & path,
+			const vector<int64_t> & input_sizes,
+			const vector<int64_t> & output_sizes,
+			int64_t macs,
+			bool in_place,
+			bool works_in_place);
+
+		static string child_path(const string & path, const string & name);
+	};
+
+	// Timeline of forward passes of modules, of loading and saving checkpoints
+	// and of tasks run by the thread pools of the library, on all threads.
+	// It's exported in Chrome trace format, which is opened by chrome://tracing
+	// and ui.perfetto.dev. While it is stopped a traced scope costs one atomic load.
+	class Tracer
+	{
+	public:
+
+		// Events of the previous recording are dropped
+		static void start();
+		static void stop();
+
+		static bool enabled()
+		{
+			return enabled_flag.load(std::memory_order_relaxed);
+		}
+
+		// Nanoseconds of a monotonic clock
+		static int64_t now();
+
+		// Adds an event of the current thread, category has to be a string literal
+		static void add_event(const char * category, const string & name, int64_t begin, int64_t end);
+
+		// Name of the current thread shown in the timeline
+		static void set_thread_name(const string & name);
+
+		static string chrome_trace();
+		static void write_chrome_trace(const string & filename);
+
+	private:
+		static std::atomic<bool> enabled_flag;
+	};
+
+	// Adds an event which lasts from its construction to its
+	// destruction, if the tracer was enabled when it was constructed
+	class TraceScope
+	{
+	public:
+		// enabled -- false makes the scope add nothing
+		TraceScope(const char * category, const string & name, bool enabled = true);
+		~TraceScope();
+
+	private:
+		const char * category;
+		string name;
+		int64_t begin;
+	};
+
+	// Hardware counters of the CPU read around the forward pass of every module
+	// of a model, to tell memory-bound layers from compute-bound ones. Counts of
+	// a module include its submodules. Only forward passes run by the thread which
+	// called start() are counted and OpenMP threads of a layer are not, so the model
+	// is best run with one thread. Uses perf_event_open(), available only on Linux.
+	class PerfCounters
+	{
+	public:
+
+		enum Counter
+		{
+			CYCLES,
+			INSTRUCTIONS,
+			LLC_MISSES,
+			BRANCH_MISSES,
+			COUNTERS_COUNT
+		};
+
+		struct ModuleCounters
+		{
+			string path;
+			string module_name;
+			int64_t calls;
+
+			// Sums of all the calls, -1 if the CPU doesn't have the counter
+			int64_t values[COUNTERS_COUNT];
+
+			// Set if the kernel multiplexed the counters with other events
+			// during some of the calls, the counts were scaled up then
+			bool scaled;
+
+			// Instructions per cycle
+			double ipc() const;
+		};
+
+		PerfCounters(const shared_ptr<Module> & model);
+		~PerfCounters();
+
+		PerfCounters(const PerfCounters &) = delete;
+		PerfCounters & operator=(const PerfCounters &) = delete;
+
+		// Opens the counters for the calling thread, throws if they can't be opened
+		void start();
+		void stop();
+
+		// Drops the counts of the previous runs
+		void reset();
+
+		// Modules in the order of their first forward pass
+		const vector<ModuleCounters> & modules() const;
+
+		// Tree of the modules with the counts per call and the IPC
+		string tostring() const;
+
+		// Also MACs and misses per thousand MACs of one call, analysis has
+		// to be done for the input which was used by the forward passes
+		string tostring(const ShapeAnalysis & analysis) const;
+
+		// Called by ForwardScope of every module
+		void module_started(Module * module);
+		void module_finished(Module * module);
+
+	private:
+
+		shared_ptr<Module> model;
+		map<Module *, string> paths;
+
+		vector<ModuleCounters> counters;
+		map<Module *, size_t> positions;
+
+		// Values read when the modules which are running now started
+		vector<vector<int64_t>> started_values;
+		vector<bool> started_scaled;
+
+		// File descriptors of the group, the first one is the leader, -1 if not opened
+		int file_descriptors[COUNTERS_COUNT];
+
+		// Current values of the counters, -1 for the ones which are not opened.
+		// Multiplexed counters are scaled to the whole time, scaled is set then.
+		vector<int64_t> read_values(bool & scaled) const;
+		void close_counters();
+	};
+
+	// Keeps the packed weights of a model in a memory-mapped file. Weights
+	// of the next layers are read ahead while a layer runs and pages of the
+	// finished layers are dropped, so only the weights of a few layers are
+	// in memory at once. Created by Module::stream_weights().
+	class WeightStream
+	{
+	public:
+
+		typedef shared_ptr<WeightStream> Ptr;
+
+		// Bytes of the weights of one module, relative to the start of the arena
+		struct Range
+		{
+			Module * module;
+			size_t begin;
+			size_t end;
+		};
+
+		// Takes the file descriptor of the mapped file
+		WeightStream(Tensor arena, int file_descriptor, const vector<Range> & ranges, int prefetch_modules);
+		~WeightStream();
+
+		// Called by ForwardScope of every module of the model
+		void module_started(Module * module);
+		void module_finished(Module * module);
+
+	private:
+
+		// Keeps the mapping alive
+		Tensor arena;
+		char * arena_data;
+		int file_descriptor;
+
+		vector<Range> ranges;
+		map<Module *, size_t> positions;
+		int prefetch_modules;
+
+		void prefetch(size_t position);
+		void release(size_t position);
+	};
+
+	// Set up at the beginning of every forward() -- applies the settings
+	// of the module which are related to the execution of its forward pass.
+	// Entry points of a layer call each other (forward() -> forward_out()),
+	// so only the outermost scope of a module does anything, and a call is
+	// traced, counted and streamed once.
+	class ForwardScope
+	{
+	public:
+		ForwardScope(Module * module);
+		~ForwardScope();
+
+		// While set, modules which start a forward pass on this thread
+		// are appended to it (used to find the order of execution)
+		static thread_local vector<Module *> * execution_order;
+
+		// While set, counters are read around the forward pass
+		// of every module run on this thread
+		static thread_local PerfCounters * perf_counters;
+
+		// Stream of the streamed model running on this thread. Parts of its
+		// forward pass which run on other threads (concurrent branches,
+		// pipeline stages) set it there, so they prefetch and release too.
+		static WeightStream * current_stream();
+
+		// Returns the previous stream of the thread
+		static WeightStream * set_current_stream(WeightStream * stream);
+
+	private:
+		// Module of the innermost scope on this thread
+		static thread_local Module * current_module;
+		Module * previous_module;
+
+		// Scope of the same module is already open on this thread
+		bool nested;
+
+		// Constructed first of the rest, so the event covers the whole scope
+		TraceScope trace_scope;
+		ExecutionGuard execution_guard;
+		Module * module;
+
+		// Stream of the outermost streamed model running on this thread
+		static thread_local WeightStream * active_stream;
+		WeightStream * previous_stream;
+	};
+
+	// Spatial size of the output of pooling layers along one dimension
+	int64_t pooling_output_size(int64_t input_size, int kernel_size, int stride, int padding, bool ceil_mode);
+
+	class Module : public std::enable_shared_from_this<Module>
 	{
 	public:
 
@@ -50,7 +650,89 @@ namespace torch
 		// This is done to automatically handle deallocation of created
 		// module objects
 		typedef shared_ptr<Module> Ptr;
-		virtual Tensor forward(Tensor input);
+
+		// Input is taken by reference to avoid refcount
+		// traffic when tensors are passed down the module tree
+		virtual Tensor forward(const Tensor & input);
+
+		// In-place capable version of forward(). The module is allowed
+		// to overwrite the input and return it as its output (ReLU and
+		// BatchNorm2d in inference mode do so), so call it only on the
+		// tensors that you own. By default it just calls forward().
+		virtual Tensor forward_(Tensor & input);
+
+		// Runs forward() on the threads of the executor (nullptr -- the global
+		// one), so the caller can do other work in the meantime. The module
+		// has to be owned by a Module::Ptr, which is kept until it's done.
+		AsyncForward forward_async(const Tensor & input, AsyncExecutor * executor = nullptr);
+
+		// Same, but the callback is called by the executor when it's done
+		AsyncForward forward_async(const Tensor & input, ForwardCallback callback, AsyncExecutor * executor = nullptr);
+
+		// Writes the result of the forward pass into a tensor provided by the
+		// caller. An undefined output is allocated on the first call, so the
+		// same tensor can be passed on every frame of a video. If the output
+		// is defined, its type and shape must match the result, otherwise
+		// an exception is thrown. By default the result of forward() is copied,
+		// layers which can write directly into the output override it.
+		virtual Tensor & forward_out(const Tensor & input, Tensor & output);
+
+		// Allocates the output tensor if it's undefined and checks that
+		// a defined one has the requested type and shape. Used by forward_out().
+		void prepare_output(Tensor & output, const Type & type, IntList sizes);
+
+		// Allocator used for the outputs of the module, nullptr means
+		// the default allocator of ATen.
+		CachingAllocator::Ptr allocator;
+
+		// Sets the allocator for the module and all of its submodules
+		void set_allocator(CachingAllocator::Ptr allocator);
+
+		// Allocates a tensor with the allocator of the module
+		Tensor new_tensor(const Type & type, IntList sizes);
+
+		// Threads used by the forward pass of the module, nullptr
+		// means that the current settings are used.
+		ExecutionConfig::Ptr execution_config;
+
+		// Sets the execution config for the module and all of its submodules
+		void set_execution_config(ExecutionConfig::Ptr execution_config);
+
+		// Set by stream_weights(), nullptr if the weights are in memory
+		WeightStream::Ptr weight_stream;
+
+		// Deep copy of the module -- the submodules and all the tensors
+		// are copied. Tensors of the copy are allocated by the calling
+		// thread, so on NUMA systems they end up in its local memory.
+		// Every module overrides it to create a copy of its own type,
+		// the default one throws for modules derived from Module.
+		virtual Module::Ptr clone() const;
+
+		// Returns the submodule which was added with the given name
+		// or nullptr if there is no such submodule
+		Module::Ptr get_module(const string & name) const;
+
+		// The module and all of its submodules with their paths, like
+		// "layer1.0.conv1". The path of the module itself is empty.
+		vector<pair<string, Module *>> named_modules();
+
+		// Runs independent branches of forward() and returns their outputs,
+		// at the same time if concurrent branches are enabled. The first one
+		// runs on the calling thread, the others on the ThreadPool with the
+		// execution config and the weight stream of the calling thread.
+		// Branches are not detected automatically: BasicBlock and Bottleneck
+		// run their downsample branch with it, other modules run their
+		// branches one after another unless they call it.
+		vector<Tensor> forward_branches(const vector<std::function<Tensor()>> & branches);
+
+		// Same for the forward passes of submodules on their inputs
+		vector<Tensor> forward_branches(const vector<Module::Ptr> & branches, const vector<Tensor> & inputs);
+
+		// Splits the module into consecutive parts, running them one
+		// after another is the same as running the forward pass.
+		// Used to run the parts on different threads by Pipeline.
+		// Empty result means that the module can't be split.
+		virtual vector<Module::Ptr> split_stages();
 
 		// This function gets overwritten
 		// for the leafnodes like Conv2d, AvgPool2d and so on
@@ -91,12 +773,159 @@ namespace torch
 		// be increased.
 		void add(Module::Ptr module);
 
-		map<string, Tensor> state_dict(map<string, Tensor> & destination, string prefix = "");
+		map<string, Tensor> & state_dict(map<string, Tensor> & destination, const string & prefix = "");
 		template<typename Func>	void apply(Func closure);
 		void cuda();
 		void cpu();
-		void save_weights(string hdf5_filename);
-		void load_weights(string hdf5_filename);
+		void save_weights(const string & hdf5_filename);
+		void load_weights(const string & hdf5_filename, const LoadOptions & options = LoadOptions());
+
+		// Loads the weights from an open file, see open_hdf5_image()
+		void load_weights(H5::H5File & file, const LoadOptions & options = LoadOptions());
+
+		// Transform applied to a model after its weights are loaded (folding,
+		// packing, quantization). It can change only the tensors of the model,
+		// including their type and sizes.
+		typedef std::function<void(Module &)> WeightsTransform;
+
+		// Loads the weights and runs the transform on them. The result is
+		// saved in the cache directory under the hash of the checkpoint, of the
+		// architecture (tostring()) and of the transform tag, so the next load
+		// with the same ones binds the transformed weights directly, with the
+		// type and sizes they were saved with. Change the tag whenever the transform changes.
+		void load_weights(const string & hdf5_filename,
+			const string & cache_directory,
+			const string & transform_tag,
+			WeightsTransform transform);
+
+		// Replaces the parameters and buffers with the tensors of the dict
+		// instead of copying them, so the memory is shared (for example
+		// weights in shared memory used by several processes).
+		// check_types -- if false, the tensors of the dict may have another type
+		// and sizes than the ones of the model and can define undefined ones
+		// (weights saved after a transform like quantization or folding).
+		void bind_weights(const map<string, Tensor> & dict, bool check_types = true);
+
+		// Declares a parameter (buffer) without allocating it. Memory is allocated
+		// by the first load_weights() -- which takes the tensors of the checkpoint
+		// when it can, so the weights are never allocated twice -- bind_weights(),
+		// state_dict() or materialize(). Building a model costs almost nothing.
+		// fill_value -- used if the checkpoint doesn't have the tensor.
+		void declare_parameter(const string & name, IntList sizes, double fill_value = 0);
+		void declare_buffer(const string & name, IntList sizes, double fill_value = 0);
+
+		// Allocates the declared tensors of the whole model
+		void materialize();
+
+		// All tensors of this module (not of the submodules) are allocated
+		bool is_materialized() const;
+
+		// Packs all parameters and buffers of the model into one aligned
+		// contiguous tensor (the arena), the tensors of the modules become
+		// views of it. With sample_input the layers are run once and their
+		// weights are placed in the order of execution, so the weights of
+		// consecutive layers are next to each other; otherwise the order of
+		// state_dict() is used. Afterwards state_dict() uses a flat index,
+		// load_weights() reads the file straight into the arena and
+		// cuda()/cpu() move it in one transfer.
+		void pack_weights(const Tensor & sample_input = Tensor());
+
+		// Undefined if the weights are not packed
+		Tensor weights_arena() const;
+
+		// Infers the forward pass for the input sizes without running any
+		// kernel: output shape, MACs, parameter and activation bytes of every
+		// layer and the peak memory of the activations. Works on models
+		// whose weights are not allocated yet.
+		ShapeAnalysis analyze(IntList input_sizes);
+
+		// Bytes of the parameters and buffers of this module (not of the
+		// submodules), including the declared ones
+		int64_t weight_bytes() const;
+
+		// Part of analyze() implemented by the layers: adds their entries to
+		// the analysis and returns the output sizes. in_place -- the caller
+		// doesn't use the input afterwards, like with forward_(). The output
+		// is counted as allocated by the caller.
+		virtual vector<int64_t> analyze_module(const vector<int64_t> & input_sizes,
+			ShapeAnalysis & analysis,
+			const string & path,
+			bool in_place);
+
+		// Moves the packed weights (see pack_weights(), on CPU) to the file
+		// and maps it into memory. During forward() the weights of the next
+		// prefetch_modules layers with weights are read ahead and the pages
+		// of the finished layers are released, so pack the weights with a
+		// sample input to get them in the order of execution. Changes of the
+		// weights (load_weights()) are written to the file. Not supported
+		// on Windows.
+		void stream_weights(const string & filename, int prefetch_modules = 2);
+
+		// Called on the whole model after its weights were loaded, bound or
+		// moved. Layers which keep tensors derived from their weights
+		// (transformed or packed ones) drop them here.
+		virtual void weights_updated();
+
+	protected:
+
+		// Replaces the submodules and the tensors of a shallow copy
+		// of the module with their deep copies. Used by clone().
+		void clone_contents();
+
+	private:
+
+		// state_dict() helper -- the prefix buffer is shared by the whole
+		// traversal and names are appended to it instead of creating
+		// new strings for every submodule
+		void collect_state_dict(map<string, Tensor> & destination, string & prefix);
+
+		// Backend of the tensors of the model, CPU if it has none
+		Backend weights_backend();
+
+		// bind_weights() helper, returns the number of bound tensors
+		size_t bind_state_dict(const map<string, Tensor> & dict, string & prefix, bool check_types);
+
+		struct DeclaredTensor
+		{
+			vector<int64_t> sizes;
+			double fill_value;
+			bool is_buffer;
+		};
+
+		map<string, DeclaredTensor> declared_tensors;
+
+		// Type of the declared tensors, changed by cuda() and cpu()
+		const Type * declared_type = nullptr;
+
+		// Declared tensors take the tensors of the dict with the same names and
+		// sizes. Tensors of another type are converted if convert_type is set,
+		// otherwise they are left. If check_types is not set, tensors of any
+		// type and sizes are taken as they are. Names of the taken ones are put in adopted.
+		void adopt_declared_tensors(const map<string, Tensor> & dict, string & prefix,
+			bool convert_type, bool check_types, std::set<string> & adopted);
+		void set_declared_backend(Backend backend);
+
+		// Tensor of the arena, see pack_weights()
+		struct ArenaEntry
+		{
+			// Name in state_dict()
+			string name;
+
+			Module * module;
+			string local_name;
+			bool is_buffer;
+
+			int64_t offset;
+			vector<int64_t> sizes;
+		};
+
+		Tensor arena;
+		vector<ArenaEntry> arena_index;
+
+		// Makes the tensors of the modules views of the arena again
+		void bind_arena_views();
+		void move_arena(Backend backend);
+		void collect_named_modules(string & prefix, vector<pair<string, Module *>> & named_modules);
 	};
 
 	class Sequential : public Module
@@ -104,10 +933,20 @@ namespace torch
 	public:
 		Sequential();
 		~Sequential();
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
 		// Forward for sequential block makes forward pass
 		// for each submodule and passed it to the next one
-		Tensor forward(Tensor input);
+		Tensor forward(const Tensor & input);
+		Tensor forward_(Tensor & input);
+		Tensor & forward_out(const Tensor & input, Tensor & output);
 		Module::Ptr get(int i) const;
+		vector<Module::Ptr> split_stages();
+
+	private:
+
+		// Runs the first modules_count submodules
+		Tensor forward_first(const Tensor & input, size_t modules_count);
 	};
 
 	class ReLU : public Module
@@ -115,8 +954,12 @@ namespace torch
 	public:
 		ReLU();
 		~ReLU();
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
 
-		Tensor forward(Tensor input);
+		Tensor forward(const Tensor & input);
+		Tensor forward_(Tensor & input);
+		Tensor & forward_out(const Tensor & input, Tensor & output);
 		string tostring(int indentation_level = 0);
 	};
 
@@ -125,11 +968,96 @@ namespace torch
 		public:
 			CReLU();
 			~CReLU();
+			Module::Ptr clone() const;
+			vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
 
-			Tensor forward(Tensor input);
+			Tensor forward(const Tensor & input);
+			Tensor & forward_out(const Tensor & input, Tensor & output);
 			string tostring(int indentation_level = 0);
 		};
 
+	// Flattens all the dimensions except the batch one
+	class Flatten : public Module
+	{
+	public:
+		Flatten();
+		~Flatten();
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
+
+		Tensor forward(const Tensor & input);
+		string tostring(int indentation_level = 0);
+	};
+
+	enum ConvolutionAlgorithm
+	{
+		// conv2d() of ATen
+		CONV_ALGORITHM_DEFAULT,
+
+		// 1x1 convolution with unit stride as a matrix multiplication
+		CONV_ALGORITHM_POINTWISE_GEMM,
+
+		// Explicit im2col and one matrix multiplication
+		// for a block of 1, 4 or 16 images
+		CONV_ALGORITHM_IM2COL_GEMM_BLOCK_1,
+		CONV_ALGORITHM_IM2COL_GEMM_BLOCK_4,
+		CONV_ALGORITHM_IM2COL_GEMM_BLOCK_16,
+
+		// Winograd F(2x2, 3x3) for 3x3 convolutions with unit stride
+		CONV_ALGORITHM_WINOGRAD,
+
+		CONV_ALGORITHMS_COUNT
+	};
+
+	// Chooses the fastest convolution algorithm for every configuration of
+	// Conv2d and shape of the input. When tuning is enabled, the first time a
+	// layer sees a new shape all of the algorithms which can be used for it
+	// are run and the fastest one is kept. Choices are saved in a cache file,
+	// keyed by the shape of the layer and the model of the CPU, so later
+	// processes start tuned.
+	//
+	// torch::ConvolutionTuner::global().enable("conv_algorithms.txt");
+	// net->forward(warmup_input);
+	class ConvolutionTuner
+	{
+	public:
+		ConvolutionTuner();
+
+		static ConvolutionTuner & global();
+
+		// Loads the choices from the file, new ones are appended to it.
+		// Empty filename -- choices are kept only in memory.
+		void enable(const string & cache_filename = "");
+		void disable();
+		bool enabled() const;
+
+		// -1 if there is no choice for the key
+		int find(const string & key) const;
+		void insert(const string & key, int algorithm);
+
+		// Part of the keys, read from /proc/cpuinfo
+		const string & cpu_model() const;
+
+		static const char * algorithm_name(int algorithm);
+
+		// Makes every convolution use the algorithm where it's applicable,
+		// regardless of the choices (used to test the algorithms).
+		// -1 -- the choices are used again.
+		void force(int algorithm);
+		int forced() const;
+
+		// Timed runs per algorithm, the fastest one counts
+		int benchmark_iterations;
+
+	private:
+		mutable std::mutex mutex;
+		std::atomic<bool> tuning;
+		std::atomic<int> forced_algorithm;
+		string cache_filename;
+		string cpu_model_name;
+		map<string, int> choices;
+	};
+
 	class Conv2d : public Module
 	{
 	public:
@@ -161,10 +1089,43 @@ namespace torch
 			int groups = 1,
 			int bias = true); 
 		~Conv2d();
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
 		
 		string tostring(int indentation_level = 0);
-		Tensor forward(Tensor input);
+		Tensor forward(const Tensor & input);
+		Tensor & forward_out(const Tensor & input, Tensor & output);
+
+		void weights_updated();
 
+		// Runs the convolution with the given algorithm, which has to be
+		// one of applicable_algorithms() for the input
+		Tensor forward_with(const Tensor & input, int algorithm);
+		vector<int> applicable_algorithms(const Tensor & input) const;
+
+	private:
+		// Algorithm used for the last shape of the input. Layers can be run
+		// by several threads, so these are replaced with atomic_store().
+		struct AlgorithmChoice
+		{
+			vector<int64_t> input_sizes;
+			int algorithm;
+		};
+
+		shared_ptr<const AlgorithmChoice> algorithm_choice;
+		shared_ptr<const Tensor> winograd_weight;
+
+		int select_algorithm(const Tensor & input);
+		string tuner_key(const Tensor & input) const;
+		int tune(const Tensor & input);
+
+		// 1x1 convolution with unit stride and without padding -- a matrix
+		// multiplication per image, on any backend
+		bool is_pointwise(const Tensor & input) const;
+
+		void forward_pointwise(const Tensor & input, Tensor & output);
+		Tensor forward_im2col(const Tensor & input, int64_t images_per_gemm);
+		Tensor forward_winograd(const Tensor & input);
 	};
 
 	class BatchNorm2d : public Module
@@ -183,9 +1144,12 @@ namespace torch
 			bool affine = true,
 			bool training = false);
 		~BatchNorm2d();
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
 
 		string tostring(int indentation_level = 0);
-		Tensor forward(Tensor input);
+		Tensor forward(const Tensor & input);
+		Tensor forward_(Tensor & input);
 	};
 
 	class MaxPool2d : public Module
@@ -210,8 +1174,11 @@ namespace torch
 			int padding_height = 0,
 			bool ceil_mode = false);
 		~MaxPool2d();
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
 		string tostring(int indentation_level = 0);
-		Tensor forward(Tensor input);
+		Tensor forward(const Tensor & input);
+		Tensor & forward_out(const Tensor & input, Tensor & output);
 	};
 
 	class AvgPool2d: public Module
@@ -236,7 +1203,9 @@ namespace torch
 			bool ceil_mode=false,
 			bool count_include_pad=true);
 		~AvgPool2d();
-		Tensor forward(Tensor input);
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
+		Tensor forward(const Tensor & input);
 		string tostring(int indentation_level = 0);
 
 	};
@@ -253,11 +1222,278 @@ namespace torch
 			int out_features,
 			bool bias = true);
 		~Linear();
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
 
 		string tostring(int indentation_level = 0);
-		Tensor forward(Tensor input);
+		Tensor forward(const Tensor & input);
+		Tensor & forward_out(const Tensor & input, Tensor & output);
+	};
+
+	// Splits the batch into shards along the first dimension and runs them
+	// in parallel on groups of cores -- one group per NUMA node by default.
+	// Each group has its own replica of the wrapped module with weights in
+	// the memory local to the node. Outputs are concatenated in order.
+	// Only CPU tensors are split, CUDA ones go directly to the module.
+	class DataParallel : public Module
+	{
+	public:
+		Module::Ptr module;
+
+		// Each element of core_groups is the list of cores of one group.
+		// If empty, groups are created from the NUMA nodes of the system.
+		DataParallel(Module::Ptr module, vector<vector<int>> core_groups = {});
+		~DataParallel();
+		Module::Ptr clone() const;
+
+		Tensor forward(const Tensor & input);
+
+		// Replicas are created on the first forward pass. Call this after
+		// changing the weights of the module to update them.
+		void replicate();
+
+		// Lists of cores of the NUMA nodes of the system. If the topology
+		// can't be read, all the cores are returned as one node.
+		static vector<vector<int>> numa_nodes();
+
+		struct Worker;
+
+	private:
+		vector<vector<int>> core_groups;
+		vector<shared_ptr<Worker>> workers;
+		bool replicated;
+	};
+
+	// Runs the stages of a model on separate threads connected with bounded
+	// queues. While one stage processes a frame, the previous stage already
+	// works on the next one, which increases the number of frames processed
+	// per second. Number of frames inside the pipeline is bounded by the
+	// capacity of the queues, so is the latency of a frame.
+	//
+	// torch::Pipeline pipeline(net);
+	// pipeline.push(frame); ... auto prediction = pipeline.pop();
+	class Pipeline
+	{
+	public:
+		// Stages are run one after another for each input. Each of them can
+		// be given its own execution config to split the cores among them.
+		// Without configs the cores are split evenly and every stage is
+		// pinned to its own cores, missing configs of a shorter list are
+		// left empty (the stage uses the current settings).
+		Pipeline(vector<Module::Ptr> stages,
+			vector<ExecutionConfig::Ptr> stage_configs = {},
+			int queue_capacity = 2);
+
+		// Uses Module::split_stages() of the model. If the model streams its
+		// weights, the stages prefetch and release them on their threads.
+		Pipeline(Module::Ptr model,
+			vector<ExecutionConfig::Ptr> stage_configs = {},
+			int queue_capacity = 2);
+
+		~Pipeline();
+
+		// Blocks while the first queue is full
+		void push(const Tensor & input);
+
+		// Blocks until the next result is ready, results are returned
+		// in the order of push(). Exceptions thrown by the stages are
+		// rethrown here.
+		Tensor pop();
+
+		int stages_count() const;
+
+		struct Queue;
+
+	private:
+		void start(vector<ExecutionConfig::Ptr> stage_configs, int queue_capacity);
+
+		vector<Module::Ptr> stages;
+		WeightStream::Ptr weight_stream;
+
+		// stages.size() + 1 queues, stage i reads from queue i
+		// and writes to queue i + 1
+		vector<shared_ptr<Queue>> queues;
+		vector<std::thread> threads;
+	};
+
+	// Serves requests with the current version of a model and replaces it with
+	// a new one without pausing. New checkpoints are loaded on a background
+	// thread and swapped in atomically. Requests which hold the old version
+	// finish with it, its weights are freed when the last of them is done.
+	//
+	// torch::ModelHandle handle([] { return torch::resnet50_imagenet(); }, "v1.h5");
+	// auto output = handle.get()->forward(input);
+	// handle.reload("v2.h5");
+	class ModelHandle
+	{
+	public:
+		typedef std::function<Module::Ptr()> Factory;
+
+		// Run on the loaded model before it's swapped in (fusion, packing and
+		// so on), returns the model to be used
+		typedef std::function<Module::Ptr(Module::Ptr)> Transform;
+
+		// The first version is loaded right away
+		ModelHandle(Factory model_factory, const string & hdf5_filename, Transform transform = nullptr);
+
+		// Waits for the reload in progress
+		~ModelHandle();
+
+		// Current version. Keep the pointer for the whole request,
+		// so all of it is done with the same version.
+		Module::Ptr get() const;
+
+		// Number of the current version, starting from 1
+		uint64_t version() const;
+
+		// Starts loading the checkpoint in the background. Returned future is
+		// ready once the new version is swapped in. If loading fails it
+		// rethrows the error and the current version stays. Reloads are done
+		// one after another in the order of the calls.
+		std::shared_future<void> reload(const string & hdf5_filename);
+
+	private:
+		Module::Ptr load(const string & hdf5_filename);
+
+		Factory model_factory;
+		Transform transform;
+
+		// Accessed only through std::atomic_load()/std::atomic_store()
+		Module::Ptr model;
+		std::atomic<uint64_t> current_version;
+
+		std::mutex reload_mutex;
+		std::shared_future<void> last_reload;
 	};
 
+#ifndef _WIN32
+
+	// Multi-process inference. Processes share the weights and exchange
+	// tensors through shared memory, so there is neither a copy of the weights
+	// per process nor serialization of the tensors.
+
+	// Puts float CPU tensors into a shared memory segment. With an empty name
+	// the memory is anonymous and is inherited only by the child processes
+	// created by fork() after this call, otherwise the segment can be opened
+	// by any process with open_shared_weights() until remove_shared_weights().
+	// Returned tensors point into the segment, which is read-only.
+	map<string, Tensor> create_shared_weights(const map<string, Tensor> & dict, const string & name = "");
+	map<string, Tensor> open_shared_weights(const string & name);
+	void remove_shared_weights(const string & name);
+
+	// Flags of the messages of SharedTensorQueue
+	enum SharedMessageFlags
+	{
+		SHARED_MESSAGE_ERROR = 1,
+		SHARED_MESSAGE_STOP = 2,
+		SHARED_MESSAGE_START = 4
+	};
+
+	// Lock-free ring buffer of float CPU tensors in shared memory, for one
+	// producer process and one consumer process. Tensors are copied into
+	// preallocated slots, each of them can hold up to max_tensor_elements.
+	class SharedTensorQueue
+	{
+	public:
+		typedef shared_ptr<SharedTensorQueue> Ptr;
+
+		static const int MAX_DIMS = 8;
+
+		// Creates a queue. With an empty name the memory is anonymous and the
+		// queue can only be shared with the child processes created by fork().
+		// Otherwise the name is removed when the creator destroys the queue,
+		// processes which have it opened can still use it.
+		SharedTensorQueue(int capacity, int64_t max_tensor_elements, const string & name = "");
+
+		// Opens a queue created by another process
+		SharedTensorQueue(const string & name);
+
+		~SharedTensorQueue();
+
+		// Return false if the queue is full (empty)
+		bool try_push(const Tensor & tensor, uint64_t tag, uint32_t flags = 0);
+		bool try_pop(Tensor & tensor, uint64_t & tag, uint32_t & flags);
+
+		// Wait while the queue is full (empty). The tensor given to pop()
+		// is reused if it has the right size.
+		void push(const Tensor & tensor, uint64_t tag, uint32_t flags = 0);
+		void pop(Tensor & tensor, uint64_t & tag, uint32_t & flags);
+
+		struct Header;
+
+	private:
+		Header * header;
+		size_t mapped_bytes;
+		string name;
+		bool owner;
+
+		char * slot(uint64_t index) const;
+	};
+
+	// Dispatcher of requests to a pool of worker processes. The weights are
+	// loaded once into shared memory and every worker binds them read-only,
+	// each worker has its own pair of request and response queues.
+	// Workers are started with fork() before the weights are loaded, still
+	// create the pool before running anything multithreaded in this process.
+	// The pool itself should be used by one thread.
+	class ProcessPool
+	{
+	public:
+		// Thrown by receive() for a request which failed in the worker
+		class RequestError : public std::runtime_error
+		{
+		public:
+			RequestError(uint64_t tag);
+
+			uint64_t tag;
+		};
+
+		// model_factory is called in every worker to build the model, with
+		// CPU(kFloat) as the default type. Throws if a worker can't build it.
+		ProcessPool(std::function<Module::Ptr()> model_factory,
+			const string & hdf5_filename,
+			int workers_count,
+			int queue_capacity = 4,
+			int64_t max_tensor_elements = int64_t(1) << 22);
+
+		// Stops the workers and waits for them
+		~ProcessPool();
+
+		// Sends the input to the least busy worker, returns the tag of the request
+		uint64_t submit(const Tensor & input);
+
+		// Waits for the output of any submitted request. A request which
+		// failed in the worker is reported with RequestError.
+		pair<uint64_t, Tensor> receive();
+
+		int workers_count() const;
+
+	private:
+		struct Worker
+		{
+			int process_id;
+			int requests_in_flight;
+			SharedTensorQueue::Ptr requests;
+			SharedTensorQueue::Ptr responses;
+		};
+
+		// Throws if a worker has exited
+		void check_workers();
+		void stop_workers();
+		void wait_for_workers_start();
+
+		map<string, Tensor> weights;
+		vector<Worker> workers;
+
+		// Requests which don't fit in the queues of a worker
+		// would block it and the dispatcher forever
+		int max_requests_in_flight;
+		uint64_t next_tag;
+		size_t next_response_worker;
+	};
+
+#endif
+
 	class BasicBlock : public Module
 	{
 	public:
@@ -273,7 +1509,9 @@ namespace torch
 
 		BasicBlock(int inplanes, int planes, int stride = 1, int dilation = 1, Module::Ptr downsample = nullptr);
 		~BasicBlock();
-		Tensor forward(Tensor input);
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
+		Tensor forward(const Tensor & input);
 	};
 
 	class Bottleneck : public Module
@@ -293,8 +1531,10 @@ namespace torch
 
 		Bottleneck(int inplanes, int planes, int stride = 1, int dilation = 1, Module::Ptr downsample = nullptr);
 		~Bottleneck();
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
 
-		Tensor forward(Tensor input);
+		Tensor forward(const Tensor & input);
 	};
 
 	Module::Ptr resnet_base_conv7x7();
@@ -335,7 +1575,17 @@ namespace torch
 			bool remove_avg_pool = false,
 			int output_stride = 32);
 		~ResNet();
-		Tensor forward(Tensor input);
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
+		Tensor forward(const Tensor & input);
+		Tensor & forward_out(const Tensor & input, Tensor & output);
+
+		// Everything up to the last (fc) layer
+		Tensor forward_features(const Tensor & input);
+
+		// Stem (conv1, bn1, relu, maxpool), layer1..layer4 and
+		// the head (avgpool and fc)
+		vector<Module::Ptr> split_stages();
 		Module::Ptr make_layer(int planes, int blocks, int stride);
 	};
 
@@ -351,6 +1601,49 @@ namespace torch
 	Tensor preprocess_batch(Tensor input_batch);
 	Tensor convert_image_to_batch(Tensor input_img);
 
+	// Order of the channels of interleaved 8-bit images
+	enum PixelFormat
+	{
+		PIXEL_FORMAT_RGB,
+		PIXEL_FORMAT_BGR
+	};
+
+	struct ImagePreprocessing
+	{
+		PixelFormat pixel_format = PIXEL_FORMAT_RGB;
+
+		// Bilinear resize so that the smaller side is equal to resize_to,
+		// 0 -- keep the size of the image
+		int resize_to = 0;
+
+		// Square center crop of the (resized) image, 0 -- no crop
+		int crop_size = 0;
+
+		// Imagenet values for 0-1 images, in RGB order
+		float mean[3] = {0.485f, 0.456f, 0.406f};
+		float std[3] = {0.229f, 0.224f, 0.225f};
+	};
+
+	// Converts an interleaved height x width x 3 8-bit image (for example the
+	// data of an OpenCV Mat) into a normalized 3 x H x W float image in one pass.
+	// Does the same as convert_image_to_batch() and preprocess_batch() together,
+	// with the resize and the crop done on the fly.
+	// row_stride -- distance between the rows in bytes, 0 -- 3 * width.
+	// output -- contiguous CPU float tensor with 3 * H * W elements (for example
+	// one image of a batch) or undefined, then a 1 x 3 x H x W tensor is allocated.
+	Tensor & preprocess_image_out(const uint8_t * image,
+		int width,
+		int height,
+		int64_t row_stride,
+		Tensor & output,
+		const ImagePreprocessing & options = ImagePreprocessing());
+
+	Tensor preprocess_image(const uint8_t * image,
+		int width,
+		int height,
+		int64_t row_stride = 0,
+		const ImagePreprocessing & options = ImagePreprocessing());
+
 	//network architecture
 	Module::Ptr resnet18(int num_classes, bool fully_conv, int output_stride, bool remove_avg_pool);
 	Module::Ptr resnet34(int num_classes, bool fully_conv, int output_stride, bool remove_avg_pool);
@@ -368,8 +1661,10 @@ namespace torch
 
 		Resnet18_8s(int num_classes = 21);
 		~Resnet18_8s();
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
 
-		Tensor forward(Tensor input);
+		Tensor forward(const Tensor & input);
 	};
 
 	class Resnet34_8s : public Module
@@ -380,8 +1675,10 @@ namespace torch
 
 		Resnet34_8s(int num_classes = 21);
 		~Resnet34_8s();
+		Module::Ptr clone() const;
+		vector<int64_t> analyze_module(const vector<int64_t> & input_sizes, ShapeAnalysis & analysis, const string & path, bool in_place);
 
-		Tensor forward(Tensor input);
+		Tensor forward(const Tensor & input);
 	};
 
 	// Maybe add new options like add_softmax?